@@ -138,7 +138,7 @@ OfxStatus VtkEffect::Cook(OfxMeshEffectHandle instance) {
 
     // do the job, VTK
     auto t_cook_before_vtk_cook = std::chrono::system_clock::now();
-    OfxStatus cook_status = vtkCook(*vtk_main_input, *vtk_main_output, vtk_inputs);
+    OfxStatus cook_status = vtkCookInstance(instance, *vtk_main_input, *vtk_main_output, vtk_inputs);
     auto t_cook_after_vtk_cook = std::chrono::system_clock::now();
 
     if (cook_status != kOfxStatOK) {
@@ -228,6 +228,11 @@ bool VtkEffect::vtkIsIdentity(OfxParamSetHandle parameters) {
     return false;
 }
 
+OfxStatus VtkEffect::vtkCookInstance(OfxMeshEffectHandle instance, VtkEffectInput &main_input,
+                                     VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs) {
+    return vtkCook(main_input, main_output, extra_inputs);
+}
+
 VtkEffectInputDef* VtkEffect::vtkAddInput(const char *name, bool is_output) {
     VtkEffectInputDef *ptr = new VtkEffectInputDef(name, is_output);
     input_definitions.emplace_back(ptr);
@@ -37,6 +37,13 @@ protected:
 
     virtual OfxStatus vtkDescribe(OfxParamSetHandle parameters, VtkEffectInputDef &input_mesh, VtkEffectInputDef &output_mesh) = 0;
     virtual OfxStatus vtkCook(VtkEffectInput &main_input, VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs) = 0;
+
+    /* Called by Cook(), by default this just calls vtkCook(). Effects which keep state between cooks
+     * can override this to look up the state of the instance (note that the host may cook several
+     * instances concurrently).
+     * */
+    virtual OfxStatus vtkCookInstance(OfxMeshEffectHandle instance, VtkEffectInput &main_input,
+                                      VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs);
     VtkEffectInputDef* vtkAddInput(const char *name, bool is_output=false);
     virtual bool vtkIsIdentity(OfxParamSetHandle parameters);
 
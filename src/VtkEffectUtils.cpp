@@ -27,6 +27,7 @@ THE SOFTWARE.
 #include <vtkCellArrayIterator.h>
 #include <vtkUnsignedCharArray.h>
 #include <vtkFloatArray.h>
+#include <vtkIntArray.h>
 #include <vtkDataArray.h>
 #include <vtkPointData.h>
 #include <cassert>
@@ -326,6 +327,22 @@ void mfx_mesh_to_vtkpolydata(VtkEffectInput &vtk_input, MfxMesh &input_mesh) {
     }
 }
 
+/* Let a point attribute of the output mesh use data of the VTK array directly, without copying.
+ * This must be called before output_mesh.Allocate().
+ * */
+template <typename ArrayType>
+static void forward_point_attribute(MfxMesh &output_mesh, const char *name, ArrayType *array,
+                                    MfxAttributeType type, MfxAttributeSemantic semantic=MfxAttributeSemantic::None) {
+    printf("vtkpolydata_to_mfx_mesh forwarding attribute %s\n", name);
+    auto attrib = output_mesh.AddPointAttribute(name, array->GetNumberOfComponents(), type, semantic);
+    MfxAttributeProps attrib_props;
+    attrib.FetchProperties(attrib_props);
+    attrib_props.isOwner = false;
+    attrib_props.data = reinterpret_cast<char*>(array->GetPointer(0));
+    attrib_props.stride = array->GetNumberOfComponents()*sizeof(typename ArrayType::ValueType);
+    attrib.SetProperties(attrib_props);
+}
+
 // pre: no lines/polys
 static void vtkpolydata_to_mfx_mesh_pointcloud(MfxMesh &output_mesh, vtkPolyData *vtk_output_polydata) {
     auto attrib_point_position = output_mesh.GetPointAttribute(kOfxMeshAttribPointPosition);
@@ -360,6 +377,28 @@ static void vtkpolydata_to_mfx_mesh_pointcloud(MfxMesh &output_mesh, vtkPolyData
     attrib_face_counts_props.isOwner = false;
     attrib_face_counts_props.data = nullptr;
 
+    // handle point attributes - there are no corners, so colors, UVs and normals go to points as well
+    auto point_data = vtk_output_polydata->GetPointData();
+    for (int k = 0; k < 4 && point_count > 0; k++) {
+        char name[32];
+        sprintf(name, "color%d", k);
+        if (auto array = vtkUnsignedCharArray::SafeDownCast(point_data->GetArray(name))) {
+            forward_point_attribute(output_mesh, name, array, MfxAttributeType::UByte, MfxAttributeSemantic::Color);
+        }
+        sprintf(name, "uv%d", k);
+        if (auto array = vtkFloatArray::SafeDownCast(point_data->GetArray(name))) {
+            forward_point_attribute(output_mesh, name, array, MfxAttributeType::Float, MfxAttributeSemantic::TextureCoordinate);
+        }
+        sprintf(name, "normal%d", k);
+        if (auto array = vtkFloatArray::SafeDownCast(point_data->GetArray(name))) {
+            forward_point_attribute(output_mesh, name, array, MfxAttributeType::Float, MfxAttributeSemantic::Normal);
+        }
+        sprintf(name, "label%d", k);
+        if (auto array = vtkIntArray::SafeDownCast(point_data->GetArray(name))) {
+            forward_point_attribute(output_mesh, name, array, MfxAttributeType::Int);
+        }
+    }
+
     attrib_point_position.SetProperties(attrib_point_position_props);
     attrib_vertex_point.SetProperties(attrib_vertex_point_props);
     attrib_face_counts.SetProperties(attrib_face_counts_props);
@@ -421,7 +460,9 @@ static void vtkpolydata_to_mfx_mesh_poly(MfxMesh &output_mesh, vtkPolyData *vtk_
     int vertex_count = vtk_output_polydata->GetPolys()->GetConnectivityArray()->GetNumberOfValues();
     int face_count = vtk_output_polydata->GetPolys()->GetNumberOfCells();
     int no_loose_edge = 1;
-    int constant_face_count = (vtk_output_polydata->GetPolys()->GetMaxCellSize() == 3) ? 3 : -1;
+    // faces have constant size iff all of them are as large as the largest one (eg. all triangles or all quads)
+    int max_face_size = vtk_output_polydata->GetPolys()->GetMaxCellSize();
+    int constant_face_count = (face_count > 0 && vertex_count == max_face_size * face_count) ? max_face_size : -1;
     auto t1 = std::chrono::system_clock::now();
 
     printf("vtkpolydata_to_mfx_mesh forwarding points\n");
@@ -468,6 +509,16 @@ static void vtkpolydata_to_mfx_mesh_poly(MfxMesh &output_mesh, vtkPolyData *vtk_
         }
     }
 
+    // handle integer point attributes (labels) - these are per-point, so we can forward them
+    for (int k = 0; k < 4; k++) {
+        char name[32];
+        sprintf(name, "label%d", k);
+        auto array = vtkIntArray::SafeDownCast(vtk_output_polydata->GetPointData()->GetArray(name));
+        if (array != nullptr) {
+            forward_point_attribute(output_mesh, name, array, MfxAttributeType::Int);
+        }
+    }
+
     attrib_point_position.SetProperties(attrib_point_position_props);
     attrib_vertex_point.SetProperties(attrib_vertex_point_props);
     attrib_face_counts.SetProperties(attrib_face_counts_props);
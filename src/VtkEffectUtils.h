@@ -24,6 +24,18 @@ THE SOFTWARE.
 #pragma once
 
 #include "VtkEffect.h"
+#include <vtkCellArray.h>
 
 void mfx_mesh_to_vtkpolydata(VtkEffectInput &vtk_input, MfxMesh &input_mesh);
 void vtkpolydata_to_mfx_mesh(VtkEffectInput &vtk_input, MfxMesh &output_mesh);
+
+/* Call f(offsets, connectivity) with raw pointers into the cell array, whatever its storage is.
+ * */
+template <typename Functor>
+static void visit_cell_array(vtkCellArray *cells, Functor &&f) {
+    if (cells->IsStorage64Bit()) {
+        f(cells->GetOffsetsArray64()->GetPointer(0), cells->GetConnectivityArray64()->GetPointer(0));
+    } else {
+        f(cells->GetOffsetsArray32()->GetPointer(0), cells->GetConnectivityArray32()->GetPointer(0));
+    }
+}
@@ -0,0 +1,167 @@
+/*
+MfxVTK Open Mesh Effect plug-in
+Copyright (c) 2020 Tomas Karabela
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*
+ * Benchmark of serial and parallel graph distance (VtkDistanceAlongSurfaceEffect::compute_distance_sparse()
+ * and compute_distance_parallel()) on a jittered grid mesh, for different numbers of sources,
+ * with and without distance bound. Checks that both give the same distances.
+ *
+ * Usage: bench_distance_along_surface [grid size, default 1000 (1M points)]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <vtkPolyData.h>
+#include <vtkPoints.h>
+#include <vtkCellArray.h>
+#include <vtkMath.h>
+
+#include "effects/VtkDistanceAlongSurfaceEffect.h"
+#include "mfx_vtk_utils.h"
+
+using SurfaceGraph = VtkDistanceAlongSurfaceEffect::SurfaceGraph;
+
+static vtkSmartPointer<vtkPolyData> make_grid_mesh(int grid_size) {
+    const int n = grid_size * grid_size;
+    auto random_generator = PcgRandom(1);
+
+    auto points = vtkSmartPointer<vtkPoints>::New();
+    points->SetDataTypeToFloat();
+    points->SetNumberOfPoints(n);
+    for (int j = 0; j < grid_size; j++) {
+        for (int i = 0; i < grid_size; i++) {
+            points->SetPoint(j*grid_size + i, i + 0.3*(random_generator.NextValue() - 0.5),
+                             j + 0.3*(random_generator.NextValue() - 0.5), 0.0);
+        }
+    }
+
+    // two triangles per grid cell
+    const int triangle_count = 2 * (grid_size - 1) * (grid_size - 1);
+    auto offsets = vtkSmartPointer<vtkTypeInt32Array>::New();
+    auto connectivity = vtkSmartPointer<vtkTypeInt32Array>::New();
+    offsets->SetNumberOfValues(triangle_count + 1);
+    connectivity->SetNumberOfValues(3 * triangle_count);
+    int t = 0;
+    for (int j = 0; j + 1 < grid_size; j++) {
+        for (int i = 0; i + 1 < grid_size; i++) {
+            int a = j*grid_size + i, b = a + 1, c = a + grid_size, d = c + 1;
+            const int triangles[2][3] = {{a, b, d}, {a, d, c}};
+            for (auto &triangle : triangles) {
+                offsets->SetValue(t, 3*t);
+                for (int k = 0; k < 3; k++) {
+                    connectivity->SetValue(3*t + k, triangle[k]);
+                }
+                t++;
+            }
+        }
+    }
+    offsets->SetValue(triangle_count, 3*triangle_count);
+
+    auto polys = vtkSmartPointer<vtkCellArray>::New();
+    polys->SetData(offsets, connectivity);
+
+    auto mesh = vtkSmartPointer<vtkPolyData>::New();
+    mesh->SetPoints(points);
+    mesh->SetPolys(polys);
+    return mesh;
+}
+
+static int dt(std::chrono::system_clock::time_point t1, std::chrono::system_clock::time_point t2) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
+}
+
+/* Returns number of points (up to max_distance) where serial and parallel distance differ.
+ * */
+static int run_case(const SurfaceGraph &graph, int source_count, float max_distance) {
+    const int n = graph.offsets.size() - 1;
+
+    // sources are distinct random points
+    std::vector<int> source_points;
+    std::vector<char> is_source(n, 0);
+    auto random_generator = PcgRandom(source_count);
+    while ((int)source_points.size() < source_count) {
+        int u = random_generator.NextUInt() % n;
+        if (!is_source[u]) {
+            is_source[u] = 1;
+            source_points.push_back(u);
+        }
+    }
+
+    // serial, same as VtkDistanceAlongSurfaceEffect::compute_distance() does for smaller meshes
+    auto t0 = std::chrono::system_clock::now();
+    VtkDistanceAlongSurfaceEffect::DistanceWorkspace workspace;
+    std::vector<VtkDistanceAlongSurfaceEffect::PointDistance> result;
+    VtkDistanceAlongSurfaceEffect::compute_distance_sparse(graph, source_count, source_points.data(), max_distance,
+                                                           workspace, result);
+    std::vector<float> serial_distance(n, vtkMath::Inf());
+    for (auto &pd : result) {
+        serial_distance[pd.id] = pd.distance;
+    }
+
+    auto t1 = std::chrono::system_clock::now();
+    std::vector<float> parallel_distance(n);
+    VtkDistanceAlongSurfaceEffect::compute_distance_parallel(graph, source_count, source_points.data(),
+                                                             parallel_distance.data(), max_distance);
+    auto t2 = std::chrono::system_clock::now();
+
+    int mismatch_count = 0;
+    for (int u = 0; u < n; u++) {
+        if (serial_distance[u] <= max_distance && serial_distance[u] != parallel_distance[u]) {
+            mismatch_count++;
+        }
+    }
+
+    printf("bench_distance_along_surface - %6d sources, max distance %-8g: serial %5d ms, parallel %5d ms, "
+           "%d points reached, %d mismatches\n", source_count, max_distance, dt(t0, t1), dt(t1, t2),
+           (int)result.size(), mismatch_count);
+    return mismatch_count;
+}
+
+int main(int argc, char **argv) {
+    int grid_size = (argc > 1) ? std::atoi(argv[1]) : 1000;
+    if (grid_size < 2) {
+        printf("bench_distance_along_surface - error, grid size must be at least 2\n");
+        return 1;
+    }
+
+    auto mesh = make_grid_mesh(grid_size);
+    SurfaceGraph graph;
+    VtkDistanceAlongSurfaceEffect::build_surface_graph(mesh, graph);
+    printf("bench_distance_along_surface - grid %dx%d, %d points, %d threads\n",
+           grid_size, grid_size, grid_size*grid_size, max_thread_count());
+
+    int mismatch_count = 0;
+    for (int source_count : {1, 100, 10000}) {
+        if (source_count > grid_size*grid_size) continue;
+        mismatch_count += run_case(graph, source_count, FLT_MAX);
+        mismatch_count += run_case(graph, source_count, 0.05f * grid_size);
+    }
+
+    if (mismatch_count > 0) {
+        printf("bench_distance_along_surface - error, serial and parallel distances differ\n");
+        return 1;
+    }
+    return 0;
+}
@@ -22,11 +22,22 @@ THE SOFTWARE.
 */
 
 #include "VtkDistanceAlongSurfaceEffect.h"
+#include "VtkEffectUtils.h"
+#include "mfx_vtk_utils.h"
 #include <vtkPointData.h>
 #include <vtkDataArray.h>
+#include <vtkUnsignedCharArray.h>
+#include <vtkIntArray.h>
+#include <vtkStaticPointLocator.h>
+#include <vtkMatrix4x4.h>
+#include <vtkMath.h>
 #include <vector>
-#include <vtkStaticCellLinks.h>
-#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
 
 const char *VtkDistanceAlongSurfaceEffect::GetName() {
     return "Distance along surface";
@@ -34,31 +45,62 @@ const char *VtkDistanceAlongSurfaceEffect::GetName() {
 
 OfxStatus
 VtkDistanceAlongSurfaceEffect::vtkDescribe(OfxParamSetHandle parameters, VtkEffectInputDef &input_mesh, VtkEffectInputDef &output_mesh) {
-    input_mesh.RequestCornerAttribute("color0", 3, MfxAttributeType::UByte, MfxAttributeSemantic::Color, true);
+    input_mesh.RequestCornerAttribute(ATTRIBUTE_COLOR, 3, MfxAttributeType::UByte, MfxAttributeSemantic::Color, false);
+    input_mesh.RequestPointAttribute(ATTRIBUTE_SOURCE_MASK, 1, MfxAttributeType::Float, MfxAttributeSemantic::Weight, false);
+    input_mesh.RequestTransform(true);
+
+    auto sources_mesh = vtkAddInput(INPUT_SOURCES);
+    sources_mesh->RequestTransform(true);
 
     // TODO declare this is a deformer
 
     AddParam(PARAM_NORMALIZE_DISTANCE, true).Label("Normalize distance");
+    AddParam(PARAM_DISTANCE_MODE, DISTANCE_MODE_GRAPH).Range(1, 2).Label("Distance mode"); // TODO make this enum!
+    AddParam(PARAM_OUTPUT_LABELS, false).Label("Output source labels");
     return kOfxStatOK;
 }
 
 OfxStatus VtkDistanceAlongSurfaceEffect::vtkCook(VtkEffectInput &main_input, VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs) {
-    auto input_color_arr = main_input.data->GetPointData()->GetArray("color0");
+    auto input_color_arr = main_input.data->GetPointData()->GetArray(ATTRIBUTE_COLOR);
+    auto input_source_mask_arr = main_input.data->GetPointData()->GetArray(ATTRIBUTE_SOURCE_MASK);
     auto normalize_distance = GetParam<bool>(PARAM_NORMALIZE_DISTANCE).GetValue();
+    auto distance_mode = GetParam<int>(PARAM_DISTANCE_MODE).GetValue();
+    auto output_labels = GetParam<bool>(PARAM_OUTPUT_LABELS).GetValue();
+
+    // XXX until we have enums...
+    distance_mode = clamp(distance_mode, DISTANCE_MODE_GRAPH, DISTANCE_MODE_FAST_MARCHING);
 
-    // TODO use extra inputs here!!!
+    VtkEffectInput *sources_input = vtkFindInput(extra_inputs, INPUT_SOURCES);
 
-    if (!input_color_arr) {
-        printf("VtkSurfaceDistanceEffect - missing input 'color0' attribute!\n");
+    if (!input_color_arr && !input_source_mask_arr && !sources_input) {
+        printf("VtkSurfaceDistanceEffect - no sources, connect '%s' input or provide '%s' or '%s' attribute!\n",
+               INPUT_SOURCES, ATTRIBUTE_SOURCE_MASK, ATTRIBUTE_COLOR);
         return kOfxStatFailed;
     }
 
     int n = main_input.data->GetNumberOfPoints();
-    std::vector<int> source_points;
+    std::vector<int> source_label(n, -1); // -1 = not a source
+
+    // sources are union of all that is given (later ones take precedence for labels);
+    // each kind gets labels past those of the previous kinds, so that labels of different kinds don't collide
+    int label_offset = 0;
+    if (input_color_arr) {
+        // has nonzero in Red channel, labeled by its value
+        label_offset = mark_source_points(input_color_arr, source_label, label_offset);
+    }
+    if (input_source_mask_arr) {
+        label_offset = mark_source_points(input_source_mask_arr, source_label, label_offset);
+    }
+    if (sources_input) {
+        double sources_transform[16];
+        main_input.get_relative_transform(*sources_input, sources_transform);
+        label_offset = snap_source_points(main_input.data, sources_input->data, sources_transform, source_label,
+                                          label_offset);
+    }
 
+    std::vector<int> source_points;
     for (int i = 0; i < n; i++) {
-        if (input_color_arr->GetComponent(i, 0) > 0) {
-            // has nonzero in Red channel
+        if (source_label[i] >= 0) {
             source_points.push_back(i);
         }
     }
@@ -69,10 +111,12 @@ OfxStatus VtkDistanceAlongSurfaceEffect::vtkCook(VtkEffectInput &main_input, Vtk
         printf("VtkSurfaceDistanceEffect - I have %d source points\n", (int)source_points.size());
     }
 
-    auto cell_links = vtkSmartPointer<vtkStaticCellLinks>::New(); // TODO use templated class to get int32 here
-    cell_links->BuildLinks(main_input.data);
-
-    auto distance_arr = compute_distance(main_input.data, source_points.size(), source_points.data(), cell_links);
+    std::vector<int> nearest_source;
+    if (output_labels) {
+        nearest_source.resize(n);
+    }
+    auto distance_arr = compute_distance(main_input.data, source_points.size(), source_points.data(), FLT_MAX,
+                                         distance_mode, (output_labels) ? nearest_source.data() : nullptr);
 
     auto output_uv_arr = vtkFloatArray::New();
     output_uv_arr->SetNumberOfComponents(2);
@@ -102,94 +146,679 @@ OfxStatus VtkDistanceAlongSurfaceEffect::vtkCook(VtkEffectInput &main_input, Vtk
     main_output.data->ShallowCopy(main_input.data);
     main_output.data->GetPointData()->AddArray(output_uv_arr);
 
+    if (output_labels) {
+        auto output_label_arr = vtkIntArray::New();
+        output_label_arr->SetNumberOfComponents(1);
+        output_label_arr->SetNumberOfTuples(n);
+        output_label_arr->SetName("label0");
+
+        int *output_label_ptr = output_label_arr->GetPointer(0);
+        #pragma omp parallel for schedule(static, 1000) if (n > 5000)
+        for (int i = 0; i < n; i++) {
+            int k = nearest_source[i];
+            output_label_ptr[i] = (k >= 0) ? source_label[source_points[k]] : -1;
+        }
+
+        main_output.data->GetPointData()->AddArray(output_label_arr);
+    }
+
     return kOfxStatOK;
 }
 
-vtkFloatArray *VtkDistanceAlongSurfaceEffect::compute_distance(vtkPolyData *mesh, int num_source_points,
-                                                               const int *source_points,
-                                                               vtkStaticCellLinks *cell_links, float max_distance) {
+// integer values are used as labels, returns the largest one (or 0)
+template <typename T>
+static int mark_positive_values(const T *values, int num_components, std::vector<int> &source_label, int label_offset) {
+    int n = source_label.size();
+    int max_value = 0;
+
+    #pragma omp parallel for schedule(static, 1000) if (n > 5000) reduction(max: max_value)
+    for (int i = 0; i < n; i++) {
+        T value = values[i*num_components];
+        if (value > 0) {
+            source_label[i] = label_offset + (int)value;
+            max_value = std::max(max_value, (int)value);
+        }
+    }
+    return max_value;
+}
+
+// floating point values are weights, not labels - label by point id
+template <typename T>
+static void mark_positive_weights(const T *values, int num_components, std::vector<int> &source_label, int label_offset) {
+    int n = source_label.size();
+
+    #pragma omp parallel for schedule(static, 1000) if (n > 5000)
+    for (int i = 0; i < n; i++) {
+        if (values[i*num_components] > 0) {
+            source_label[i] = label_offset + i;
+        }
+    }
+}
+
+int VtkDistanceAlongSurfaceEffect::mark_source_points(vtkDataArray *array, std::vector<int> &source_label,
+                                                      int label_offset) {
+    int n = source_label.size();
+    int num_components = array->GetNumberOfComponents();
+
+    // read the usual types directly, without virtual call per value
+    if (auto uchar_arr = vtkUnsignedCharArray::SafeDownCast(array)) {
+        return label_offset + mark_positive_values(uchar_arr->GetPointer(0), num_components, source_label, label_offset) + 1;
+    } else if (auto int_arr = vtkIntArray::SafeDownCast(array)) {
+        return label_offset + mark_positive_values(int_arr->GetPointer(0), num_components, source_label, label_offset) + 1;
+    } else if (auto float_arr = vtkFloatArray::SafeDownCast(array)) {
+        mark_positive_weights(float_arr->GetPointer(0), num_components, source_label, label_offset);
+        return label_offset + n;
+    } else if (array->IsIntegral()) {
+        int max_value = 0;
+        for (int i = 0; i < n; i++) {
+            double value = array->GetComponent(i, 0);
+            if (value > 0) {
+                source_label[i] = label_offset + (int)value;
+                max_value = std::max(max_value, (int)value);
+            }
+        }
+        return label_offset + max_value + 1;
+    } else {
+        for (int i = 0; i < n; i++) {
+            if (array->GetComponent(i, 0) > 0) {
+                source_label[i] = label_offset + i;
+            }
+        }
+        return label_offset + n;
+    }
+}
+
+int VtkDistanceAlongSurfaceEffect::snap_source_points(vtkPolyData *mesh, vtkPolyData *sources_polydata,
+                                                      const double sources_transform[16], std::vector<int> &source_label,
+                                                      int label_offset) {
+    int num_sources = sources_polydata->GetNumberOfPoints();
+    if (num_sources == 0 || mesh->GetNumberOfPoints() == 0) {
+        return label_offset;
+    }
+
+    auto locator = vtkSmartPointer<vtkStaticPointLocator>::New();
+    locator->SetDataSet(mesh);
+    locator->BuildLocator();
+
+    std::vector<int> nearest_points(num_sources);
+
+    // FindClosestPoint() is thread-safe once the locator is built
+    #pragma omp parallel for schedule(static, 1000) if (num_sources > 5000)
+    for (int i = 0; i < num_sources; i++) {
+        double p[4], p_mesh[4];
+        sources_polydata->GetPoint(i, p);
+        p[3] = 1.0;
+        vtkMatrix4x4::MultiplyPoint(sources_transform, p, p_mesh);
+        nearest_points[i] = locator->FindClosestPoint(p_mesh);
+    }
+
+    for (int i = 0; i < num_sources; i++) {
+        if (nearest_points[i] >= 0) {
+            source_label[nearest_points[i]] = label_offset + i;
+        }
+    }
+    printf("VtkSurfaceDistanceEffect - snapped %d points from sources input to the mesh\n", num_sources);
+    return label_offset + num_sources;
+}
+
+void VtkDistanceAlongSurfaceEffect::build_surface_graph(vtkPolyData *mesh, SurfaceGraph &graph, bool with_triangles) {
     int n = mesh->GetNumberOfPoints();
 
-    auto manifold_distance_arr = vtkFloatArray::New();
-    manifold_distance_arr->SetNumberOfComponents(1);
-    manifold_distance_arr->SetNumberOfTuples(n);
-    manifold_distance_arr->SetName("ManifoldDistance");
-    manifold_distance_arr->FillValue(vtkMath::Inf());
+    // gather lines and polygons into one cell list
+    std::vector<int> cell_offsets(1, 0);
+    std::vector<int> cell_connectivity;
+    int first_poly_cell = 0;
+    for (vtkCellArray *cells : {mesh->GetLines(), mesh->GetPolys()}) {
+        first_poly_cell = cell_offsets.size() - 1; // this ends up right for polys, lines come first
+        int num_cells = cells ? cells->GetNumberOfCells() : 0;
+        if (num_cells == 0) continue;
+
+        visit_cell_array(cells, [&](auto *offsets, auto *connectivity) {
+            int first_offset = cell_offsets.back();
+            int first_cell = cell_offsets.size() - 1;
+            cell_offsets.resize(first_cell + num_cells + 1);
+            cell_connectivity.resize(first_offset + offsets[num_cells]);
+
+            for (int i = 1; i <= num_cells; i++) {
+                cell_offsets[first_cell + i] = first_offset + offsets[i];
+            }
+            for (int j = 0; j < offsets[num_cells]; j++) {
+                cell_connectivity[first_offset + j] = connectivity[j];
+            }
+        });
+    }
+    int num_cells = cell_offsets.size() - 1;
 
-    enum class Status : unsigned char { UNVISITED, OPEN, CLOSED, SOURCE };
-    std::vector<Status> status_arr(n, Status::UNVISITED);
+    // point -> cell links
+    std::vector<int> link_offsets(n + 1, 0);
+    for (int v : cell_connectivity) {
+        link_offsets[v]++;
+    }
+    exclusive_scan(link_offsets.data(), link_offsets.data(), n + 1);
+    std::vector<int> link_cells(cell_connectivity.size());
+    {
+        std::vector<int> cursor(link_offsets.begin(), link_offsets.end() - 1);
+        for (int c = 0; c < num_cells; c++) {
+            for (int j = cell_offsets[c]; j < cell_offsets[c+1]; j++) {
+                link_cells[cursor[cell_connectivity[j]]++] = c;
+            }
+        }
+    }
 
-    // add source points to queue
-    typedef std::pair<float, int> PointDistance;
-    auto cmp = [](PointDistance left, PointDistance right) { return left.first > right.first; };
-    std::priority_queue<PointDistance, std::vector<PointDistance>, decltype(cmp)> queue(cmp);
+    // collect unique neighbors of each point; first pass counts them, second pass writes them
+    auto gather_neighbors = [&](int u, std::vector<int> &tmp) {
+        tmp.clear();
+        for (int k = link_offsets[u]; k < link_offsets[u+1]; k++) {
+            int c = link_cells[k];
+            for (int j = cell_offsets[c]; j < cell_offsets[c+1]; j++) {
+                int v = cell_connectivity[j];
+                if (v != u) {
+                    tmp.push_back(v);
+                }
+            }
+        }
+        std::sort(tmp.begin(), tmp.end());
+        tmp.erase(std::unique(tmp.begin(), tmp.end()), tmp.end());
+    };
 
-    for (int i = 0; i < num_source_points; i++) {
-        int p = source_points[i];
-        status_arr[p] = Status::SOURCE; // for debugging only
-        manifold_distance_arr->SetValue(p, 0.0);
-        queue.push(std::make_pair(0.0, p));
+    graph.offsets.assign(n + 1, 0);
+
+    #pragma omp parallel
+    {
+        std::vector<int> tmp;
+        #pragma omp for schedule(static, 1000)
+        for (int u = 0; u < n; u++) {
+            gather_neighbors(u, tmp);
+            graph.offsets[u] = tmp.size();
+        }
     }
 
-    auto get_distance = [&mesh](int u, int v) -> float {
+    int num_edges = exclusive_scan(graph.offsets.data(), graph.offsets.data(), n + 1);
+    graph.neighbors.resize(num_edges);
+
+    #pragma omp parallel
+    {
+        std::vector<int> tmp;
+        #pragma omp for schedule(static, 1000)
+        for (int u = 0; u < n; u++) {
+            gather_neighbors(u, tmp);
+            std::copy(tmp.begin(), tmp.end(), graph.neighbors.begin() + graph.offsets[u]);
+        }
+    }
+
+    if (!with_triangles) {
+        graph.triangle_offsets.clear();
+        graph.triangle_edges.clear();
+        update_surface_graph_geometry(mesh, graph);
+        return;
+    }
+
+    // split polygons into triangle fans, each triangle is listed for all its points:
+    // first point is in all size-2 triangles, second and last point in one, other points in two
+    graph.triangle_offsets.assign(n + 1, 0);
+    for (int c = first_poly_cell; c < num_cells; c++) {
+        const int *cell = cell_connectivity.data() + cell_offsets[c];
+        int size = cell_offsets[c+1] - cell_offsets[c];
+        if (size < 3) continue;
+        graph.triangle_offsets[cell[0]] += size - 2;
+        graph.triangle_offsets[cell[1]] += 1;
+        graph.triangle_offsets[cell[size-1]] += 1;
+        for (int j = 2; j < size - 1; j++) {
+            graph.triangle_offsets[cell[j]] += 2;
+        }
+    }
+    int num_triangle_refs = exclusive_scan(graph.triangle_offsets.data(), graph.triangle_offsets.data(), n + 1);
+    graph.triangle_edges.resize(2*num_triangle_refs);
+
+    std::vector<int> cursor(graph.triangle_offsets.begin(), graph.triangle_offsets.end() - 1);
+    auto add_triangle_ref = [&](int u, int a, int b) {
+        int k = cursor[u]++;
+        graph.triangle_edges[2*k] = a;
+        graph.triangle_edges[2*k + 1] = b;
+    };
+    for (int c = first_poly_cell; c < num_cells; c++) {
+        const int *cell = cell_connectivity.data() + cell_offsets[c];
+        int size = cell_offsets[c+1] - cell_offsets[c];
+        for (int j = 1; j + 1 < size; j++) {
+            add_triangle_ref(cell[0], cell[j], cell[j+1]);
+            add_triangle_ref(cell[j], cell[j+1], cell[0]);
+            add_triangle_ref(cell[j+1], cell[0], cell[j]);
+        }
+    }
+
+    update_surface_graph_geometry(mesh, graph);
+}
+
+void VtkDistanceAlongSurfaceEffect::update_surface_graph_geometry(vtkPolyData *mesh, SurfaceGraph &graph) {
+    int n = mesh->GetNumberOfPoints();
+    graph.edge_lengths.resize(graph.neighbors.size());
+
+    #pragma omp parallel for schedule(static, 1000) if (n > 5000)
+    for (int u = 0; u < n; u++) {
         double x[3], y[3];
-        mesh->GetPoints()->GetPoint(u, x);
-        mesh->GetPoints()->GetPoint(v, y);
-        double dist_sq = vtkMath::Distance2BetweenPoints(x, y);
-        return (float)std::sqrt(dist_sq);
+        mesh->GetPoint(u, x);
+        for (int k = graph.offsets[u]; k < graph.offsets[u+1]; k++) {
+            mesh->GetPoint(graph.neighbors[k], y);
+            graph.edge_lengths[k] = (float)std::sqrt(vec3_squared_distance(x, y));
+        }
+    }
+
+    if (graph.triangle_offsets.empty()) {
+        graph.points.clear();
+        return;
+    }
+
+    graph.points.resize(3*n);
+    #pragma omp parallel for schedule(static, 1000) if (n > 5000)
+    for (int u = 0; u < n; u++) {
+        double x[3];
+        mesh->GetPoint(u, x);
+        graph.points[3*u + 0] = (float)x[0];
+        graph.points[3*u + 1] = (float)x[1];
+        graph.points[3*u + 2] = (float)x[2];
+    }
+}
+
+/* Fast marching update of point x from triangle (x, a, b), where a, b have known distances da, db.
+ * The distance is assumed to be linear over the triangle, with unit gradient; the update is only valid
+ * if the characteristic reaching x comes through the edge ab, otherwise fall back to edge updates.
+ * */
+static float fast_marching_update(const float *points, int x, int a, int b, float da, float db) {
+    double ea[3], eb[3];
+    for (int j = 0; j < 3; j++) {
+        ea[j] = points[3*a + j] - points[3*x + j];
+        eb[j] = points[3*b + j] - points[3*x + j];
+    }
+    double edge_update = std::min(da + std::sqrt(vec3_dot(ea, ea)), db + std::sqrt(vec3_dot(eb, eb)));
+
+    // inverse of Gram matrix [ea eb]^T [ea eb]
+    double g_aa = vec3_dot(ea, ea), g_ab = vec3_dot(ea, eb), g_bb = vec3_dot(eb, eb);
+    double det = g_aa*g_bb - g_ab*g_ab;
+    if (det <= 1e-12 * g_aa * g_bb) {
+        return (float)edge_update; // degenerate triangle
+    }
+    double q_aa = g_bb / det, q_ab = -g_ab / det, q_bb = g_aa / det;
+
+    // solve (t - p)^T Q (t - p) = 1 for distance p at x, with t = (da, db)
+    double q_1_1 = q_aa + 2*q_ab + q_bb;
+    double q_1_t = (q_aa + q_ab)*da + (q_ab + q_bb)*db;
+    double q_t_t = q_aa*da*da + 2*q_ab*da*db + q_bb*db*db;
+    double discriminant = q_1_t*q_1_t - q_1_1*(q_t_t - 1.0);
+    if (discriminant < 0) {
+        return (float)edge_update;
+    }
+    double p = (q_1_t + std::sqrt(discriminant)) / q_1_1;
+
+    // upwind condition - gradient direction at x must point away from the triangle
+    double c_a = q_aa*(da - p) + q_ab*(db - p);
+    double c_b = q_ab*(da - p) + q_bb*(db - p);
+    if (c_a > 0 || c_b > 0) {
+        return (float)edge_update;
+    }
+    return (float)std::min(p, edge_update);
+}
+
+/* 4-ary min-heap of point IDs keyed by distance, supporting decrease-key.
+ * Storage is borrowed from DistanceWorkspace; position[] must be -1 for points not in heap.
+ * */
+class DistanceHeap {
+public:
+    DistanceHeap(std::vector<std::pair<float, int>> &heap, std::vector<int> &position)
+        : heap(heap), position(position) {}
+
+    bool empty() const {
+        return heap.empty();
+    }
+
+    /* Insert u, or lower its key if it is already queued.
+     * */
+    void push(int u, float key) {
+        int i = position[u];
+        if (i < 0) {
+            i = heap.size();
+            heap.emplace_back(key, u);
+        } else {
+            heap[i].first = key;
+        }
+        sift_up(i);
+    }
+
+    int pop() {
+        int u = heap[0].second;
+        position[u] = -1;
+        Entry last = heap.back();
+        heap.pop_back();
+        if (!heap.empty()) {
+            heap[0] = last;
+            sift_down(0);
+        }
+        return u;
+    }
+
+    /* Remove remaining points, leaving position[] clean for next use.
+     * */
+    void clear() {
+        for (auto &e : heap) {
+            position[e.second] = -1;
+        }
+        heap.clear();
+    }
+
+private:
+    typedef std::pair<float, int> Entry; // key, point ID
+    std::vector<Entry> &heap;
+    std::vector<int> &position;
+
+    void sift_up(int i) {
+        Entry e = heap[i];
+        while (i > 0) {
+            int parent = (i - 1) / 4;
+            if (heap[parent].first <= e.first) break;
+            heap[i] = heap[parent];
+            position[heap[i].second] = i;
+            i = parent;
+        }
+        heap[i] = e;
+        position[e.second] = i;
+    }
+
+    void sift_down(int i) {
+        Entry e = heap[i];
+        int size = heap.size();
+        while (true) {
+            int first_child = 4*i + 1;
+            if (first_child >= size) break;
+            int best = first_child;
+            for (int c = first_child + 1; c < std::min(first_child + 4, size); c++) {
+                if (heap[c].first < heap[best].first) best = c;
+            }
+            if (heap[best].first >= e.first) break;
+            heap[i] = heap[best];
+            position[heap[i].second] = i;
+            i = best;
+        }
+        heap[i] = e;
+        position[e.second] = i;
+    }
+};
+
+void VtkDistanceAlongSurfaceEffect::compute_distance_sparse(const SurfaceGraph &graph, int num_source_points,
+                                                            const int *source_points, float max_distance,
+                                                            DistanceWorkspace &workspace,
+                                                            std::vector<PointDistance> &result, int mode) {
+    int n = graph.offsets.size() - 1;
+    result.clear();
+
+    if (mode == DISTANCE_MODE_FAST_MARCHING && graph.triangle_offsets.empty()) {
+        printf("VtkSurfaceDistanceEffect - graph has no triangles, falling back to graph distance\n");
+        mode = DISTANCE_MODE_GRAPH;
+    }
+    bool fast_marching = mode == DISTANCE_MODE_FAST_MARCHING;
+
+    // new epoch, this invalidates values from previous query
+    if (workspace.visited_epoch.size() != n || workspace.epoch == UINT_MAX) {
+        workspace.epoch = 0;
+        workspace.visited_epoch.assign(n, 0);
+        workspace.frozen_epoch.assign(n, 0);
+        workspace.distance.resize(n);
+        workspace.source.resize(n);
+        workspace.heap_position.assign(n, -1);
+        workspace.heap.clear();
+    }
+    const unsigned int epoch = ++workspace.epoch;
+    unsigned int *visited_epoch = workspace.visited_epoch.data();
+    unsigned int *frozen_epoch = workspace.frozen_epoch.data();
+    float *distance = workspace.distance.data();
+    int *source = workspace.source.data();
+
+    DistanceHeap queue(workspace.heap, workspace.heap_position);
+    for (int i = 0; i < num_source_points; i++) {
+        int u = source_points[i];
+        visited_epoch[u] = epoch;
+        distance[u] = 0.0f;
+        source[u] = i;
+        queue.push(u, 0.0f);
+    }
+
+    const int *offsets = graph.offsets.data();
+    const int *neighbors = graph.neighbors.data();
+    const float *edge_lengths = graph.edge_lengths.data();
+    const int *triangle_offsets = graph.triangle_offsets.data();
+    const int *triangle_edges = graph.triangle_edges.data();
+    const float *points = graph.points.data();
+
+    // v inherits nearest source from u, whose front reached it
+    auto relax = [&](int v, float new_v_distance, int u) {
+        if (visited_epoch[v] != epoch || new_v_distance < distance[v]) {
+            visited_epoch[v] = epoch;
+            distance[v] = new_v_distance;
+            source[v] = source[u];
+            queue.push(v, new_v_distance);
+        }
     };
 
-    // begin dijkstra
-    int it = 0;
     while (!queue.empty()) {
-        float u_dist; int u;
-        std::tie(u_dist, u) = queue.top();
-        queue.pop();
-        it++;
+        int u = queue.pop();
+        float u_distance = distance[u];
 
-        if (u_dist > max_distance) {
+        if (u_distance > max_distance) {
             // early exit, we've computed all closest paths up to max_distance
             break;
         }
+        result.push_back({u, u_distance, source[u]});
+        frozen_epoch[u] = epoch;
 
-        Status u_status = status_arr[u];
-        float u_distance = manifold_distance_arr->GetValue(u);
-        //printf("iteration %d - point %d, dist %g, status %d\n", it, u, u_dist, (int)u_status);
+        for (int k = offsets[u]; k < offsets[u+1]; k++) {
+            relax(neighbors[k], u_distance + edge_lengths[k], u);
+        }
 
-        if (u_status == Status::CLOSED) {
-            continue;
-        };
+        if (fast_marching) {
+            // update points of triangles (u, a, b) which now have two known distances
+            for (int k = triangle_offsets[u]; k < triangle_offsets[u+1]; k++) {
+                int a = triangle_edges[2*k], b = triangle_edges[2*k + 1];
+                for (int side = 0; side < 2; side++) {
+                    int v = (side == 0) ? a : b;
+                    int w = (side == 0) ? b : a;
+                    if (frozen_epoch[v] == epoch || frozen_epoch[w] != epoch) continue;
+                    relax(v, fast_marching_update(points, v, u, w, u_distance, distance[w]), u);
+                }
+            }
+        }
+    }
 
-        int num_cells = cell_links->GetNumberOfCells(u);
-        auto neighbor_cells = cell_links->GetCells(u);
-        for (int i = 0; i < num_cells; i++) {
-            auto cell = mesh->GetCell(neighbor_cells[i]);
-            int num_points = cell->GetNumberOfPoints();
+    queue.clear();
+}
 
-            for (int j = 0; j < num_points; j++) {
-                int v = cell->GetPointId(j);
-                Status v_status = status_arr[v];
+void VtkDistanceAlongSurfaceEffect::compute_distance(const SurfaceGraph &graph, int num_source_points,
+                                                     const int *source_points, float *distance, float max_distance,
+                                                     int mode, int *nearest_source) {
+    int n = graph.offsets.size() - 1;
 
-                float uv_distance = get_distance(u, v);
-                float old_v_distance = manifold_distance_arr->GetValue(v);
-                float new_v_distance = u_distance + uv_distance;
+    if (mode == DISTANCE_MODE_GRAPH && n >= PARALLEL_DISTANCE_MIN_POINTS) {
+        compute_distance_parallel(graph, num_source_points, source_points, distance, max_distance, nearest_source);
+        return;
+    }
 
-                //printf("  - point %d, old dist %g, new dist %g, status %d\n", v, old_v_distance, new_v_distance, (int)v_status);
+    DistanceWorkspace workspace;
+    std::vector<PointDistance> result;
+    compute_distance_sparse(graph, num_source_points, source_points, max_distance, workspace, result, mode);
 
-                if (new_v_distance < old_v_distance) {
-                    manifold_distance_arr->SetValue(v, new_v_distance);
-                    queue.push(std::make_pair(new_v_distance, v));
-                    status_arr[v] = Status::OPEN;
+    std::fill(distance, distance + n, vtkMath::Inf());
+    for (auto &pd : result) {
+        distance[pd.id] = pd.distance;
+    }
 
-                    //printf("  - enqueue point %d\n", v);
+    if (nearest_source) {
+        std::fill(nearest_source, nearest_source + n, -1);
+        for (auto &pd : result) {
+            nearest_source[pd.id] = pd.source;
+        }
+    }
+}
+
+/* Distance and nearest source packed into one 64-bit word, so that both can be updated by one atomic operation.
+ * Distance goes to the upper half - for non-negative floats, order of their bit patterns is the same
+ * as order of the values, so packed words compare by distance first (and by source index on ties).
+ * */
+static inline uint64_t pack_distance(float distance, int source) {
+    uint32_t distance_bits;
+    memcpy(&distance_bits, &distance, sizeof(float));
+    return ((uint64_t)distance_bits << 32) | (uint32_t)source;
+}
+
+static inline float unpack_distance(uint64_t packed) {
+    uint32_t distance_bits = packed >> 32;
+    float distance;
+    memcpy(&distance, &distance_bits, sizeof(float));
+    return distance;
+}
+
+static inline int unpack_source(uint64_t packed) {
+    return (int)(uint32_t)packed;
+}
+
+/* Atomically lower value to new_value; returns true if it was lowered.
+ * */
+static inline bool atomic_min(uint64_t &value, uint64_t new_value) {
+    std::atomic_ref<uint64_t> ref(value);
+    uint64_t old_value = ref.load(std::memory_order_relaxed);
+    while (new_value < old_value) {
+        if (ref.compare_exchange_weak(old_value, new_value, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void VtkDistanceAlongSurfaceEffect::compute_distance_parallel(const SurfaceGraph &graph, int num_source_points,
+                                                              const int *source_points, float *distance,
+                                                              float max_distance, int *nearest_source) {
+    auto t0 = std::chrono::system_clock::now();
+
+    int n = graph.offsets.size() - 1;
+    int num_edges = graph.neighbors.size();
+    const int *offsets = graph.offsets.data();
+    const int *neighbors = graph.neighbors.data();
+    const float *edge_lengths = graph.edge_lengths.data();
+
+    // bucket width - about one edge, so that each bucket is a thin front with plenty of points
+    double edge_length_sum = 0.0;
+    #pragma omp parallel for schedule(static, 1000) reduction(+:edge_length_sum)
+    for (int k = 0; k < num_edges; k++) {
+        edge_length_sum += edge_lengths[k];
+    }
+    double delta = (num_edges > 0) ? edge_length_sum / num_edges : 0.0;
+    if (!is_positive_double(delta)) {
+        delta = DBL_MAX; // everything in one bucket
+    }
+    auto bucket_of = [delta](float d) -> size_t {
+        return (size_t)(d / delta);
+    };
+
+    std::vector<uint64_t> state(n, pack_distance(vtkMath::Inf(), -1)); // see pack_distance()
+    std::vector<char> queued(n, 0); // point is in current frontier
+    std::vector<std::vector<int>> buckets(1);
+    for (int i = 0; i < num_source_points; i++) {
+        state[source_points[i]] = std::min(state[source_points[i]], pack_distance(0.0f, i));
+        buckets[0].push_back(source_points[i]);
+    }
+
+    std::vector<int> frontier, next_frontier;
+    int num_rounds = 0;
+
+    for (size_t i = 0; i < buckets.size(); i++) {
+        if (i * delta > max_distance) {
+            break;
+        }
+
+        // bucket may have stale entries, for points which were improved into an earlier bucket
+        frontier.clear();
+        for (int u : buckets[i]) {
+            if (bucket_of(unpack_distance(state[u])) == i && !queued[u]) {
+                queued[u] = 1;
+                frontier.push_back(u);
+            }
+        }
+        std::vector<int>().swap(buckets[i]);
+
+        while (!frontier.empty()) {
+            next_frontier.clear();
+            int frontier_size = frontier.size();
+
+            #pragma omp parallel
+            {
+                std::vector<int> local_next_frontier;
+                std::vector<std::pair<size_t, int>> local_later;
+
+                #pragma omp for schedule(dynamic, 256)
+                for (int j = 0; j < frontier_size; j++) {
+                    int u = frontier[j];
+                    std::atomic_ref<char>(queued[u]).store(0);
+                    uint64_t u_state = std::atomic_ref<uint64_t>(state[u]).load();
+                    float u_distance = unpack_distance(u_state);
+                    int u_source = unpack_source(u_state);
+
+                    for (int k = offsets[u]; k < offsets[u+1]; k++) {
+                        int v = neighbors[k];
+                        float new_v_distance = u_distance + edge_lengths[k];
+                        if (atomic_min(state[v], pack_distance(new_v_distance, u_source))) {
+                            size_t b = bucket_of(new_v_distance);
+                            if (b <= i) {
+                                if (!std::atomic_ref<char>(queued[v]).exchange(1)) {
+                                    local_next_frontier.push_back(v);
+                                }
+                            } else {
+                                local_later.emplace_back(b, v);
+                            }
+                        }
+                    }
+                }
+
+                #pragma omp critical
+                {
+                    next_frontier.insert(next_frontier.end(), local_next_frontier.begin(), local_next_frontier.end());
+                    for (auto &entry : local_later) {
+                        if (entry.first >= buckets.size()) {
+                            buckets.resize(entry.first + 1);
+                        }
+                        buckets[entry.first].push_back(entry.second);
+                    }
                 }
             }
-            // end neighbor cell
+
+            std::swap(frontier, next_frontier);
+            num_rounds++;
         }
-        status_arr[u] = Status::CLOSED;
-        // end point
     }
-    // end dijkstra
 
+    #pragma omp parallel for schedule(static, 1000)
+    for (int u = 0; u < n; u++) {
+        distance[u] = unpack_distance(state[u]);
+        if (nearest_source) {
+            nearest_source[u] = unpack_source(state[u]);
+        }
+    }
+
+    auto t1 = std::chrono::system_clock::now();
+    printf("VtkSurfaceDistanceEffect - parallel distance, %d points, %d sources, %d rounds, %d ms\n",
+           n, num_source_points, num_rounds,
+           (int)std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+}
+
+vtkFloatArray *VtkDistanceAlongSurfaceEffect::compute_distance(vtkPolyData *mesh, int num_source_points,
+                                                               const int *source_points, float max_distance,
+                                                               int mode, int *nearest_source) {
+    int n = mesh->GetNumberOfPoints();
+
+    SurfaceGraph graph;
+    build_surface_graph(mesh, graph, mode == DISTANCE_MODE_FAST_MARCHING);
+
+    auto manifold_distance_arr = vtkFloatArray::New();
+    manifold_distance_arr->SetNumberOfComponents(1);
+    manifold_distance_arr->SetNumberOfTuples(n);
+    manifold_distance_arr->SetName("ManifoldDistance");
+
+    compute_distance(graph, num_source_points, source_points, manifold_distance_arr->GetPointer(0), max_distance, mode,
+                     nearest_source);
     return manifold_distance_arr;
 }
@@ -24,15 +24,121 @@ THE SOFTWARE.
 #pragma once
 
 #include <vtkFloatArray.h>
-#include <vtkStaticCellLinks.h>
 #include "VtkEffect.h"
+#include <vector>
 
 class VtkDistanceAlongSurfaceEffect : public VtkEffect {
 private:
     const char *PARAM_NORMALIZE_DISTANCE = "NormalizeDistance";
+    const char *PARAM_DISTANCE_MODE = "DistanceMode";
+    const char *PARAM_OUTPUT_LABELS = "OutputLabels";
+    const char *INPUT_SOURCES = "Sources";
+    const char *ATTRIBUTE_COLOR = "color0";
+    const char *ATTRIBUTE_SOURCE_MASK = "source_mask";
 public:
+    static const int DISTANCE_MODE_GRAPH = 1;
+    static const int DISTANCE_MODE_FAST_MARCHING = 2;
+
+    // graph distance on meshes at least this large uses compute_distance_parallel()
+    static const int PARALLEL_DISTANCE_MIN_POINTS = 200000;
+
     const char* GetName() override;
     OfxStatus vtkDescribe(OfxParamSetHandle parameters, VtkEffectInputDef &input_mesh, VtkEffectInputDef &output_mesh) override;
     OfxStatus vtkCook(VtkEffectInput &main_input, VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs) override;
-    static vtkFloatArray *compute_distance(vtkPolyData *mesh, int num_source_points, const int *source_points, vtkStaticCellLinks *cell_links, float max_distance=FLT_MAX);
+
+    /* Mesh connectivity in compressed sparse row format: neighbors of point u are
+     * neighbors[offsets[u]] ... neighbors[offsets[u+1]-1], ie. all other points of cells using u,
+     * with Euclidean lengths of these edges in edge_lengths.
+     *
+     * For fast marching, the graph also has triangles (polygons are split into fans): for point u,
+     * triangle_edges[2*k], triangle_edges[2*k+1] for k in triangle_offsets[u] ... triangle_offsets[u+1]-1
+     * are the other two points of each triangle using u. Point coordinates are in points.
+     * */
+    struct SurfaceGraph {
+        std::vector<int> offsets;
+        std::vector<int> neighbors;
+        std::vector<float> edge_lengths;
+
+        std::vector<int> triangle_offsets;
+        std::vector<int> triangle_edges;
+        std::vector<float> points;
+    };
+
+    /* Mark points with positive value in the first component of array (which must have one tuple per point)
+     * as sources; leave other values of source_label untouched. Integer arrays (eg. color) label sources
+     * by label_offset + value, floating point arrays (eg. weights in [0, 1]) by label_offset + point id.
+     * Returns the first label after those this array can produce, to be used as label_offset of the next kind.
+     * */
+    static int mark_source_points(vtkDataArray *array, std::vector<int> &source_label, int label_offset=0);
+
+    /* Mark mesh points nearest to the points of sources_polydata as sources, labeled by label_offset + index
+     * of the source point; sources are first transformed by sources_transform (relative transform from sources
+     * to mesh). Returns the first label after those used, like mark_source_points().
+     * */
+    static int snap_source_points(vtkPolyData *mesh, vtkPolyData *sources_polydata, const double sources_transform[16],
+                                  std::vector<int> &source_label, int label_offset=0);
+
+    static void build_surface_graph(vtkPolyData *mesh, SurfaceGraph &graph, bool with_triangles=false);
+
+    /* Recompute edge lengths (and point coordinates, if the graph has triangles) of a graph built
+     * by build_surface_graph(), after points of the mesh moved; topology must be the same.
+     * */
+    static void update_surface_graph_geometry(vtkPolyData *mesh, SurfaceGraph &graph);
+
+    struct PointDistance {
+        int id;
+        float distance;
+        int source; // index into source_points of the nearest source
+    };
+
+    /* Scratch memory for compute_distance_sparse(), meant to be reused between queries on the same graph.
+     * Per-point values are only valid if stamped with the current epoch, so that a query does not need
+     * to reset them and its cost only depends on the number of points it reaches.
+     * */
+    struct DistanceWorkspace {
+        unsigned int epoch = 0;
+        std::vector<unsigned int> visited_epoch; // distance[u] is set
+        std::vector<unsigned int> frozen_epoch; // distance[u] is final (fast marching)
+        std::vector<float> distance;
+        std::vector<int> source; // index of nearest source
+        std::vector<int> heap_position; // -1 when not queued
+        std::vector<std::pair<float, int>> heap;
+
+        float get_distance(int u) const {
+            return (visited_epoch[u] == epoch) ? distance[u] : FLT_MAX;
+        }
+    };
+
+    /* Distance from source points along the surface, written to distance (one value per point).
+     * DISTANCE_MODE_GRAPH is Dijkstra along graph edges (upper bound of the true distance),
+     * DISTANCE_MODE_FAST_MARCHING also propagates across triangles, which removes most of the error
+     * (needs graph built with triangles). Points farther than max_distance may be left with an
+     * overestimate or Inf.
+     *
+     * If nearest_source is given, it receives index into source_points of the source which is nearest
+     * to each point (-1 for unreached points), ie. a geodesic Voronoi partition of the mesh. This comes
+     * from the same traversal, the nearest source is passed along with the distance.
+     * */
+    static void compute_distance(const SurfaceGraph &graph, int num_source_points, const int *source_points,
+                                 float *distance, float max_distance=FLT_MAX, int mode=DISTANCE_MODE_GRAPH,
+                                 int *nearest_source=nullptr);
+
+    /* Same result as compute_distance() in DISTANCE_MODE_GRAPH (for points up to max_distance),
+     * computed in parallel by delta-stepping: points are processed in buckets of distance width delta,
+     * relaxing all points of the current bucket in parallel until it settles.
+     * */
+    static void compute_distance_parallel(const SurfaceGraph &graph, int num_source_points, const int *source_points,
+                                          float *distance, float max_distance=FLT_MAX, int *nearest_source=nullptr);
+
+    /* Same as compute_distance(), but only returns points with distance <= max_distance,
+     * as (point, distance) pairs in order of increasing distance. Distances of these points
+     * can also be looked up in workspace until the next query.
+     * */
+    static void compute_distance_sparse(const SurfaceGraph &graph, int num_source_points, const int *source_points,
+                                        float max_distance, DistanceWorkspace &workspace,
+                                        std::vector<PointDistance> &result, int mode=DISTANCE_MODE_GRAPH);
+
+    static vtkFloatArray *compute_distance(vtkPolyData *mesh, int num_source_points, const int *source_points,
+                                           float max_distance=FLT_MAX, int mode=DISTANCE_MODE_GRAPH,
+                                           int *nearest_source=nullptr);
 };
@@ -21,10 +21,11 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
-#include <vtkFeatureEdges.h>
-#include <vtkTriangleFilter.h>
-#include <vtkCleanPolyData.h>
+#include <vtkCellArray.h>
+#include <vtkMath.h>
+#include <vtkPoints.h>
 #include "VtkExtractEdgesEffect.h"
+#include "mfx_vtk_utils.h"
 
 const char *VtkExtractEdgesEffect::GetName() {
     return "Feature edges";
@@ -55,39 +56,219 @@ OfxStatus
 VtkExtractEdgesEffect::vtkCook_inner(vtkPolyData *input_polydata, vtkPolyData *output_polydata, double feature_angle,
                                      bool extract_feature_edges, bool extract_boundary_edges,
                                      bool extract_nonmanifold_edges, bool extract_manifold_edges) {
-    auto feature_edges_filter = vtkSmartPointer<vtkFeatureEdges>::New();
+    EdgeTopology topology;
+    build_edge_topology(input_polydata, topology);
 
+    // all feature edges are manifold edges, so normals are not needed when those are extracted anyway
+    std::vector<double> face_normals;
     if (extract_feature_edges && !extract_manifold_edges) {
-        // Extract_feature_edges only works with triangles in vtkFeatureEdges, so we have to triangulate.
-        // Since all feature edges are manifold edges, we can skip triangulation if extract_manifold_edges is on.
-        // Triangulation does not affect non-manifold and boundary edges.
-        auto triangle_filter = vtkSmartPointer<vtkTriangleFilter>::New();
-        triangle_filter->SetInputData(input_polydata);
-        triangle_filter->Update();
-        feature_edges_filter->SetInputConnection(triangle_filter->GetOutputPort());
-    } else {
-        feature_edges_filter->SetInputData(input_polydata);
+        compute_face_normals(input_polydata, face_normals);
     }
 
-    printf("feature_angle = %g\n", feature_angle);
-    feature_edges_filter->SetFeatureAngle(feature_angle);
-    feature_edges_filter->SetFeatureEdges(extract_feature_edges);
-    feature_edges_filter->SetBoundaryEdges(extract_boundary_edges);
-    feature_edges_filter->SetNonManifoldEdges(extract_nonmanifold_edges);
-    feature_edges_filter->SetManifoldEdges(extract_manifold_edges);
-    feature_edges_filter->SetColoring(false);
-
-    // get rid of unused points
-    auto clean_polydata_filter = vtkSmartPointer<vtkCleanPolyData>::New();
-    clean_polydata_filter->SetInputConnection(feature_edges_filter->GetOutputPort());
-    clean_polydata_filter->SetConvertStripsToPolys(false);
-    clean_polydata_filter->SetConvertPolysToLines(false);
-    clean_polydata_filter->SetConvertLinesToPoints(false);
-    clean_polydata_filter->SetPointMerging(false);
-
-    clean_polydata_filter->Update();
-
-    auto filter_output = clean_polydata_filter->GetOutput();
-    output_polydata->ShallowCopy(filter_output);
+    std::vector<uint8_t> edge_labels;
+    classify_edges(topology, face_normals, feature_angle, edge_labels);
+
+    // flag + scan + scatter selected edges, marking points that are used
+    const int input_edge_count = topology.GetNumberOfEdges();
+    const int point_count = input_polydata->GetNumberOfPoints();
+    std::vector<int> edge_index(input_edge_count);
+
+    #pragma omp parallel for schedule(static, 1000) if (input_edge_count > 5000)
+    for (int e = 0; e < input_edge_count; e++) {
+        bool selected = false;
+        switch (edge_labels[e]) {
+            case EDGE_BOUNDARY: selected = extract_boundary_edges; break;
+            case EDGE_NON_MANIFOLD: selected = extract_nonmanifold_edges; break;
+            case EDGE_MANIFOLD: selected = extract_manifold_edges; break;
+            case EDGE_FEATURE: selected = extract_manifold_edges || extract_feature_edges; break;
+        }
+        edge_index[e] = selected ? 1 : 0;
+    }
+
+    const int edge_count = exclusive_scan(edge_index.data(), edge_index.data(), input_edge_count);
+    std::vector<int> point_index(point_count, 0);
+
+    auto output_offsets = vtkSmartPointer<vtkTypeInt32Array>::New();
+    auto output_connectivity = vtkSmartPointer<vtkTypeInt32Array>::New();
+    output_offsets->SetNumberOfValues(edge_count + 1);
+    output_connectivity->SetNumberOfValues(2*edge_count);
+    int *offsets = output_offsets->GetPointer(0);
+    int *connectivity = output_connectivity->GetPointer(0);
+
+    #pragma omp parallel for schedule(static, 1000) if (input_edge_count > 5000)
+    for (int e = 0; e < input_edge_count; e++) {
+        bool selected = (e+1 < input_edge_count) ? (edge_index[e+1] != edge_index[e]) : (edge_index[e] < edge_count);
+        if (!selected) continue;
+
+        int k = edge_index[e];
+        offsets[k] = 2*k;
+        for (int v = 0; v < 2; v++) {
+            int p = topology.edges[2*e + v];
+            connectivity[2*k + v] = p;
+            #pragma omp atomic write
+            point_index[p] = 1;
+        }
+    }
+    offsets[edge_count] = 2*edge_count;
+
+    // get rid of unused points: scan + scatter points, then remap edges
+    const int output_point_count = exclusive_scan(point_index.data(), point_index.data(), point_count);
+    auto input_points = input_polydata->GetPoints();
+
+    auto output_points = vtkSmartPointer<vtkPoints>::New();
+    output_points->SetDataType(input_points ? input_points->GetDataType() : VTK_FLOAT);
+    output_points->SetNumberOfPoints(output_point_count);
+
+    #pragma omp parallel for schedule(static, 1000) if (point_count > 5000)
+    for (int p = 0; p < point_count; p++) {
+        bool used = (p+1 < point_count) ? (point_index[p+1] != point_index[p]) : (point_index[p] < output_point_count);
+        if (used) {
+            double x[3];
+            input_points->GetPoint(p, x);
+            output_points->SetPoint(point_index[p], x);
+        }
+    }
+
+    #pragma omp parallel for schedule(static, 1000) if (edge_count > 5000)
+    for (int k = 0; k < 2*edge_count; k++) {
+        connectivity[k] = point_index[connectivity[k]];
+    }
+
+    auto output_lines = vtkSmartPointer<vtkCellArray>::New();
+    output_lines->SetData(output_offsets, output_connectivity);
+
+    auto temp_polydata = vtkSmartPointer<vtkPolyData>::New();
+    temp_polydata->SetPoints(output_points);
+    temp_polydata->SetLines(output_lines);
+    output_polydata->ShallowCopy(temp_polydata);
     return kOfxStatOK;
 }
+
+void VtkExtractEdgesEffect::build_edge_topology(vtkPolyData *mesh, EdgeTopology &topology) {
+    auto polys = mesh->GetPolys();
+    polys->ConvertTo32BitStorage();
+    const int *offsets = polys->GetOffsetsArray32()->GetPointer(0);
+    const int *connectivity = polys->GetConnectivityArray32()->GetPointer(0);
+    const int face_count = polys->GetNumberOfCells();
+    const int point_count = mesh->GetNumberOfPoints();
+
+    // count polygon sides, then write (min, max) keys in parallel
+    std::vector<int> face_side_offsets(face_count);
+
+    #pragma omp parallel for schedule(static, 1000) if (face_count > 5000)
+    for (int f = 0; f < face_count; f++) {
+        int start = offsets[f], n = offsets[f+1] - offsets[f];
+        int count = 0;
+        for (int k = 0; k < n; k++) {
+            count += (connectivity[start + k] != connectivity[start + (k+1) % n]) ? 1 : 0;
+        }
+        face_side_offsets[f] = count;
+    }
+
+    const int side_count = exclusive_scan(face_side_offsets.data(), face_side_offsets.data(), face_count);
+
+    int point_bits = 1;
+    while ((int64_t(1) << point_bits) < point_count) point_bits++;
+
+    std::vector<uint64_t> keys(side_count);
+    std::vector<int> &side_faces = topology.edge_faces;
+    side_faces.resize(side_count);
+
+    #pragma omp parallel for schedule(static, 1000) if (face_count > 5000)
+    for (int f = 0; f < face_count; f++) {
+        int start = offsets[f], n = offsets[f+1] - offsets[f];
+        int i = face_side_offsets[f];
+        for (int k = 0; k < n; k++) {
+            uint64_t a = connectivity[start + k], b = connectivity[start + (k+1) % n];
+            if (a == b) continue;
+            keys[i] = (std::min(a, b) << point_bits) | std::max(a, b);
+            side_faces[i] = f;
+            i++;
+        }
+    }
+
+    // sides of the same edge are now next to each other, faces in increasing order (the sort is stable)
+    radix_sort(keys, side_faces, 2*point_bits);
+
+    // flag + scan + scatter first side of each edge
+    std::vector<int> edge_index(side_count);
+
+    #pragma omp parallel for schedule(static, 1000) if (side_count > 5000)
+    for (int i = 0; i < side_count; i++) {
+        edge_index[i] = (i == 0 || keys[i] != keys[i-1]) ? 1 : 0;
+    }
+
+    const int edge_count = exclusive_scan(edge_index.data(), edge_index.data(), side_count);
+    const uint64_t point_mask = (uint64_t(1) << point_bits) - 1;
+    topology.edges.resize(2*edge_count);
+    topology.face_offsets.resize(edge_count + 1);
+
+    #pragma omp parallel for schedule(static, 1000) if (side_count > 5000)
+    for (int i = 0; i < side_count; i++) {
+        bool first = (i+1 < side_count) ? (edge_index[i+1] != edge_index[i]) : (edge_index[i] < edge_count);
+        if (first) {
+            int e = edge_index[i];
+            topology.edges[2*e] = static_cast<int>(keys[i] >> point_bits);
+            topology.edges[2*e + 1] = static_cast<int>(keys[i] & point_mask);
+            topology.face_offsets[e] = i;
+        }
+    }
+    topology.face_offsets[edge_count] = side_count;
+}
+
+void VtkExtractEdgesEffect::compute_face_normals(vtkPolyData *mesh, std::vector<double> &face_normals) {
+    auto polys = mesh->GetPolys();
+    auto points = mesh->GetPoints();
+    polys->ConvertTo32BitStorage();
+    const int *offsets = polys->GetOffsetsArray32()->GetPointer(0);
+    const int *connectivity = polys->GetConnectivityArray32()->GetPointer(0);
+    const int face_count = polys->GetNumberOfCells();
+    face_normals.resize(3*face_count);
+
+    #pragma omp parallel for schedule(static, 1000) if (face_count > 5000)
+    for (int f = 0; f < face_count; f++) {
+        int start = offsets[f], n = offsets[f+1] - offsets[f];
+        double normal[3] = {0, 0, 0};
+        double a[3], b[3];
+        if (n > 0) {
+            points->GetPoint(connectivity[start + n - 1], a);
+        }
+        for (int k = 0; k < n; k++) {
+            points->GetPoint(connectivity[start + k], b);
+            normal[0] += (a[1] - b[1]) * (a[2] + b[2]);
+            normal[1] += (a[2] - b[2]) * (a[0] + b[0]);
+            normal[2] += (a[0] - b[0]) * (a[1] + b[1]);
+            std::copy(b, b + 3, a);
+        }
+
+        double length = std::sqrt(vec3_dot(normal, normal));
+        for (int i = 0; i < 3; i++) {
+            face_normals[3*f + i] = (length > 0) ? normal[i] / length : 0.0;
+        }
+    }
+}
+
+void VtkExtractEdgesEffect::classify_edges(const EdgeTopology &topology, const std::vector<double> &face_normals,
+                                           double feature_angle, std::vector<uint8_t> &edge_labels) {
+    const int edge_count = topology.GetNumberOfEdges();
+    const double cos_feature_angle = std::cos(vtkMath::RadiansFromDegrees(feature_angle));
+    const bool has_normals = !face_normals.empty();
+    edge_labels.resize(edge_count);
+
+    #pragma omp parallel for schedule(static, 1000) if (edge_count > 5000)
+    for (int e = 0; e < edge_count; e++) {
+        int start = topology.face_offsets[e];
+        int n = topology.face_offsets[e+1] - start;
+
+        if (n == 1) {
+            edge_labels[e] = EDGE_BOUNDARY;
+        } else if (n > 2) {
+            edge_labels[e] = EDGE_NON_MANIFOLD;
+        } else if (has_normals && vec3_dot(&face_normals[3*topology.edge_faces[start]],
+                                           &face_normals[3*topology.edge_faces[start + 1]]) <= cos_feature_angle) {
+            edge_labels[e] = EDGE_FEATURE;
+        } else {
+            edge_labels[e] = EDGE_MANIFOLD;
+        }
+    }
+}
@@ -24,6 +24,7 @@ THE SOFTWARE.
 #pragma once
 
 #include "VtkEffect.h"
+#include <vector>
 
 class VtkExtractEdgesEffect : public VtkEffect {
 private:
@@ -34,10 +35,45 @@ private:
     const char *PARAM_MANIFOLD_EDGES = "ManifoldEdges";
 
 public:
+    // edge labels computed by classify_edges()
+    static const int EDGE_BOUNDARY = 1; // one adjacent polygon
+    static const int EDGE_NON_MANIFOLD = 2; // three or more adjacent polygons
+    static const int EDGE_MANIFOLD = 3; // two adjacent polygons
+    static const int EDGE_FEATURE = 4; // two adjacent polygons with angle at least the feature angle
+
+    /* Unique edges of polygons, with polygons adjacent to each edge.
+     * */
+    struct EdgeTopology {
+        std::vector<int> edges; // 2 per edge (smaller point ID first), ordered by point IDs
+        std::vector<int> face_offsets; // per edge + 1, adjacent faces of edge e are edge_faces[face_offsets[e]...face_offsets[e+1]]
+        std::vector<int> edge_faces; // polygon IDs, in increasing order for each edge
+
+        int GetNumberOfEdges() const {
+            return edges.size() / 2;
+        }
+    };
+
     const char* GetName() override;
     OfxStatus vtkDescribe(OfxParamSetHandle parameters, VtkEffectInputDef &input_mesh, VtkEffectInputDef &output_mesh) override;
     OfxStatus vtkCook(VtkEffectInput &main_input, VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs) override;
     static OfxStatus vtkCook_inner(vtkPolyData *input_polydata, vtkPolyData *output_polydata,
                                    double feature_angle, bool extract_feature_edges, bool extract_boundary_edges,
                                    bool extract_nonmanifold_edegs, bool extract_manifold_edges);
+
+    /* Build unique edges of polygons of the mesh: (min, max) point pair for each polygon side,
+     * radix sorted, equal pairs are merged into one edge listing the polygons. Polygon sides
+     * with the same point at both ends are skipped. Parallel, result does not depend on number of threads.
+     * */
+    static void build_edge_topology(vtkPolyData *mesh, EdgeTopology &topology);
+
+    /* Unit normals of polygons (xyz), using Newell's method, so that any polygon works,
+     * not just triangles. Degenerate polygons get zero normal.
+     * */
+    static void compute_face_normals(vtkPolyData *mesh, std::vector<double> &face_normals);
+
+    /* Label each edge of topology as EDGE_BOUNDARY, EDGE_NON_MANIFOLD, EDGE_MANIFOLD or EDGE_FEATURE
+     * (feature angle is in degrees). Pass empty face_normals when feature edges are not needed.
+     * */
+    static void classify_edges(const EdgeTopology &topology, const std::vector<double> &face_normals,
+                               double feature_angle, std::vector<uint8_t> &edge_labels);
 };
@@ -21,12 +21,14 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
-#include <vtkTubeFilter.h>
-#include <vtkTriangleFilter.h>
-#include <vtkAppendPolyData.h>
-#include <vtkExtractEdges.h>
+#include <vtkCellArray.h>
+#include <vtkMath.h>
+#include <vtkPoints.h>
+#include <cstring>
 
 #include "VtkMakeTubesEffect.h"
+#include "VtkExtractEdgesEffect.h"
+#include "mfx_vtk_utils.h"
 
 const char *VtkMakeTubesEffect::GetName() {
     return "Make tubes";
@@ -52,40 +54,258 @@ OfxStatus VtkMakeTubesEffect::vtkCook(VtkEffectInput &main_input, VtkEffectInput
 
 OfxStatus VtkMakeTubesEffect::vtkCook_inner(vtkPolyData *input_polydata, vtkPolyData *output_polydata, double radius,
                                             int number_of_sides, bool capping) {
-    auto append_poly_data = vtkSmartPointer<vtkAppendPolyData>::New();
-
-    if (input_polydata->GetNumberOfPolys() > 0) {
-        // vtkExtractEdges to create lines even from polygonal mesh
-        auto extract_edges_filter = vtkSmartPointer<vtkExtractEdges>::New();
-        extract_edges_filter->SetInputData(input_polydata);
-        extract_edges_filter->Update();
-        append_poly_data->AddInputData(extract_edges_filter->GetOutput());
-    } else {
-        append_poly_data->AddInputData(input_polydata);
+    auto input_lines = input_polydata->GetLines();
+    input_lines->ConvertTo32BitStorage();
+    const int *input_offsets = input_lines->GetOffsetsArray32()->GetPointer(0);
+    const int *input_connectivity = input_lines->GetConnectivityArray32()->GetPointer(0);
+    const int input_line_count = input_lines->GetNumberOfCells();
+
+    if (input_polydata->GetNumberOfPolys() == 0) {
+        return generate_tubes(input_polydata->GetPoints(), input_polydata->GetPointData(), input_offsets,
+                              input_connectivity, input_line_count, radius, number_of_sides, capping, output_polydata);
+    }
+
+    // create lines even from polygonal mesh: unique polygon edges, followed by original lines
+    VtkExtractEdgesEffect::EdgeTopology topology;
+    VtkExtractEdgesEffect::build_edge_topology(input_polydata, topology);
+
+    const int input_connectivity_size = input_offsets[input_line_count];
+    const int edge_count = topology.GetNumberOfEdges();
+    std::vector<int> offsets(edge_count + input_line_count + 1);
+    std::vector<int> connectivity(topology.edges);
+    connectivity.insert(connectivity.end(), input_connectivity, input_connectivity + input_connectivity_size);
+
+    #pragma omp parallel for schedule(static, 1000) if (edge_count > 5000)
+    for (int e = 0; e < edge_count; e++) {
+        offsets[e] = 2*e;
+    }
+    for (int i = 0; i <= input_line_count; i++) {
+        offsets[edge_count + i] = 2*edge_count + input_offsets[i];
+    }
+
+    // TODO incorporate optional tube bending, like vtkTubeBender - when it lands post VTK 9.0
+
+    return generate_tubes(input_polydata->GetPoints(), input_polydata->GetPointData(), offsets.data(),
+                          connectivity.data(), edge_count + input_line_count, radius, number_of_sides, capping,
+                          output_polydata);
+}
+
+OfxStatus VtkMakeTubesEffect::generate_tubes(vtkPoints *points, vtkPointData *point_data, const int *line_offsets,
+                                             const int *line_connectivity, int line_count, double radius,
+                                             int number_of_sides, bool capping, vtkPolyData *output_polydata) {
+    const int sides = number_of_sides;
+
+    // count rings (distinct consecutive points) per line, lines with less than two get no tube
+    std::vector<int> ring_offsets(line_count + 1);
+    std::vector<int> tube_offsets(line_count + 1);
+
+    #pragma omp parallel for schedule(static, 1000) if (line_count > 5000)
+    for (int l = 0; l < line_count; l++) {
+        int ring_count = 0;
+        double previous[3], x[3];
+        for (int k = line_offsets[l]; k < line_offsets[l+1]; k++) {
+            points->GetPoint(line_connectivity[k], x);
+            if (ring_count == 0 || vec3_squared_distance(previous, x) > 0) {
+                ring_count++;
+                std::copy(x, x + 3, previous);
+            }
+        }
+        ring_offsets[l] = (ring_count >= 2) ? ring_count : 0;
+        tube_offsets[l] = (ring_count >= 2) ? 1 : 0;
+    }
+
+    const int64_t ring_count = exclusive_scan(ring_offsets.data(), ring_offsets.data(), line_count);
+    const int64_t tube_count = exclusive_scan(tube_offsets.data(), tube_offsets.data(), line_count);
+    ring_offsets[line_count] = ring_count;
+    tube_offsets[line_count] = tube_count;
+
+    // each tube has one ring of points per line point, quads between consecutive rings and two caps
+    const int64_t segment_count = ring_count - tube_count;
+    const int64_t cap_count = capping ? 2*tube_count : 0;
+    const int64_t output_point_count = ring_count * sides;
+    const int64_t output_face_count = segment_count * sides + cap_count;
+    const int64_t output_connectivity_size = 4 * segment_count * sides + cap_count * sides;
+
+    const int64_t max_count = 2000000000;
+    if (output_connectivity_size > max_count) {
+        printf("VtkMakeTubesEffect - error, would generate %lld face corners (limit is %lld), use less sides\n",
+               static_cast<long long>(output_connectivity_size), static_cast<long long>(max_count));
+        return kOfxStatFailed;
     }
 
-    // TODO incorporate optional vtkTubeBender - when it lands post VTK 9.0
-    // if (use_tube_bender) {
-    //    auto tube_bender_filter = vtkSmartPointer<vtkTubeBender>::New();
-    //    tube_bender_filter->SetInputConnection(extract_edges_filter->GetOutputPort());
-    //    tube_filter_input = tube_bender_filter->GetOutputPort();
-    // }
-
-    // vtkTubeFilter to turn lines into polygonal tubes
-    auto tube_filter = vtkSmartPointer<vtkTubeFilter>::New();
-    tube_filter->SetInputConnection(append_poly_data->GetOutputPort());
-    tube_filter->SetRadius(radius);
-    tube_filter->SetNumberOfSides(number_of_sides);
-    tube_filter->SetCapping(capping);
-    tube_filter->SetSidesShareVertices(true);
-
-    // vtkTriangleFilter to convert triangle strips to polygons
-    auto triangle_filter = vtkSmartPointer<vtkTriangleFilter>::New();
-    triangle_filter->SetInputConnection(tube_filter->GetOutputPort());
-
-    triangle_filter->Update();
-
-    auto filter_output = triangle_filter->GetOutput();
-    output_polydata->ShallowCopy(filter_output);
+    auto output_points = vtkSmartPointer<vtkPoints>::New();
+    output_points->SetDataTypeToFloat();
+    output_points->SetNumberOfPoints(output_point_count);
+    float *positions = reinterpret_cast<float*>(output_points->GetVoidPointer(0));
+
+    auto output_offsets = vtkSmartPointer<vtkTypeInt32Array>::New();
+    auto output_connectivity = vtkSmartPointer<vtkTypeInt32Array>::New();
+    output_offsets->SetNumberOfValues(output_face_count + 1);
+    output_connectivity->SetNumberOfValues(output_connectivity_size);
+    int *offsets = output_offsets->GetPointer(0);
+    int *connectivity = output_connectivity->GetPointer(0);
+
+    // point data arrays to be copied from line points to their rings, tuples are copied as bytes
+    struct PointDataCopy {
+        const char *src;
+        char *dst;
+        size_t tuple_size;
+    };
+    std::vector<PointDataCopy> point_data_copies;
+    std::vector<vtkSmartPointer<vtkDataArray>> output_point_data_arrays;
+    if (point_data) {
+        for (int i = 0; i < point_data->GetNumberOfArrays(); i++) {
+            vtkDataArray *arr = point_data->GetArray(i);
+            if (!arr || arr->GetNumberOfTuples() != points->GetNumberOfPoints() || !arr->GetName() ||
+                !arr->HasStandardMemoryLayout() || strcmp(arr->GetName(), ATTRIBUTE_NORMAL) == 0) continue;
+
+            vtkSmartPointer<vtkDataArray> arr_out;
+            arr_out.TakeReference(arr->NewInstance());
+            arr_out->SetName(arr->GetName());
+            arr_out->SetNumberOfComponents(arr->GetNumberOfComponents());
+            arr_out->SetNumberOfTuples(output_point_count);
+            output_point_data_arrays.push_back(arr_out);
+            point_data_copies.push_back({static_cast<const char*>(arr->GetVoidPointer(0)),
+                                         static_cast<char*>(arr_out->GetVoidPointer(0)),
+                                         static_cast<size_t>(arr->GetDataTypeSize()) * arr->GetNumberOfComponents()});
+        }
+    }
+
+    std::vector<double> ring_angle_cos(sides), ring_angle_sin(sides);
+    for (int j = 0; j < sides; j++) {
+        double angle = 2.0 * vtkMath::Pi() * j / sides;
+        ring_angle_cos[j] = std::cos(angle);
+        ring_angle_sin[j] = std::sin(angle);
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1000) if (line_count > 5000)
+    for (int l = 0; l < line_count; l++) {
+        const int first_ring = ring_offsets[l];
+        const int rings = ring_offsets[l+1] - first_ring;
+        if (rings == 0) continue;
+
+        // walk distinct points of the line directly (consecutive duplicates are skipped, as when counting rings)
+        const int line_end = line_offsets[l+1];
+        auto next_distinct = [&](int k, const double x[3], double next_x[3]) -> int {
+            for (k++; k < line_end; k++) {
+                points->GetPoint(line_connectivity[k], next_x);
+                if (vec3_squared_distance(x, next_x) > 0) break;
+            }
+            return k;
+        };
+
+        // write rings, moving the normal along the line (sliding normals), so that the tube does not twist
+        double previous[3], center[3], next[3];
+        double tangent[3] = {0, 0, 0}, normal[3] = {0, 0, 0};
+        int k = line_offsets[l];
+        points->GetPoint(line_connectivity[k], center);
+        for (int r = 0; r < rings; r++) {
+            const int center_id = line_connectivity[k];
+            if (r + 1 < rings) {
+                k = next_distinct(k, center, next);
+            }
+
+            double new_tangent[3] = {0, 0, 0};
+            if (r > 0) {
+                double d[3] = {center[0] - previous[0], center[1] - previous[1], center[2] - previous[2]};
+                double length = std::sqrt(vec3_dot(d, d));
+                for (int a = 0; a < 3; a++) new_tangent[a] += d[a] / length;
+            }
+            if (r + 1 < rings) {
+                double d[3] = {next[0] - center[0], next[1] - center[1], next[2] - center[2]};
+                double length = std::sqrt(vec3_dot(d, d));
+                for (int a = 0; a < 3; a++) new_tangent[a] += d[a] / length;
+            }
+            // if the line turns back on itself, the sum vanishes and we keep the previous tangent
+            // (and with it, the previous ring orientation); this can't happen at the ends
+            double tangent_length = std::sqrt(vec3_dot(new_tangent, new_tangent));
+            if (tangent_length > 1e-6) {
+                for (int a = 0; a < 3; a++) tangent[a] = new_tangent[a] / tangent_length;
+            }
+
+            double dot = vec3_dot(normal, tangent);
+            for (int a = 0; a < 3; a++) normal[a] -= dot * tangent[a];
+            double normal_length = std::sqrt(vec3_dot(normal, normal));
+            if (normal_length < 1e-6) {
+                // start from the axis which is the most perpendicular to the tangent
+                int axis = 0;
+                for (int a = 1; a < 3; a++) {
+                    if (std::abs(tangent[a]) < std::abs(tangent[axis])) axis = a;
+                }
+                std::fill(normal, normal + 3, 0.0);
+                normal[axis] = 1;
+                dot = vec3_dot(normal, tangent);
+                for (int a = 0; a < 3; a++) normal[a] -= dot * tangent[a];
+                normal_length = std::sqrt(vec3_dot(normal, normal));
+            }
+            for (int a = 0; a < 3; a++) normal[a] /= normal_length;
+
+            double binormal[3];
+            vtkMath::Cross(tangent, normal, binormal);
+
+            float *ring_positions = &positions[3 * static_cast<int64_t>(first_ring + r) * sides];
+            for (int j = 0; j < sides; j++) {
+                for (int a = 0; a < 3; a++) {
+                    ring_positions[3*j + a] = static_cast<float>(center[a] + radius * (ring_angle_cos[j] * normal[a] +
+                                                                                        ring_angle_sin[j] * binormal[a]));
+                }
+            }
+
+            for (const auto &copy : point_data_copies) {
+                const char *src = copy.src + copy.tuple_size * center_id;
+                char *dst = copy.dst + copy.tuple_size * static_cast<int64_t>(first_ring + r) * sides;
+                for (int j = 0; j < sides; j++) {
+                    std::memcpy(dst + copy.tuple_size * j, src, copy.tuple_size);
+                }
+            }
+
+            if (r + 1 < rings) {
+                std::copy(center, center + 3, previous);
+                std::copy(next, next + 3, center);
+            }
+        }
+
+        // write quads between consecutive rings (facing outwards), then caps
+        const int tube = tube_offsets[l];
+        int face = (first_ring - tube) * sides + (capping ? 2*tube : 0);
+        int corner = 4 * (first_ring - tube) * sides + (capping ? 2*tube*sides : 0);
+
+        for (int r = 0; r + 1 < rings; r++) {
+            int ring_start = (first_ring + r) * sides;
+            for (int j = 0; j < sides; j++) {
+                int next_j = (j + 1 < sides) ? j + 1 : 0;
+                offsets[face++] = corner;
+                connectivity[corner++] = ring_start + j;
+                connectivity[corner++] = ring_start + next_j;
+                connectivity[corner++] = ring_start + sides + next_j;
+                connectivity[corner++] = ring_start + sides + j;
+            }
+        }
+
+        if (capping) {
+            int start_ring = first_ring * sides;
+            int end_ring = (first_ring + rings - 1) * sides;
+            offsets[face++] = corner;
+            for (int j = sides - 1; j >= 0; j--) {
+                connectivity[corner++] = start_ring + j;
+            }
+            offsets[face++] = corner;
+            for (int j = 0; j < sides; j++) {
+                connectivity[corner++] = end_ring + j;
+            }
+        }
+    }
+    offsets[output_face_count] = output_connectivity_size;
+
+    auto output_polys = vtkSmartPointer<vtkCellArray>::New();
+    output_polys->SetData(output_offsets, output_connectivity);
+
+    auto temp_polydata = vtkSmartPointer<vtkPolyData>::New();
+    temp_polydata->SetPoints(output_points);
+    temp_polydata->SetPolys(output_polys);
+    for (auto &arr : output_point_data_arrays) {
+        temp_polydata->GetPointData()->AddArray(arr);
+    }
+    output_polydata->ShallowCopy(temp_polydata);
     return kOfxStatOK;
 }
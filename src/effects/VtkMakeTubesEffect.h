@@ -25,12 +25,15 @@ THE SOFTWARE.
 
 #include "VtkEffect.h"
 
+#include <vtkPointData.h>
+
 class VtkMakeTubesEffect : public VtkEffect {
 private:
     const char *PARAM_RADIUS = "Radius";
     const char *PARAM_NUMBER_OF_SIDES = "NumberOfSides";
     const char *PARAM_CAPPING = "Capping";
     // const char *PARAM_TUBE_BENDER = "TubeBender";
+    static constexpr const char *ATTRIBUTE_NORMAL = "normal0"; // not passed to tubes, their points face outwards
 
 public:
     const char* GetName() override;
@@ -38,4 +41,13 @@ public:
     OfxStatus vtkCook(VtkEffectInput &main_input, VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs) override;
     static OfxStatus vtkCook_inner(vtkPolyData *input_polydata, vtkPolyData *output_polydata,
                                    double radius, int number_of_sides, bool capping);
+
+    /* Tubes along lines (32-bit offsets and connectivity, polylines are followed through): a ring of
+     * number_of_sides points at each line point, quads between consecutive rings and polygon caps
+     * at both ends. Output sizes are computed first, then all lines are written in parallel.
+     * Point data of each line point (if point_data is given) is copied to all points of its ring.
+     * */
+    static OfxStatus generate_tubes(vtkPoints *points, vtkPointData *point_data, const int *line_offsets,
+                                    const int *line_connectivity, int line_count, double radius, int number_of_sides,
+                                    bool capping, vtkPolyData *output_polydata);
 };
@@ -22,19 +22,22 @@ THE SOFTWARE.
 */
 
 #include "VtkPokeEffect.h"
+#include "VtkEffectUtils.h"
 #include "mfx_vtk_utils.h"
 #include "VtkDistanceAlongSurfaceEffect.h"
 #include <chrono>
+#include <algorithm>
+#include <iterator>
 #include <vtkPointData.h>
 #include <vtkCellData.h>
-#include <vtkIdFilter.h>
+#include <vtkIdList.h>
 #include <vtkFloatArray.h>
+#include <vtkUnsignedCharArray.h>
 #include <vtkPolyDataNormals.h>
-#include <vtkThreshold.h>
-#include <vtkGeometryFilter.h>
+#include <vtkCellArray.h>
 #include <vtkModifiedBSPTree.h>
+#include <vtkImplicitPolyDataDistance.h>
 #include <vtkOctreePointLocator.h>
-#include <vtkStaticCellLinks.h>
 #include <vtkWarpVector.h>
 #include <vtkXMLPolyDataWriter.h>
 #include <vtkTransform.h>
@@ -58,21 +61,79 @@ OfxStatus VtkPokeEffect::vtkDescribe(OfxParamSetHandle parameters, VtkEffectInpu
     AddParam(PARAM_COLLISION_SMOOTHING_RATIO, 0.001).Range(0.0, 1.0).Label("Collision smoothing ratio");
     AddParam(PARAM_COLLIDER_NORMAL_FACTOR, 0.0).Range(0.0, 1.0).Label("Collider normal factor");
     AddParam(PARAM_NUMBER_OF_ITERATIONS, 20).Range(1, 10000).Label("Number of iterations");
+    AddParam(PARAM_SOLVER, SOLVER_ITERATIVE).Range(1, 2).Label("Solver"); // TODO make this enum!
     AddParam(PARAM_OFFSET, 0.0).Range(0.0, 1e6).Label("Offset");
+    AddParam(PARAM_TEMPORAL_COHERENCE, false).Label("Temporal coherence");
+    AddParam(PARAM_COLLIDER_MODE, COLLIDER_MODE_RAYS).Range(1, 2).Label("Collider mode"); // TODO make this enum!
+    AddParam(PARAM_SDF_VOXEL_SIZE, 0.0).Range(0.0, 1e6).Label("SDF voxel size");
+    AddParam(PARAM_DISTANCE_MODE, VtkDistanceAlongSurfaceEffect::DISTANCE_MODE_GRAPH).Range(1, 2).Label("Distance mode"); // TODO make this enum!
     AddParam(PARAM_DEBUG, false).Label("Debug");
     return kOfxStatOK;
 }
 
+OfxStatus VtkPokeEffect::DestroyInstance(OfxMeshEffectHandle instance) {
+    {
+        std::lock_guard<std::mutex> lock(instance_states_mutex);
+        instance_states.erase(instance);
+    }
+    return VtkEffect::DestroyInstance(instance);
+}
+
+OfxStatus VtkPokeEffect::vtkCookInstance(OfxMeshEffectHandle instance, VtkEffectInput &main_input,
+                                         VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs) {
+    // map nodes do not move, so the state can be used after unlocking
+    InstanceState *instance_state;
+    {
+        std::lock_guard<std::mutex> lock(instance_states_mutex);
+        instance_state = &instance_states[instance];
+    }
+    return vtkCook(main_input, main_output, extra_inputs, instance_state);
+}
+
 OfxStatus VtkPokeEffect::vtkCook(VtkEffectInput &main_input, VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs) {
+    return vtkCook(main_input, main_output, extra_inputs, nullptr);
+}
+
+OfxStatus VtkPokeEffect::vtkCook(VtkEffectInput &main_input, VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs,
+                                 InstanceState *instance_state) {
     auto max_distance = GetParam<double>(PARAM_MAX_DISTANCE).GetValue();
     auto falloff_radius = GetParam<double>(PARAM_FALLOFF_RADIUS).GetValue();
     auto falloff_exponent = GetParam<double>(PARAM_FALLOFF_EXPONENT).GetValue();
     auto collision_smoothing_ratio = GetParam<double>(PARAM_COLLISION_SMOOTHING_RATIO).GetValue();
     auto collider_normal_factor = GetParam<double>(PARAM_COLLIDER_NORMAL_FACTOR).GetValue();
     auto number_of_iterations = GetParam<int>(PARAM_NUMBER_OF_ITERATIONS).GetValue();
+    auto solver = GetParam<int>(PARAM_SOLVER).GetValue();
     auto offset = GetParam<double>(PARAM_OFFSET).GetValue();
+    auto temporal_coherence = GetParam<bool>(PARAM_TEMPORAL_COHERENCE).GetValue();
+    auto collider_mode = GetParam<int>(PARAM_COLLIDER_MODE).GetValue();
+    auto sdf_voxel_size = GetParam<double>(PARAM_SDF_VOXEL_SIZE).GetValue();
+    auto distance_mode = GetParam<int>(PARAM_DISTANCE_MODE).GetValue();
     auto debug = GetParam<bool>(PARAM_DEBUG).GetValue();
 
+    // XXX until we have enums...
+    solver = clamp(solver, SOLVER_ITERATIVE, SOLVER_CONJUGATE_GRADIENT);
+    collider_mode = clamp(collider_mode, COLLIDER_MODE_RAYS, COLLIDER_MODE_SDF);
+    distance_mode = clamp(distance_mode, VtkDistanceAlongSurfaceEffect::DISTANCE_MODE_GRAPH,
+                          VtkDistanceAlongSurfaceEffect::DISTANCE_MODE_FAST_MARCHING);
+
+    // keep the distance field around, so that it's built only once for a static collider
+    ColliderSdf *collider_sdf = nullptr;
+    if (instance_state && collider_mode == COLLIDER_MODE_SDF) {
+        collider_sdf = &instance_state->collider_sdf;
+    } else if (instance_state) {
+        instance_state->collider_sdf = ColliderSdf();
+    }
+
+    // keep the surface graph around, so that it's only built once for a mesh with fixed topology
+    ReactionCache *reaction_cache = (instance_state) ? &instance_state->reaction_cache : nullptr;
+
+    TemporalState *temporal_state = nullptr;
+    if (instance_state && temporal_coherence) {
+        temporal_state = &instance_state->temporal_state;
+    } else if (instance_state) {
+        instance_state->temporal_state = TemporalState();
+    }
+
     VtkEffectInput *collider_input = vtkFindInput(extra_inputs, INPUT_COLLIDER);
     double input_collider_transform[16];
 
@@ -84,23 +145,13 @@ OfxStatus VtkPokeEffect::vtkCook(VtkEffectInput &main_input, VtkEffectInput &mai
 
     return vtkCook_inner(main_input.data, (collider_input) ? collider_input->data : nullptr, main_output.data,
                          ATTRIBUTE_COLOR, input_collider_transform, max_distance, falloff_radius, falloff_exponent,
-                         collision_smoothing_ratio, offset, number_of_iterations, debug, collider_normal_factor);
+                         collision_smoothing_ratio, offset, number_of_iterations, debug, collider_normal_factor, solver,
+                         temporal_state, collider_mode, sdf_voxel_size, collider_sdf, distance_mode, reaction_cache);
 }
 
-static const char *POINT_ID_ARRAY_NAME = "_PointId";
 const int THRESHOLD_VALUE_COLLIDER = 0;
 const int THRESHOLD_VALUE_MESH = 255;
 
-static void compute_point_ids(vtkPolyData* input_polydata, vtkPolyData* output_polydata) {
-    auto id_filter = vtkSmartPointer<vtkIdFilter>::New();
-    id_filter->SetInputData(input_polydata);
-    id_filter->SetPointIds(true);
-    id_filter->SetPointIdsArrayName(POINT_ID_ARRAY_NAME);
-    id_filter->SetCellIds(false);
-    id_filter->Update();
-    output_polydata->ShallowCopy(id_filter->GetOutput());
-}
-
 static void compute_normals(vtkPolyData* input_polydata, vtkPolyData* output_polydata, bool point_normals, bool cell_normals) {
     auto normals_filter = vtkSmartPointer<vtkPolyDataNormals>::New();
     normals_filter->SetInputData(input_polydata);
@@ -113,20 +164,198 @@ static void compute_normals(vtkPolyData* input_polydata, vtkPolyData* output_pol
     output_polydata->ShallowCopy(normals_filter->GetOutput());
 }
 
-static void scalar_threshold(vtkPolyData* input_polydata, vtkPolyData* output_polydata, const char *point_array_name, int value) {
-    // separate input into collider part and mesh part
-    auto threshold_filter = vtkSmartPointer<vtkThreshold>::New();
-    threshold_filter->SetInputArrayToProcess(0, 0, 0, vtkDataObject::FIELD_ASSOCIATION_POINTS, point_array_name);
-    threshold_filter->ThresholdBetween(value, value);
-    threshold_filter->SetInputData(input_polydata);
+static void copy_tuples(vtkFieldData *input_data, vtkFieldData *output_data, vtkIdList *ids) {
+    for (int k = 0; k < input_data->GetNumberOfArrays(); k++) {
+        auto input_array = input_data->GetAbstractArray(k);
+        auto output_array = vtk::TakeSmartPointer(input_array->NewInstance());
+        output_array->SetName(input_array->GetName());
+        output_array->SetNumberOfComponents(input_array->GetNumberOfComponents());
+        output_array->SetNumberOfTuples(ids->GetNumberOfIds());
+        input_array->GetTuples(ids, output_array);
+        output_data->AddArray(output_array);
+    }
+}
+
+/*
+ * Keep points whose point_array_name (first component) equals value and cells whose points are all kept;
+ * output only has points used by kept cells. This gives the same result as vtkThreshold followed by
+ * vtkGeometryFilter (no merging), without building the intermediate vtkUnstructuredGrid.
+ *
+ * If point_map is not null, it receives the input point ID of each output point.
+ * input_polydata and output_polydata may be the same object. Triangle strips are not supported.
+ */
+static void scalar_threshold(vtkPolyData* input_polydata, vtkPolyData* output_polydata, vtkIdList *point_map,
+                             const char *point_array_name, int value) {
+    int num_points = input_polydata->GetNumberOfPoints();
+    auto scalar_arr = input_polydata->GetPointData()->GetArray(point_array_name);
+
+    // flag points
+    std::vector<char> point_flag(num_points);
+    auto scalar_arr_uchar = vtkUnsignedCharArray::SafeDownCast(scalar_arr);
+    if (scalar_arr_uchar) {
+        const unsigned char *scalar_ptr = scalar_arr_uchar->GetPointer(0);
+        int stride = scalar_arr_uchar->GetNumberOfComponents();
+
+        #pragma omp parallel for schedule(static, 1000) if (num_points > 5000)
+        for (int i = 0; i < num_points; i++) {
+            point_flag[i] = scalar_ptr[i*stride] == value;
+        }
+    } else {
+        #pragma omp parallel for schedule(static, 1000) if (num_points > 5000)
+        for (int i = 0; i < num_points; i++) {
+            point_flag[i] = scalar_arr->GetComponent(i, 0) == value;
+        }
+    }
+
+    // flag cells, and points used by kept cells
+    // cell IDs in cell data are numbered verts, lines, polys (, strips)
+    vtkCellArray *input_cells[3] = {input_polydata->GetVerts(), input_polydata->GetLines(), input_polydata->GetPolys()};
+    std::vector<int> cell_kept[3]; // 0/1, then scanned into output cell ID
+    std::vector<int> cell_kept_size[3]; // cell size or 0, then scanned into output offset
+    int num_output_cells[3] = {0, 0, 0};
+    int num_output_ids[3] = {0, 0, 0};
+    std::vector<int> point_new_id(num_points, 0); // 0/1 used flag, then scanned into output point ID
+
+    for (int k = 0; k < 3; k++) {
+        int num_cells = input_cells[k] ? input_cells[k]->GetNumberOfCells() : 0;
+        if (num_cells == 0) continue;
+        cell_kept[k].resize(num_cells);
+        cell_kept_size[k].resize(num_cells);
+
+        visit_cell_array(input_cells[k], [&](auto *offsets, auto *connectivity) {
+            #pragma omp parallel for schedule(static, 1000) if (num_cells > 5000)
+            for (int i = 0; i < num_cells; i++) {
+                bool keep = true;
+                for (auto j = offsets[i]; j < offsets[i+1] && keep; j++) {
+                    keep = point_flag[connectivity[j]];
+                }
+                cell_kept[k][i] = keep;
+                cell_kept_size[k][i] = keep ? (int)(offsets[i+1] - offsets[i]) : 0;
+                if (keep) {
+                    for (auto j = offsets[i]; j < offsets[i+1]; j++) {
+                        #pragma omp atomic write
+                        point_new_id[connectivity[j]] = 1;
+                    }
+                }
+            }
+        });
+
+        num_output_cells[k] = exclusive_scan(cell_kept[k].data(), cell_kept[k].data(), num_cells);
+        num_output_ids[k] = exclusive_scan(cell_kept_size[k].data(), cell_kept_size[k].data(), num_cells);
+    }
+
+    int num_output_points = exclusive_scan(point_new_id.data(), point_new_id.data(), num_points);
+
+    // output -> input maps, used to gather points and attributes
+    auto output_point_map = vtkSmartPointer<vtkIdList>::New();
+    output_point_map->SetNumberOfIds(num_output_points);
+    vtkIdType *output_point_map_ptr = output_point_map->GetPointer(0);
+
+    #pragma omp parallel for schedule(static, 1000) if (num_points > 5000)
+    for (int i = 0; i < num_points; i++) {
+        int next_id = (i+1 < num_points) ? point_new_id[i+1] : num_output_points;
+        if (next_id != point_new_id[i]) {
+            output_point_map_ptr[point_new_id[i]] = i;
+        }
+    }
+
+    auto output_cell_map = vtkSmartPointer<vtkIdList>::New();
+    output_cell_map->SetNumberOfIds(num_output_cells[0] + num_output_cells[1] + num_output_cells[2]);
+    vtkIdType *output_cell_map_ptr = output_cell_map->GetPointer(0);
+
+    vtkSmartPointer<vtkCellArray> output_cells[3];
+    int input_cell_id_offset = 0, output_cell_id_offset = 0;
+
+    for (int k = 0; k < 3; k++) {
+        int num_cells = input_cells[k] ? input_cells[k]->GetNumberOfCells() : 0;
+
+        auto offsets_arr = vtkSmartPointer<vtkTypeInt32Array>::New();
+        auto connectivity_arr = vtkSmartPointer<vtkTypeInt32Array>::New();
+        offsets_arr->SetNumberOfValues(num_output_cells[k] + 1);
+        connectivity_arr->SetNumberOfValues(num_output_ids[k]);
+        int *output_offsets = offsets_arr->GetPointer(0);
+        int *output_connectivity = connectivity_arr->GetPointer(0);
+        output_offsets[num_output_cells[k]] = num_output_ids[k];
+
+        if (num_output_cells[k] > 0) {
+            visit_cell_array(input_cells[k], [&](auto *offsets, auto *connectivity) {
+                #pragma omp parallel for schedule(static, 1000) if (num_cells > 5000)
+                for (int i = 0; i < num_cells; i++) {
+                    int next_cell = (i+1 < num_cells) ? cell_kept[k][i+1] : num_output_cells[k];
+                    if (next_cell == cell_kept[k][i]) continue; // not kept
+
+                    int output_cell = cell_kept[k][i];
+                    int output_offset = cell_kept_size[k][i];
+                    output_offsets[output_cell] = output_offset;
+                    output_cell_map_ptr[output_cell_id_offset + output_cell] = input_cell_id_offset + i;
+                    for (auto j = offsets[i]; j < offsets[i+1]; j++) {
+                        output_connectivity[output_offset++] = point_new_id[connectivity[j]];
+                    }
+                }
+            });
+        }
+
+        output_cells[k] = vtkSmartPointer<vtkCellArray>::New();
+        output_cells[k]->SetData(offsets_arr, connectivity_arr);
+        input_cell_id_offset += num_cells;
+        output_cell_id_offset += num_output_cells[k];
+    }
+
+    auto output_points = vtkSmartPointer<vtkPoints>::New();
+    output_points->SetDataType(input_polydata->GetPoints()->GetDataType());
+    output_points->SetNumberOfPoints(num_output_points);
+    input_polydata->GetPoints()->GetData()->GetTuples(output_point_map, output_points->GetData());
+
+    auto result = vtkSmartPointer<vtkPolyData>::New();
+    result->SetPoints(output_points);
+    result->SetVerts(output_cells[0]);
+    result->SetLines(output_cells[1]);
+    result->SetPolys(output_cells[2]);
+    copy_tuples(input_polydata->GetPointData(), result->GetPointData(), output_point_map);
+    copy_tuples(input_polydata->GetCellData(), result->GetCellData(), output_cell_map);
+
+    if (point_map) {
+        point_map->DeepCopy(output_point_map);
+    }
+    output_polydata->ShallowCopy(result);
+}
+
+/* Hash of point coordinates, to tell if results cached between cooks were computed for the same points.
+ * */
+static uint64_t hash_points(vtkPoints *points) {
+    if (!points || points->GetNumberOfPoints() == 0) {
+        return 0;
+    }
+    auto data = points->GetData();
+    size_t size = (size_t)data->GetNumberOfTuples() * data->GetNumberOfComponents() * data->GetDataTypeSize();
+    return hash_bytes(data->GetVoidPointer(0), size);
+}
+
+/* IDs of points inside axis-aligned box (xmin, xmax, ymin, ymax, zmin, zmax), in increasing order.
+ * */
+static void points_in_box(vtkPoints *points, const double box[6], std::vector<int> &ids) {
+    int n = points->GetNumberOfPoints();
+    std::vector<int> index(n); // 0/1, then scanned into index in ids
+
+    #pragma omp parallel for schedule(static, 1000) if (n > 5000)
+    for (int i = 0; i < n; i++) {
+        double p[3];
+        points->GetPoint(i, p);
+        index[i] = p[0] >= box[0] && p[0] <= box[1] &&
+                   p[1] >= box[2] && p[1] <= box[3] &&
+                   p[2] >= box[4] && p[2] <= box[5];
+    }
 
-    // vtkThreshold outputs unstructured grid, get vtkPolyData again
-    auto geometry_filter = vtkSmartPointer<vtkGeometryFilter>::New();
-    geometry_filter->SetInputConnection(threshold_filter->GetOutputPort());
-    geometry_filter->SetMerging(false);
-    geometry_filter->Update();
+    int count = exclusive_scan(index.data(), index.data(), n);
+    ids.resize(count);
 
-    output_polydata->ShallowCopy(geometry_filter->GetOutput());
+    #pragma omp parallel for schedule(static, 1000) if (n > 5000)
+    for (int i = 0; i < n; i++) {
+        int next_index = (i+1 < n) ? index[i+1] : count;
+        if (next_index != index[i]) {
+            ids[index[i]] = i;
+        }
+    }
 }
 
 static void transform_polydata(vtkPolyData *input_polydata, vtkPolyData* output_polydata, const double m[16]) {
@@ -150,22 +379,26 @@ OfxStatus VtkPokeEffect::vtkCook_inner(vtkPolyData *input_polydata,
                                        double falloff_radius,
                                        double falloff_exponent, double collision_smoothing_ratio, double offset,
                                        int number_of_iterations,
-                                       bool debug, double collider_normal_factor) {
+                                       bool debug, double collider_normal_factor, int solver,
+                                       TemporalState *temporal_state, int collider_mode, double sdf_voxel_size,
+                                       ColliderSdf *collider_sdf, int distance_mode, ReactionCache *reaction_cache) {
     auto t0 = std::chrono::system_clock::now();
 
     auto mesh_polydata = vtkSmartPointer<vtkPolyData>::New();
     auto collider_polydata = vtkSmartPointer<vtkPolyData>::New();
 
     // remember point IDs so that we can map deformed mesh onto input_polydata
-    compute_point_ids(input_polydata, mesh_polydata);
+    // (null means that mesh_polydata has the same points as input_polydata)
+    vtkSmartPointer<vtkIdList> mesh_point_map;
 
     if (input_collider_polydata) {
         // mesh = WHITE part of input_polydata (or all input_polydata if no color array)
         // collider = BLACK part of input_collider_polydata (or all input_collider_polydata if no color array)
-        compute_normals(mesh_polydata, mesh_polydata, true, false);
+        compute_normals(input_polydata, mesh_polydata, true, false);
         if (mesh_polydata->GetPointData()->HasArray(color_attribute_name)) {
             printf("VtkPokeEffect - using mesh from main input (%s = %d)\n", color_attribute_name, THRESHOLD_VALUE_MESH);
-            scalar_threshold(mesh_polydata, mesh_polydata, color_attribute_name, THRESHOLD_VALUE_MESH);
+            mesh_point_map = vtkSmartPointer<vtkIdList>::New();
+            scalar_threshold(mesh_polydata, mesh_polydata, mesh_point_map, color_attribute_name, THRESHOLD_VALUE_MESH);
         } else {
             printf("VtkPokeEffect - using mesh from main input (all)\n");
         }
@@ -174,7 +407,7 @@ OfxStatus VtkPokeEffect::vtkCook_inner(vtkPolyData *input_polydata,
         compute_normals(collider_polydata, collider_polydata, true, true);
         if (collider_polydata->GetPointData()->HasArray(color_attribute_name)) {
             printf("VtkPokeEffect - using collider from collider input (%s = %d)\n", color_attribute_name, THRESHOLD_VALUE_COLLIDER);
-            scalar_threshold(collider_polydata, collider_polydata, color_attribute_name, THRESHOLD_VALUE_COLLIDER);
+            scalar_threshold(collider_polydata, collider_polydata, nullptr, color_attribute_name, THRESHOLD_VALUE_COLLIDER);
         }else {
             printf("VtkPokeEffect - using collider from collider input (all)\n");
         }
@@ -186,20 +419,23 @@ OfxStatus VtkPokeEffect::vtkCook_inner(vtkPolyData *input_polydata,
             return kOfxStatFailed;
         }
 
-        compute_normals(mesh_polydata, mesh_polydata, true, true);
+        compute_normals(input_polydata, mesh_polydata, true, true);
 
         printf("VtkPokeEffect - using collider from main input (%s = %d)\n", color_attribute_name, THRESHOLD_VALUE_COLLIDER);
         printf("VtkPokeEffect - using mesh from main input (%s = %d)\n", color_attribute_name, THRESHOLD_VALUE_MESH);
-        scalar_threshold(mesh_polydata, collider_polydata, color_attribute_name, THRESHOLD_VALUE_COLLIDER);
-        scalar_threshold(mesh_polydata, mesh_polydata, color_attribute_name, THRESHOLD_VALUE_MESH);
+        mesh_point_map = vtkSmartPointer<vtkIdList>::New();
+        scalar_threshold(mesh_polydata, collider_polydata, nullptr, color_attribute_name, THRESHOLD_VALUE_COLLIDER);
+        scalar_threshold(mesh_polydata, mesh_polydata, mesh_point_map, color_attribute_name, THRESHOLD_VALUE_MESH);
     }
 
     if (mesh_polydata->GetNumberOfCells() == 0) {
         printf("VtkPokeEffect - early termination, no mesh\n");
+        if (temporal_state) *temporal_state = TemporalState();
         output_polydata->ShallowCopy(input_polydata);
         return kOfxStatOK;
     } else if (collider_polydata->GetNumberOfCells() == 0) {
         printf("VtkPokeEffect - early termination, no collider\n");
+        if (temporal_state) *temporal_state = TemporalState();
         output_polydata->ShallowCopy(input_polydata);
         return kOfxStatOK;
     }
@@ -215,25 +451,149 @@ OfxStatus VtkPokeEffect::vtkCook_inner(vtkPolyData *input_polydata,
     }
     printf("VtkPokeEffect - max_distance = %g\n", max_distance);
 
-    auto contacts = evaluate_collision(mesh_polydata, collider_polydata, max_distance, offset, debug, collider_normal_factor);
+    ColliderSdf tmp_collider_sdf;
+    if (collider_mode == COLLIDER_MODE_SDF) {
+        if (!collider_sdf) {
+            collider_sdf = &tmp_collider_sdf;
+        }
+        update_collider_sdf(collider_polydata, *collider_sdf, sdf_voxel_size, offset);
+    }
+
+    auto collide = [&](const std::vector<int> *candidate_points, double collider_offset) {
+        if (collider_mode == COLLIDER_MODE_SDF) {
+            return evaluate_collision_sdf(mesh_polydata, *collider_sdf, max_distance, offset, collider_normal_factor,
+                                          candidate_points);
+        } else {
+            return evaluate_collision(mesh_polydata, collider_polydata, max_distance, collider_offset, debug,
+                                      collider_normal_factor, candidate_points);
+        }
+    };
+
+    // temporal coherence - if the mesh did not move and the collider did not move much since last cook,
+    // contacts are either near previous contacts or they are new contacts inside the collider, so we only
+    // need to test points from the previous falloff region and points inside the collider bounding box
+    // (mesh points outside of a closed collider cannot be in contact with it)
+    std::vector<int> candidate_points;
+    bool use_temporal_state = false;
+    if (temporal_state) {
+        double collider_bounds[6];
+        collider_polydata->GetBounds(collider_bounds);
+        uint64_t mesh_points_hash = hash_points(mesh_polydata->GetPoints());
+
+        use_temporal_state = temporal_state->mesh_point_count == mesh_polydata->GetNumberOfPoints() &&
+                             temporal_state->mesh_cell_count == mesh_polydata->GetNumberOfCells() &&
+                             temporal_state->mesh_points_hash == mesh_points_hash;
+        for (int i = 0; i < 6 && use_temporal_state; i++) {
+            use_temporal_state = std::abs(collider_bounds[i] - temporal_state->collider_bounds[i]) < 0.5*falloff_radius;
+        }
+
+        if (use_temporal_state) {
+            std::vector<int> previous_region_points;
+            for (auto &pd : temporal_state->falloff_region) {
+                if (pd.distance < falloff_radius) {
+                    previous_region_points.push_back(pd.id);
+                }
+            }
+
+            double box[6];
+            if (collider_mode == COLLIDER_MODE_SDF) {
+                // points outside of the field are never in contact
+                const double brick_length = ColliderSdf::BRICK_SIZE * collider_sdf->voxel_size;
+                for (int a = 0; a < 3; a++) {
+                    box[2*a] = collider_sdf->origin[a];
+                    box[2*a+1] = collider_sdf->origin[a] + collider_sdf->brick_count[a] * brick_length;
+                }
+            } else {
+                // collider gets inflated by offset, plus some tolerance for the ray casting
+                const double margin = offset + 1e-3 * collider_polydata->GetLength();
+                for (int a = 0; a < 3; a++) {
+                    box[2*a] = collider_bounds[2*a] - margin;
+                    box[2*a+1] = collider_bounds[2*a+1] + margin;
+                }
+            }
+            std::vector<int> collider_box_points;
+            points_in_box(mesh_polydata->GetPoints(), box, collider_box_points);
+
+            std::set_union(previous_region_points.begin(), previous_region_points.end(),
+                           collider_box_points.begin(), collider_box_points.end(),
+                           std::back_inserter(candidate_points));
+            printf("VtkPokeEffect - temporal coherence, testing %d points near previous contacts or inside collider bounds\n",
+                   (int)candidate_points.size());
+        } else {
+            printf("VtkPokeEffect - temporal coherence, previous state does not match\n");
+            *temporal_state = TemporalState();
+        }
+
+        temporal_state->mesh_point_count = mesh_polydata->GetNumberOfPoints();
+        temporal_state->mesh_cell_count = mesh_polydata->GetNumberOfCells();
+        temporal_state->mesh_points_hash = mesh_points_hash;
+        for (int i = 0; i < 6; i++) {
+            temporal_state->collider_bounds[i] = collider_bounds[i];
+        }
+    }
+
+    auto contacts = collide((use_temporal_state) ? &candidate_points : nullptr, offset);
+
+    if (use_temporal_state) {
+        // contacts got close to the edge of tested region, there may be more outside of it
+        bool front_escaped = contacts.empty();
+        const auto &region = temporal_state->falloff_region;
+        for (auto &c : contacts) {
+            auto it = std::lower_bound(region.begin(), region.end(), c.pid,
+                                       [](const VtkDistanceAlongSurfaceEffect::PointDistance &pd, int pid) {
+                                           return pd.id < pid;
+                                       });
+            if (it == region.end() || it->id != c.pid || it->distance >= 0.5*falloff_radius) {
+                front_escaped = true;
+                break;
+            }
+        }
+        if (front_escaped) {
+            printf("VtkPokeEffect - temporal coherence, contacts moved too far, testing all points\n");
+            // note: collider was already offset by the first call
+            contacts = collide(nullptr, 0.0);
+        }
+    }
+
     auto t2 = std::chrono::system_clock::now();
-    handle_reaction_laplacian(mesh_polydata, contacts, falloff_radius, falloff_exponent, number_of_iterations, collision_smoothing_ratio);
+    std::vector<double> moved_positions;
+    auto moved_points = handle_reaction_laplacian(mesh_polydata, contacts, falloff_radius, falloff_exponent, number_of_iterations,
+                              collision_smoothing_ratio, moved_positions, solver, temporal_state, distance_mode,
+                              reaction_cache);
     auto t3 = std::chrono::system_clock::now();
 
 
-    // map deformation back onto main mesh
+    // map deformation back onto main mesh, only moved points are written
     output_polydata->ShallowCopy(input_polydata);
-    output_polydata->GetPoints()->DeepCopy(input_polydata->GetPoints()); // maybe skip if we're okay changing input in place
-
-    auto mesh_id_array = mesh_polydata->GetPointData()->GetArray(POINT_ID_ARRAY_NAME);
-    auto mesh_points = mesh_polydata->GetPoints();
-    auto output_points = output_polydata->GetPoints();
-    // TODO parallelize this
-    for (int pid_mesh = 0; pid_mesh < mesh_polydata->GetNumberOfPoints(); pid_mesh++) {
-        int pid_output = mesh_id_array->GetVariantValue(pid_mesh).ToInt();
-        double p[3];
-        mesh_points->GetPoint(pid_mesh, p);
-        output_points->SetPoint(pid_output, p);
+
+    if (!moved_points.empty()) {
+        auto output_points = vtkSmartPointer<vtkPoints>::New();
+        output_points->DeepCopy(input_polydata->GetPoints());
+        output_polydata->SetPoints(output_points);
+
+        // null map means that mesh_polydata has the same points as input_polydata
+        const vtkIdType *mesh_point_map_ptr = (mesh_point_map) ? mesh_point_map->GetPointer(0) : nullptr;
+        auto output_points_arr = vtkFloatArray::SafeDownCast(output_points->GetData());
+        int num_moved_points = moved_points.size();
+
+        if (output_points_arr) {
+            float *output_points_ptr = output_points_arr->GetPointer(0);
+
+            #pragma omp parallel for schedule(static, 1000) if (num_moved_points > 5000)
+            for (int i = 0; i < num_moved_points; i++) {
+                int pid_mesh = moved_points[i];
+                int pid_output = (mesh_point_map_ptr) ? mesh_point_map_ptr[pid_mesh] : pid_mesh;
+                output_points_ptr[3*pid_output + 0] = moved_positions[3*i + 0];
+                output_points_ptr[3*pid_output + 1] = moved_positions[3*i + 1];
+                output_points_ptr[3*pid_output + 2] = moved_positions[3*i + 2];
+            }
+        } else {
+            for (int i = 0; i < num_moved_points; i++) {
+                int pid_mesh = moved_points[i];
+                int pid_output = (mesh_point_map_ptr) ? mesh_point_map_ptr[pid_mesh] : pid_mesh;
+                output_points->SetPoint(pid_output, &moved_positions[3*i]);
+            }
+        }
     }
 
     auto t4 = std::chrono::system_clock::now();
@@ -250,9 +610,11 @@ OfxStatus VtkPokeEffect::vtkCook_inner(vtkPolyData *input_polydata,
 
 std::vector<VtkPokeEffect::Contact>
 VtkPokeEffect::evaluate_collision(vtkPolyData *mesh_polydata, vtkPolyData *collider_polydata, double max_distance,
-                                  double offset, bool debug, double collider_normal_factor) {
+                                  double offset, bool debug, double collider_normal_factor,
+                                  const std::vector<int> *candidate_points) {
     std::vector<Contact> contacts;
     int n = mesh_polydata->GetNumberOfPoints();
+    int num_candidates = (candidate_points) ? candidate_points->size() : n;
     double mesh_diagonal_length = mesh_polydata->GetLength();
     
     vtkFloatArray *this_to_collider_arr = nullptr, *this_to_mesh_arr = nullptr, *mesh_to_collider_arr = nullptr, *contact_arr = nullptr;
@@ -325,7 +687,8 @@ VtkPokeEffect::evaluate_collision(vtkPolyData *mesh_polydata, vtkPolyData *colli
                                      collider_bounds[5] + max_distance };
 
     // step 1 - clear mesh collision with collider
-    for (int i = 0; i < n; i++) {
+    for (int k = 0; k < num_candidates; k++) {
+        int i = (candidate_points) ? (*candidate_points)[k] : k;
         double p[3];
         double mesh_point[3], collider_point[3];
         double mesh_normal[3], collider_cell_normal[3];
@@ -436,128 +799,733 @@ VtkPokeEffect::evaluate_collision(vtkPolyData *mesh_polydata, vtkPolyData *colli
     return contacts;
 }
 
-void VtkPokeEffect::handle_reaction_laplacian(vtkPolyData *mesh_polydata, const std::vector<Contact> &contacts,
-                                              double falloff_radius, double falloff_exponent,
-                                              int number_of_iterations, double collision_smoothing_ratio) {
+void VtkPokeEffect::update_collider_sdf(vtkPolyData *collider_polydata, ColliderSdf &collider_sdf, double voxel_size,
+                                        double offset) {
+    const int B = ColliderSdf::BRICK_SIZE;
+    int num_points = collider_polydata->GetNumberOfPoints();
+    int num_cells = collider_polydata->GetNumberOfCells();
+
+    // hash all coordinates, any change of the collider shape needs a new field
+    uint64_t points_hash = hash_points(collider_polydata->GetPoints());
+
+    if (collider_sdf.collider_point_count == num_points &&
+        collider_sdf.collider_cell_count == num_cells &&
+        collider_sdf.collider_points_hash == points_hash &&
+        collider_sdf.requested_voxel_size == voxel_size &&
+        collider_sdf.offset == offset) {
+        printf("VtkPokeEffect - reusing collider SDF\n");
+        return;
+    }
+
+    auto t0 = std::chrono::system_clock::now();
+
+    collider_sdf.collider_point_count = num_points;
+    collider_sdf.collider_cell_count = num_cells;
+    collider_sdf.collider_points_hash = points_hash;
+    collider_sdf.requested_voxel_size = voxel_size;
+    collider_sdf.offset = offset;
+
+    if (!is_positive_double(voxel_size)) {
+        voxel_size = collider_polydata->GetLength() / 256;
+    }
+    collider_sdf.voxel_size = voxel_size;
+
+    // refined bricks must cover points closer than offset to the surface
+    const double brick_length = B * voxel_size;
+    const double band = offset + brick_length;
+
+    double bounds[6];
+    collider_polydata->GetBounds(bounds);
+    for (int a = 0; a < 3; a++) {
+        collider_sdf.origin[a] = bounds[2*a] - band;
+        collider_sdf.brick_count[a] = std::max(1, (int)std::ceil((bounds[2*a+1] - bounds[2*a] + 2*band) / brick_length));
+    }
+    const int *brick_count = collider_sdf.brick_count;
+    const double *origin = collider_sdf.origin;
+    const int num_bricks = brick_count[0] * brick_count[1] * brick_count[2];
+
+    // pick bricks near collider surface
+    std::vector<int> brick_index(num_bricks, 0);
+    auto mark_bricks = [&](auto *offsets, auto *connectivity, int num_cells) {
+        #pragma omp parallel for schedule(static, 1000) if (num_cells > 5000)
+        for (int cid = 0; cid < num_cells; cid++) {
+            double cell_min[3] = {DBL_MAX, DBL_MAX, DBL_MAX}, cell_max[3] = {-DBL_MAX, -DBL_MAX, -DBL_MAX};
+            for (auto j = offsets[cid]; j < offsets[cid+1]; j++) {
+                double p[3];
+                collider_polydata->GetPoint(connectivity[j], p);
+                vec3_min(cell_min, p);
+                vec3_max(cell_max, p);
+            }
+
+            int brick_min[3], brick_max[3];
+            for (int a = 0; a < 3; a++) {
+                brick_min[a] = clamp((int)std::floor((cell_min[a] - band - origin[a]) / brick_length), 0, brick_count[a]-1);
+                brick_max[a] = clamp((int)std::floor((cell_max[a] + band - origin[a]) / brick_length), 0, brick_count[a]-1);
+            }
+
+            for (int z = brick_min[2]; z <= brick_max[2]; z++) {
+                for (int y = brick_min[1]; y <= brick_max[1]; y++) {
+                    for (int x = brick_min[0]; x <= brick_max[0]; x++) {
+                        #pragma omp atomic write
+                        brick_index[(z*brick_count[1] + y)*brick_count[0] + x] = 1;
+                    }
+                }
+            }
+        }
+    };
+    visit_cell_array(collider_polydata->GetPolys(), [&](auto *offsets, auto *connectivity) {
+        mark_bricks(offsets, connectivity, collider_polydata->GetPolys()->GetNumberOfCells());
+    });
+    visit_cell_array(collider_polydata->GetLines(), [&](auto *offsets, auto *connectivity) {
+        mark_bricks(offsets, connectivity, collider_polydata->GetLines()->GetNumberOfCells());
+    });
+
+    // number refined bricks, -1 for the rest
+    std::vector<int> refined_bricks;
+    for (int i = 0; i < num_bricks; i++) {
+        if (brick_index[i]) {
+            brick_index[i] = refined_bricks.size();
+            refined_bricks.push_back(i);
+        } else {
+            brick_index[i] = -1;
+        }
+    }
+
+    const int coarse_count[3] = {brick_count[0] + 1, brick_count[1] + 1, brick_count[2] + 1};
+    const int num_coarse_samples = coarse_count[0] * coarse_count[1] * coarse_count[2];
+    const int num_refined_bricks = refined_bricks.size();
+    const int samples_per_brick = (B+1) * (B+1) * (B+1);
+
+    collider_sdf.coarse_samples.resize(num_coarse_samples);
+    collider_sdf.fine_samples.resize((size_t)num_refined_bricks * samples_per_brick);
+    float *coarse_samples = collider_sdf.coarse_samples.data();
+    float *fine_samples = collider_sdf.fine_samples.data();
+
+    // evaluate distance, vtkImplicitPolyDataDistance is not thread safe so each thread gets its own
+    // (created here, SetInput() runs a pipeline on the collider, which must not happen concurrently)
+    const int thread_count = max_thread_count();
+    std::vector<vtkSmartPointer<vtkImplicitPolyDataDistance>> distance_functions(thread_count);
+    for (auto &distance_function : distance_functions) {
+        distance_function = vtkSmartPointer<vtkImplicitPolyDataDistance>::New();
+        distance_function->SetInput(collider_polydata);
+    }
+
+    #pragma omp parallel num_threads(thread_count)
+    {
+        vtkImplicitPolyDataDistance *distance_function = distance_functions[thread_index()];
+
+        #pragma omp for schedule(static, 1000)
+        for (int i = 0; i < num_coarse_samples; i++) {
+            int x = i % coarse_count[0];
+            int y = (i / coarse_count[0]) % coarse_count[1];
+            int z = i / (coarse_count[0] * coarse_count[1]);
+            double p[3] = { origin[0] + x*brick_length, origin[1] + y*brick_length, origin[2] + z*brick_length };
+            coarse_samples[i] = distance_function->EvaluateFunction(p);
+        }
+
+        #pragma omp for schedule(dynamic, 4)
+        for (int k = 0; k < num_refined_bricks; k++) {
+            int brick = refined_bricks[k];
+            int bx = brick % brick_count[0];
+            int by = (brick / brick_count[0]) % brick_count[1];
+            int bz = brick / (brick_count[0] * brick_count[1]);
+            float *samples = fine_samples + (size_t)k * samples_per_brick;
+
+            for (int z = 0; z <= B; z++) {
+                for (int y = 0; y <= B; y++) {
+                    for (int x = 0; x <= B; x++) {
+                        double p[3] = { origin[0] + bx*brick_length + x*voxel_size,
+                                        origin[1] + by*brick_length + y*voxel_size,
+                                        origin[2] + bz*brick_length + z*voxel_size };
+                        samples[(z*(B+1) + y)*(B+1) + x] = distance_function->EvaluateFunction(p);
+                    }
+                }
+            }
+        }
+    }
+
+    collider_sdf.brick_index = std::move(brick_index);
+
+    auto t1 = std::chrono::system_clock::now();
+    printf("VtkPokeEffect - built collider SDF, voxel size %g, %d x %d x %d bricks (%d refined) in %d ms\n",
+           voxel_size, brick_count[0], brick_count[1], brick_count[2], num_refined_bricks,
+           (int)std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+}
+
+/* Trilinear interpolation of samples on a regular grid (x fastest) with spacing h, in cell (x, y, z)
+ * at local coordinates t in [0, 1]^3. Also gives the gradient.
+ * */
+static double interpolate_trilinear(const float *samples, const int count[3], int x, int y, int z, const double t[3],
+                                    double h, double gradient[3]) {
+    auto at = [&](int dx, int dy, int dz) -> double {
+        return samples[((z+dz)*count[1] + (y+dy))*count[0] + (x+dx)];
+    };
+    double c000 = at(0, 0, 0), c100 = at(1, 0, 0), c010 = at(0, 1, 0), c110 = at(1, 1, 0);
+    double c001 = at(0, 0, 1), c101 = at(1, 0, 1), c011 = at(0, 1, 1), c111 = at(1, 1, 1);
+
+    double c00 = c000 + t[0]*(c100 - c000), c10 = c010 + t[0]*(c110 - c010);
+    double c01 = c001 + t[0]*(c101 - c001), c11 = c011 + t[0]*(c111 - c011);
+    double c0 = c00 + t[1]*(c10 - c00), c1 = c01 + t[1]*(c11 - c01);
+
+    double dx0 = (c100 - c000) + t[1]*((c110 - c010) - (c100 - c000));
+    double dx1 = (c101 - c001) + t[1]*((c111 - c011) - (c101 - c001));
+    gradient[0] = (dx0 + t[2]*(dx1 - dx0)) / h;
+    gradient[1] = ((c10 - c00) + t[2]*((c11 - c01) - (c10 - c00))) / h;
+    gradient[2] = (c1 - c0) / h;
+
+    return c0 + t[2]*(c1 - c0);
+}
+
+/* Returns false if p is outside of the field, ie. farther than offset from the collider.
+ * */
+static bool sample_collider_sdf(const VtkPokeEffect::ColliderSdf &collider_sdf, const double p[3], double &distance,
+                                double gradient[3]) {
+    const int B = VtkPokeEffect::ColliderSdf::BRICK_SIZE;
+    const double brick_length = B * collider_sdf.voxel_size;
+    const int *brick_count = collider_sdf.brick_count;
+
+    int brick[3];
+    double t[3];
+    for (int a = 0; a < 3; a++) {
+        double u = (p[a] - collider_sdf.origin[a]) / brick_length;
+        if (!(u >= 0.0 && u <= brick_count[a])) {
+            return false;
+        }
+        brick[a] = std::min((int)u, brick_count[a] - 1);
+        t[a] = u - brick[a];
+    }
+
+    int k = collider_sdf.brick_index[(brick[2]*brick_count[1] + brick[1])*brick_count[0] + brick[0]];
+    if (k < 0) {
+        // far from surface, coarse samples are good enough
+        const int coarse_count[3] = {brick_count[0] + 1, brick_count[1] + 1, brick_count[2] + 1};
+        distance = interpolate_trilinear(collider_sdf.coarse_samples.data(), coarse_count, brick[0], brick[1], brick[2],
+                                         t, brick_length, gradient);
+    } else {
+        const int fine_count[3] = {B + 1, B + 1, B + 1};
+        int voxel[3];
+        for (int a = 0; a < 3; a++) {
+            double v = t[a] * B;
+            voxel[a] = std::min((int)v, B - 1);
+            t[a] = v - voxel[a];
+        }
+        const float *samples = collider_sdf.fine_samples.data() + (size_t)k * fine_count[0]*fine_count[1]*fine_count[2];
+        distance = interpolate_trilinear(samples, fine_count, voxel[0], voxel[1], voxel[2], t,
+                                         collider_sdf.voxel_size, gradient);
+    }
+    return true;
+}
+
+std::vector<VtkPokeEffect::Contact>
+VtkPokeEffect::evaluate_collision_sdf(vtkPolyData *mesh_polydata, const ColliderSdf &collider_sdf,
+                                      double max_distance, double offset, double collider_normal_factor,
+                                      const std::vector<int> *candidate_points) {
+    int n = mesh_polydata->GetNumberOfPoints();
+    int num_candidates = (candidate_points) ? candidate_points->size() : n;
     auto mesh_normals = mesh_polydata->GetPointData()->GetArray("Normals");
 
-    // apply initial deformation
-    auto new_mesh_points = vtkSmartPointer<vtkPoints>::New();
-    new_mesh_points->DeepCopy(mesh_polydata->GetPoints());
+    std::vector<Contact> candidate_contacts(num_candidates);
+    std::vector<int> candidate_contact_index(num_candidates); // 0/1, then scanned into index in contacts
 
-    std::vector<int> collision_points;
-    for (auto c : contacts) {
-        collision_points.push_back(c.pid);
+    #pragma omp parallel for schedule(static, 1000) if (num_candidates > 5000)
+    for (int k = 0; k < num_candidates; k++) {
+        int i = (candidate_points) ? (*candidate_points)[k] : k;
+        double p[3], mesh_normal[3], gradient[3], distance;
+        candidate_contact_index[k] = 0;
 
-        double p[3];
-        new_mesh_points->GetPoint(c.pid, p);
-        p[0] += c.dx;
-        p[1] += c.dy;
-        p[2] += c.dz;
-        new_mesh_points->SetPoint(c.pid, p);
+        mesh_polydata->GetPoint(i, p);
+        if (!sample_collider_sdf(collider_sdf, p, distance, gradient)) {
+            continue; // point too far away from collider
+        }
+
+        distance -= offset;
+        if (distance >= 0 || -distance > max_distance) {
+            continue; // outside collider, or too deep
+        }
+
+        double gradient_norm = std::sqrt(vec3_dot(gradient, gradient));
+        if (gradient_norm == 0.0) {
+            continue;
+        }
+        for (int j = 0; j < 3; j++) {
+            gradient[j] /= gradient_norm;
+        }
+
+        mesh_normals->GetTuple(i, mesh_normal);
+        if (vec3_dot(mesh_normal, gradient) > 0) {
+            continue; // bad angle, closest way out of collider is in direction of mesh normal
+        }
+
+        double v[3];
+        for (int j = 0; j < 3; j++) {
+            v[j] = -mesh_normal[j]*(1.0-collider_normal_factor) + gradient[j]*collider_normal_factor;
+        }
+
+        // first order estimate of how far we need to go along v to get to distance = 0
+        double speed = vec3_dot(gradient, v);
+        if (speed < 1e-3) {
+            continue;
+        }
+        double t = -distance / speed;
+
+        candidate_contacts[k] = { .pid = i,
+                                  .dx = static_cast<float>(v[0] * t),
+                                  .dy = static_cast<float>(v[1] * t),
+                                  .dz = static_cast<float>(v[2] * t)};
+        candidate_contact_index[k] = 1;
     }
 
-    auto cell_links = vtkSmartPointer<vtkStaticCellLinks>::New(); // TODO use templated class to get int32 here
-    cell_links->BuildLinks(mesh_polydata);
+    int num_contacts = exclusive_scan(candidate_contact_index.data(), candidate_contact_index.data(), num_candidates);
+    std::vector<Contact> contacts(num_contacts);
 
-    auto manifold_distance_arr = VtkDistanceAlongSurfaceEffect::compute_distance(mesh_polydata, collision_points.size(),
-                                                                                 collision_points.data(), cell_links,
-                                                                                 (float) falloff_radius);
+    #pragma omp parallel for schedule(static, 1000) if (num_candidates > 5000)
+    for (int k = 0; k < num_candidates; k++) {
+        int next_index = (k+1 < num_candidates) ? candidate_contact_index[k+1] : num_contacts;
+        if (next_index != candidate_contact_index[k]) {
+            contacts[candidate_contact_index[k]] = candidate_contacts[k];
+        }
+    }
 
-    auto tmp_id_list = vtkSmartPointer<vtkIdList>::New(); // TODO get rid of this, prevents parallelization
-    auto push_point_neighbors = [&mesh_polydata, &cell_links, &tmp_id_list](int u, std::vector<int> &connectivity) -> int {
-        tmp_id_list->Reset();
-        int num_cells = cell_links->GetNumberOfCells(u);
-        auto neighbor_cells = cell_links->GetCells(u);
-        for (int i = 0; i < num_cells; i++) {
-            auto cell = mesh_polydata->GetCell(neighbor_cells[i]);
-            int num_points = cell->GetNumberOfPoints();
+    return contacts;
+}
 
-            for (int j = 0; j < num_points; j++) {
-                int v = cell->GetPointId(j);
-                tmp_id_list->InsertUniqueId(v);
+/* New positions of mesh points in a region (given by sorted IDs), which start as a copy of mesh points;
+ * points outside of the region keep their mesh positions. This way, deforming the falloff region
+ * does not need a copy of all mesh points.
+ * */
+class RegionPoints {
+public:
+    RegionPoints(vtkPoints *mesh_points, std::vector<int> region_points)
+            : mesh_points(mesh_points), ids(std::move(region_points)), positions(3*ids.size()) {
+        int m = ids.size();
+        #pragma omp parallel for schedule(static, 1000) if (m > 5000)
+        for (int i = 0; i < m; i++) {
+            mesh_points->GetPoint(ids[i], &positions[3*i]);
+        }
+    }
+
+    void GetPoint(int pid, double p[3]) const {
+        int i = Find(pid);
+        if (i >= 0) {
+            std::copy(&positions[3*i], &positions[3*i] + 3, p);
+        } else {
+            mesh_points->GetPoint(pid, p);
+        }
+    }
+
+    // pid must be in the region
+    void SetPoint(int pid, const double p[3]) {
+        int i = Find(pid);
+        std::copy(p, p + 3, &positions[3*i]);
+    }
+
+    // index of pid in the region or -1, positions of region points can be accessed directly by index
+    int Find(int pid) const {
+        auto it = std::lower_bound(ids.begin(), ids.end(), pid);
+        return (it != ids.end() && *it == pid) ? it - ids.begin() : -1;
+    }
+
+    double *GetPosition(int index) {
+        return &positions[3*index];
+    }
+
+private:
+
+    vtkPoints *mesh_points;
+    std::vector<int> ids;
+    std::vector<double> positions;
+};
+
+/* Solve the falloff to convergence as a screened Laplace problem in displacements u:
+ *
+ *      (deg_i + k_i) u_i - sum_{free j ~ i} u_j = sum_{fixed j ~ i} u_j
+ *
+ * Free points are those inside the falloff radius (excluding contacts), fixed points are contacts
+ * (u = contact displacement) and points just outside the falloff region (u = 0).
+ * The screening term k_i = (1 - alpha_i) / alpha_i anchors each point according to the falloff weight
+ * alpha_i which the iterative solver uses as its blending weight, so that falloff radius and exponent
+ * keep their meaning. The system is symmetric positive definite; we use Jacobi-preconditioned CG.
+ *
+ * smoothed_points must be sorted by ID, smoothed_points_distance holds their manifold distance from contacts.
+ * If displacement is given, it is used as initial guess (when it has 3 values per point)
+ * and it receives the solution.
+ * */
+static void solve_reaction_cg(vtkPoints *mesh_points, RegionPoints &new_mesh_points,
+                              const std::vector<int> &smoothed_points, const std::vector<float> &smoothed_points_distance,
+                              const std::vector<int> &smoothed_points_offsets,
+                              const std::vector<int> &smoothed_points_connectivity,
+                              double falloff_radius, double falloff_exponent, std::vector<float> *displacement) {
+    const double tolerance = 1e-6;   // relative to norm of right hand side
+    const int max_iterations = 1000;
+    const double max_screening = 1e6;
+
+    int n = mesh_points->GetNumberOfPoints();
+
+    // number the free points; smoothed_points is sorted, so we can look up the local index
+    // of a neighbor by binary search instead of keeping a table for the whole mesh
+    std::vector<int> free_points;
+    std::vector<int> free_points_smoothed_idx;
+    std::vector<int> smoothed_idx_to_local(smoothed_points.size(), -1);
+    for (int j = 0; j < smoothed_points.size(); j++) {
+        if (smoothed_points_distance[j] > 0) {
+            smoothed_idx_to_local[j] = free_points.size();
+            free_points.push_back(smoothed_points[j]);
+            free_points_smoothed_idx.push_back(j);
+        }
+    }
+    auto local_idx = [&](int pid) -> int {
+        auto it = std::lower_bound(smoothed_points.begin(), smoothed_points.end(), pid);
+        return (it != smoothed_points.end() && *it == pid) ? smoothed_idx_to_local[it - smoothed_points.begin()] : -1;
+    };
+
+    int m = free_points.size();
+    bool warm_start = displacement && displacement->size() == 3*n;
+    if (displacement) {
+        if (!warm_start) {
+            displacement->assign(3*n, 0.0f);
+        }
+    }
+    if (m == 0) {
+        return;
+    }
+
+    // assemble the system; diagonal is kept separately, off-diagonal entries are all -1
+    std::vector<double> diag(m);
+    std::vector<double> rhs(3*m, 0.0);
+    std::vector<int> row_offsets(m+1);
+    std::vector<int> cols;
+    cols.reserve(smoothed_points_connectivity.size());
+
+    for (int i = 0; i < m; i++) {
+        int pid0 = free_points[i];
+        int j = free_points_smoothed_idx[i];
+        int degree = 0;
+        row_offsets[i] = cols.size();
+
+        for (int k = smoothed_points_offsets[j]; k < smoothed_points_offsets[j+1]; k++) {
+            int pid = smoothed_points_connectivity[k];
+            if (pid == pid0) {
+                continue; // neighborhood includes the point itself
+            }
+            degree++;
+
+            int col = local_idx(pid);
+            if (col >= 0) {
+                cols.push_back(col);
+            } else {
+                // fixed point, move its displacement to right hand side
+                double p[3], p_new[3];
+                mesh_points->GetPoint(pid, p);
+                new_mesh_points.GetPoint(pid, p_new);
+                for (int c = 0; c < 3; c++) {
+                    rhs[3*i + c] += p_new[c] - p[c];
+                }
             }
         }
 
-        for (int i = 0; i < tmp_id_list->GetNumberOfIds(); i++) {
-            connectivity.push_back(tmp_id_list->GetId(i));
+        float distance_to_collision = smoothed_points_distance[j];
+        double alpha = std::pow(std::max(0.0, 1.0 - (distance_to_collision / falloff_radius)), falloff_exponent);
+        double screening = (alpha > 1.0/max_screening) ? (1.0 - alpha) / alpha : max_screening;
+        diag[i] = degree + screening;
+    }
+    row_offsets[m] = cols.size();
+
+    auto multiply = [&](const std::vector<double> &x, std::vector<double> &y) {
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < m; i++) {
+            double acc = diag[i] * x[i];
+            for (int k = row_offsets[i]; k < row_offsets[i+1]; k++) {
+                acc -= x[cols[k]];
+            }
+            y[i] = acc;
         }
-        return tmp_id_list->GetNumberOfIds();
+    };
+
+    auto dot = [m](const std::vector<double> &x, const std::vector<double> &y) -> double {
+        double acc = 0.0;
+        #pragma omp parallel for schedule(static) reduction(+:acc)
+        for (int i = 0; i < m; i++) {
+            acc += x[i] * y[i];
+        }
+        return acc;
+    };
+
+    // solve each coordinate separately, they share the matrix
+    std::vector<double> u(3*m, 0.0);
+    std::vector<double> x(m), b(m), r(m), z(m), p(m), Ap(m);
+
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < m; i++) {
+            b[i] = rhs[3*i + c];
+            x[i] = (warm_start) ? (*displacement)[3*free_points[i] + c] : 0.0;
+        }
+
+        double b_norm = std::sqrt(dot(b, b));
+        if (b_norm == 0.0) {
+            continue; // solution is zero
+        }
+
+        multiply(x, Ap);
+        for (int i = 0; i < m; i++) {
+            r[i] = b[i] - Ap[i];
+            z[i] = r[i] / diag[i];
+            p[i] = z[i];
+        }
+        double rz = dot(r, z);
+        double r_norm = std::sqrt(dot(r, r));
+
+        int it;
+        for (it = 0; it < max_iterations && r_norm > tolerance*b_norm; it++) {
+            multiply(p, Ap);
+            double step = rz / dot(p, Ap);
+
+            #pragma omp parallel for schedule(static)
+            for (int i = 0; i < m; i++) {
+                x[i] += step * p[i];
+                r[i] -= step * Ap[i];
+                z[i] = r[i] / diag[i];
+            }
+
+            double rz_new = dot(r, z);
+            double beta = rz_new / rz;
+            rz = rz_new;
+            r_norm = std::sqrt(dot(r, r));
+
+            #pragma omp parallel for schedule(static)
+            for (int i = 0; i < m; i++) {
+                p[i] = z[i] + beta * p[i];
+            }
+        }
+        printf("VtkPokeEffect - CG solver, coordinate %d: %d iterations, relative residual %g\n", c, it, r_norm / b_norm);
+
+        for (int i = 0; i < m; i++) {
+            u[3*i + c] = x[i];
+        }
+    }
+
+    if (displacement) {
+        // keep the solution for next cook; values for other points are not used
+        for (int i = 0; i < m; i++) {
+            for (int c = 0; c < 3; c++) {
+                (*displacement)[3*free_points[i] + c] = u[3*i + c];
+            }
+        }
+    }
+
+    for (int i = 0; i < m; i++) {
+        double p0[3];
+        mesh_points->GetPoint(free_points[i], p0);
+        p0[0] += u[3*i + 0];
+        p0[1] += u[3*i + 1];
+        p0[2] += u[3*i + 2];
+        new_mesh_points.SetPoint(free_points[i], p0);
+    }
+}
+
+/* Hash of mesh lines and polygons, to tell if results cached between cooks were computed for the same topology.
+ * */
+static uint64_t hash_cells(vtkPolyData *mesh) {
+    uint64_t hashes[4] = {0, 0, 0, 0};
+    vtkCellArray *cells[2] = {mesh->GetLines(), mesh->GetPolys()};
+    for (int k = 0; k < 2; k++) {
+        int num_cells = cells[k] ? cells[k]->GetNumberOfCells() : 0;
+        if (num_cells == 0) continue;
+        visit_cell_array(cells[k], [&](auto *offsets, auto *connectivity) {
+            hashes[2*k] = hash_bytes(offsets, (num_cells + 1) * sizeof(*offsets));
+            hashes[2*k + 1] = hash_bytes(connectivity, offsets[num_cells] * sizeof(*connectivity));
+        });
+    }
+    return hash_bytes(hashes, sizeof(hashes));
+}
+
+/* Make sure that the cache has surface graph of the mesh: rebuild it if mesh topology changed, only update
+ * edge lengths if points moved. Hashing is linear in mesh size too, but much cheaper than building the graph.
+ * */
+static void update_reaction_cache(vtkPolyData *mesh_polydata, VtkPokeEffect::ReactionCache &cache,
+                                  bool with_triangles) {
+    int n = mesh_polydata->GetNumberOfPoints();
+    uint64_t cells_hash = hash_cells(mesh_polydata);
+    uint64_t points_hash = hash_points(mesh_polydata->GetPoints());
+
+    if (cache.mesh_point_count != n || cache.mesh_cells_hash != cells_hash || cache.with_triangles != with_triangles) {
+        printf("VtkPokeEffect - building surface graph\n");
+        VtkDistanceAlongSurfaceEffect::build_surface_graph(mesh_polydata, cache.graph, with_triangles);
+    } else if (cache.mesh_points_hash != points_hash) {
+        printf("VtkPokeEffect - updating surface graph, mesh points moved\n");
+        VtkDistanceAlongSurfaceEffect::update_surface_graph_geometry(mesh_polydata, cache.graph);
+    }
+
+    cache.mesh_point_count = n;
+    cache.mesh_cells_hash = cells_hash;
+    cache.mesh_points_hash = points_hash;
+    cache.with_triangles = with_triangles;
+}
+
+std::vector<int> VtkPokeEffect::handle_reaction_laplacian(vtkPolyData *mesh_polydata, const std::vector<Contact> &contacts,
+                                              double falloff_radius, double falloff_exponent,
+                                              int number_of_iterations, double collision_smoothing_ratio,
+                                              std::vector<double> &moved_positions, int solver,
+                                              TemporalState *temporal_state, int distance_mode,
+                                              ReactionCache *reaction_cache) {
+    auto mesh_normals = mesh_polydata->GetPointData()->GetArray("Normals");
+
+    std::vector<int> collision_points;
+    for (auto c : contacts) {
+        collision_points.push_back(c.pid);
+    }
+    std::sort(collision_points.begin(), collision_points.end());
+
+    ReactionCache local_cache;
+    auto &cache = (reaction_cache) ? *reaction_cache : local_cache;
+    update_reaction_cache(mesh_polydata, cache,
+                          distance_mode == VtkDistanceAlongSurfaceEffect::DISTANCE_MODE_FAST_MARCHING);
+    const auto &graph = cache.graph;
+
+    // only the falloff region is reached, so with the graph and workspace cached,
+    // the cost of this does not depend on mesh size
+    std::vector<VtkDistanceAlongSurfaceEffect::PointDistance> falloff_region;
+    VtkDistanceAlongSurfaceEffect::compute_distance_sparse(graph, collision_points.size(), collision_points.data(),
+                                                           (float) falloff_radius, cache.distance_workspace,
+                                                           falloff_region, distance_mode);
+    std::sort(falloff_region.begin(), falloff_region.end(),
+              [](const VtkDistanceAlongSurfaceEffect::PointDistance &a, const VtkDistanceAlongSurfaceEffect::PointDistance &b) {
+                  return a.id < b.id;
+              });
+
+    // neighborhood for smoothing is the point itself and its graph neighbors
+    auto push_point_neighbors = [&graph](int u, std::vector<int> &connectivity) -> int {
+        connectivity.push_back(u);
+        connectivity.insert(connectivity.end(), graph.neighbors.begin() + graph.offsets[u],
+                            graph.neighbors.begin() + graph.offsets[u+1]);
+        return 1 + graph.offsets[u+1] - graph.offsets[u];
     };
 
     // pick points to be affected by the laplacian
     std::vector<int> smoothed_points;
+    std::vector<float> smoothed_points_distance;
     std::vector<int> smoothed_points_offsets;
     std::vector<int> smoothed_points_connectivity;
     int previous_offset = 0;
-    for (int i = 0; i < manifold_distance_arr->GetNumberOfValues(); i++) {
-        float d = manifold_distance_arr->GetValue(i);
+    for (auto &pd : falloff_region) {
+        float d = pd.distance;
 
         // smooth points in falloff_radius
         // if collision_smoothing_ratio > 0, we want to smooth collision points as well
         if (d < falloff_radius && (d > 0 || collision_smoothing_ratio > 0)) {
-            smoothed_points.push_back(i);
+            smoothed_points.push_back(pd.id);
+            smoothed_points_distance.push_back(d);
             smoothed_points_offsets.push_back(previous_offset);
-            int neighbor_count = push_point_neighbors(i, smoothed_points_connectivity);
+            int neighbor_count = push_point_neighbors(pd.id, smoothed_points_connectivity);
             previous_offset += neighbor_count;
         }
     }
     smoothed_points_offsets.push_back(previous_offset);
     printf("VtkPokeEffect - picked %d points for smoothing\n", (int)smoothed_points.size());
 
-    // iterate laplacian
-    for (int i = 0; i < number_of_iterations; i++) {
-        // TODO parallelize
-        // XXX make iterations independent!!!
-        for (int j = 0; j < smoothed_points.size(); j++) {
-            int pid0 = smoothed_points[j];
-            double p0[3];
-            new_mesh_points->GetPoint(pid0, p0);
-            double barycenter[3] = {0, 0, 0};
-            int num_neighbors = smoothed_points_offsets[j+1] - smoothed_points_offsets[j];
-
-            for (int k = smoothed_points_offsets[j]; k < smoothed_points_offsets[j+1]; k++) {
-                int pid = smoothed_points_connectivity[k];
-                double p[3];
-                new_mesh_points->GetPoint(pid, p);
-                barycenter[0] += p[0];
-                barycenter[1] += p[1];
-                barycenter[2] += p[2];
-            }
-            barycenter[0] /= num_neighbors;
-            barycenter[1] /= num_neighbors;
-            barycenter[2] /= num_neighbors;
+    // copy only points which can move - contacts and the falloff region (which normally includes them),
+    // plus neighbors of smoothed points, so that the smoothing only reads from the copy
+    std::vector<int> falloff_region_points, moving_points, region_points;
+    for (auto &pd : falloff_region) {
+        falloff_region_points.push_back(pd.id);
+    }
+    std::set_union(collision_points.begin(), collision_points.end(),
+                   falloff_region_points.begin(), falloff_region_points.end(), std::back_inserter(moving_points));
+    std::vector<int> neighbor_points(smoothed_points_connectivity);
+    std::sort(neighbor_points.begin(), neighbor_points.end());
+    neighbor_points.erase(std::unique(neighbor_points.begin(), neighbor_points.end()), neighbor_points.end());
+    std::set_union(moving_points.begin(), moving_points.end(), neighbor_points.begin(), neighbor_points.end(),
+                   std::back_inserter(region_points));
+    RegionPoints new_mesh_points(mesh_polydata->GetPoints(), std::move(region_points));
+
+    // apply initial deformation
+    for (auto c : contacts) {
+        double p[3];
+        new_mesh_points.GetPoint(c.pid, p);
+        p[0] += c.dx;
+        p[1] += c.dy;
+        p[2] += c.dz;
+        new_mesh_points.SetPoint(c.pid, p);
+    }
 
-            float distance_to_collision = manifold_distance_arr->GetValue(pid0);
-            double alpha = 0.0;  // blending weight
+    if (solver == SOLVER_CONJUGATE_GRADIENT) {
+        solve_reaction_cg(mesh_polydata->GetPoints(), new_mesh_points, smoothed_points, smoothed_points_distance,
+                          smoothed_points_offsets, smoothed_points_connectivity, falloff_radius, falloff_exponent,
+                          (temporal_state) ? &temporal_state->displacement : nullptr);
+    } else {
+        // translate points to their index in the region once, so that iterations access positions directly
+        int num_smoothed_points = smoothed_points.size();
+        int num_smoothed_connectivity = smoothed_points_connectivity.size();
+        std::vector<int> smoothed_points_index(num_smoothed_points);
+        std::vector<int> smoothed_points_connectivity_index(num_smoothed_connectivity);
+
+        #pragma omp parallel for schedule(static, 1000) if (num_smoothed_connectivity > 5000)
+        for (int k = 0; k < num_smoothed_connectivity; k++) {
+            smoothed_points_connectivity_index[k] = new_mesh_points.Find(smoothed_points_connectivity[k]);
+        }
+        for (int j = 0; j < num_smoothed_points; j++) {
+            smoothed_points_index[j] = new_mesh_points.Find(smoothed_points[j]);
+        }
 
-            double disp[3] = { barycenter[0] - p0[0],
-                               barycenter[1] - p0[1],
-                               barycenter[2] - p0[2] };
+        // iterate laplacian
+        for (int i = 0; i < number_of_iterations; i++) {
+            // TODO parallelize
+            // XXX make iterations independent!!!
+            for (int j = 0; j < num_smoothed_points; j++) {
+                int pid0 = smoothed_points[j];
+                double *p0 = new_mesh_points.GetPosition(smoothed_points_index[j]);
+                double barycenter[3] = {0, 0, 0};
+                int num_neighbors = smoothed_points_offsets[j+1] - smoothed_points_offsets[j];
+
+                for (int k = smoothed_points_offsets[j]; k < smoothed_points_offsets[j+1]; k++) {
+                    const double *p = new_mesh_points.GetPosition(smoothed_points_connectivity_index[k]);
+                    barycenter[0] += p[0];
+                    barycenter[1] += p[1];
+                    barycenter[2] += p[2];
+                }
+                barycenter[0] /= num_neighbors;
+                barycenter[1] /= num_neighbors;
+                barycenter[2] /= num_neighbors;
 
-            if (distance_to_collision > 0) {
-                alpha = std::pow(std::max(0.0, 1.0 - (distance_to_collision / falloff_radius)), falloff_exponent);
-            } else {
-                // collision point
-                double normal[3];
-                mesh_normals->GetTuple(pid0, normal);
-                if (vec3_dot(disp, normal) > 0) {
-                    // pushing outside - back towards collider, we want to dampen this
-                    alpha = collision_smoothing_ratio;
+                float distance_to_collision = smoothed_points_distance[j];
+                double alpha = 0.0;  // blending weight
+
+                double disp[3] = { barycenter[0] - p0[0],
+                                   barycenter[1] - p0[1],
+                                   barycenter[2] - p0[2] };
+
+                if (distance_to_collision > 0) {
+                    alpha = std::pow(std::max(0.0, 1.0 - (distance_to_collision / falloff_radius)), falloff_exponent);
                 } else {
-                    // pushing inside mesh, use full laplacian
-                    alpha = 1.0;
+                    // collision point
+                    double normal[3];
+                    mesh_normals->GetTuple(pid0, normal);
+                    if (vec3_dot(disp, normal) > 0) {
+                        // pushing outside - back towards collider, we want to dampen this
+                        alpha = collision_smoothing_ratio;
+                    } else {
+                        // pushing inside mesh, use full laplacian
+                        alpha = 1.0;
+                    }
                 }
-            }
-
-            p0[0] += alpha * disp[0];
-            p0[1] += alpha * disp[1];
-            p0[2] += alpha * disp[2];
 
-            new_mesh_points->SetPoint(pid0, p0);
+                p0[0] += alpha * disp[0];
+                p0[1] += alpha * disp[1];
+                p0[2] += alpha * disp[2];
+            }
         }
     }
 
-    // final step - overwrite original coordinates with new ones
-    mesh_polydata->GetPoints()->ShallowCopy(new_mesh_points);
+    if (temporal_state) {
+        temporal_state->falloff_region = std::move(falloff_region);
+    }
+
+    // final step - gather new coordinates of moved points
+    std::vector<int> moved_points;
+    std::set_union(collision_points.begin(), collision_points.end(), smoothed_points.begin(), smoothed_points.end(),
+                   std::back_inserter(moved_points));
+    moved_positions.resize(3*moved_points.size());
+    for (int i = 0; i < moved_points.size(); i++) {
+        new_mesh_points.GetPoint(moved_points[i], &moved_positions[3*i]);
+    }
+    return moved_points;
 }
@@ -24,6 +24,9 @@ THE SOFTWARE.
 #pragma once
 
 #include "VtkEffect.h"
+#include "VtkDistanceAlongSurfaceEffect.h"
+#include <map>
+#include <mutex>
 
 class VtkPokeEffect : public VtkEffect {
 private:
@@ -33,7 +36,12 @@ private:
     const char *PARAM_COLLISION_SMOOTHING_RATIO = "CollisionSmoothingRatio";
     const char *PARAM_COLLIDER_NORMAL_FACTOR = "ColliderNormalFactor";
     const char *PARAM_NUMBER_OF_ITERATIONS = "NumberOfIterations";
+    const char *PARAM_SOLVER = "Solver";
     const char *PARAM_OFFSET = "Offset";
+    const char *PARAM_TEMPORAL_COHERENCE = "TemporalCoherence";
+    const char *PARAM_COLLIDER_MODE = "ColliderMode";
+    const char *PARAM_SDF_VOXEL_SIZE = "SdfVoxelSize";
+    const char *PARAM_DISTANCE_MODE = "DistanceMode";
     const char *PARAM_DEBUG = "Debug";
 
     const char *INPUT_COLLIDER = "Collider";
@@ -43,6 +51,71 @@ private:
 public:
     struct Contact { int pid; float dx, dy, dz; };
 
+    /* Results of the previous cook of an instance, used to speed up the next one
+     * when PARAM_TEMPORAL_COHERENCE is on.
+     * */
+    struct TemporalState {
+        int mesh_point_count = 0; // 0 means no usable state
+        int mesh_cell_count = 0;
+        uint64_t mesh_points_hash = 0; // state is only used if the mesh did not move
+        double collider_bounds[6];
+        std::vector<VtkDistanceAlongSurfaceEffect::PointDistance> falloff_region; // points within falloff radius of contacts, sorted by ID
+        std::vector<float> displacement; // solved falloff displacement, indexed by point ID (CG solver only)
+    };
+
+    /* Surface graph of the mesh and scratch memory for falloff distance, kept between cooks of an instance
+     * so that the graph is only rebuilt when mesh topology changes (edge lengths are updated if points move).
+     * */
+    struct ReactionCache {
+        int mesh_point_count = -1;
+        uint64_t mesh_cells_hash = 0;
+        uint64_t mesh_points_hash = 0;
+        bool with_triangles = false;
+        VtkDistanceAlongSurfaceEffect::SurfaceGraph graph;
+        VtkDistanceAlongSurfaceEffect::DistanceWorkspace distance_workspace;
+    };
+
+    /* Signed distance field of the collider (negative inside), stored as a coarse grid with samples
+     * at brick corners, refined to voxel resolution in bricks near the collider surface.
+     * */
+    struct ColliderSdf {
+        static const int BRICK_SIZE = 8; // voxels along brick edge
+
+        // what the field was built from, to tell if it can be reused
+        int collider_point_count = -1;
+        int collider_cell_count = -1;
+        uint64_t collider_points_hash = 0;
+        double requested_voxel_size;
+        double offset;
+
+        double voxel_size;
+        double origin[3];
+        int brick_count[3];
+        std::vector<float> coarse_samples; // (brick_count + 1)^3 samples
+        std::vector<int> brick_index; // per brick, index of its fine samples or -1
+        std::vector<float> fine_samples; // (BRICK_SIZE + 1)^3 samples per refined brick
+    };
+
+    /* Everything kept between cooks of an instance.
+     * */
+    struct InstanceState {
+        TemporalState temporal_state;
+        ColliderSdf collider_sdf;
+        ReactionCache reaction_cache;
+    };
+
+    static const int COLLIDER_MODE_RAYS = 1;
+    static const int COLLIDER_MODE_SDF = 2;
+
+    static const int SOLVER_ITERATIVE = 1;
+    static const int SOLVER_CONJUGATE_GRADIENT = 2;
+
+protected:
+    OfxStatus DestroyInstance(OfxMeshEffectHandle instance) override;
+    OfxStatus vtkCookInstance(OfxMeshEffectHandle instance, VtkEffectInput &main_input, VtkEffectInput &main_output,
+                              std::vector<VtkEffectInput> &extra_inputs) override;
+
+public:
     const char* GetName() override;
     OfxStatus vtkDescribe(OfxParamSetHandle parameters, VtkEffectInputDef &input_mesh, VtkEffectInputDef &output_mesh) override;
     OfxStatus vtkCook(VtkEffectInput &main_input, VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs) override;
@@ -50,18 +123,63 @@ public:
     vtkCook_inner(vtkPolyData *input_polydata, vtkPolyData *input_collider_polydata, vtkPolyData *output_polydata,
                   const char* color_attribute_name, const double input_collider_transform[16], double max_distance, double falloff_radius,
                   double falloff_exponent, double collision_smoothing_ratio, double offset, int number_of_iterations,
-                  bool debug, double collider_normal_factor);
+                  bool debug, double collider_normal_factor, int solver=SOLVER_ITERATIVE,
+                  TemporalState *temporal_state=nullptr, int collider_mode=COLLIDER_MODE_RAYS,
+                  double sdf_voxel_size=0.0, ColliderSdf *collider_sdf=nullptr,
+                  int distance_mode=VtkDistanceAlongSurfaceEffect::DISTANCE_MODE_GRAPH,
+                  ReactionCache *reaction_cache=nullptr);
 
     /* Find out which mesh points need to be moved to clear the collision.
+     * If candidate_points is given, only these points are tested.
      * */
     static std::vector<Contact>
     evaluate_collision(vtkPolyData *mesh_polydata, vtkPolyData *collider_polydata, double max_distance, double offset,
-                       bool debug, double collider_normal_factor);
+                       bool debug, double collider_normal_factor, const std::vector<int> *candidate_points=nullptr);
+
+    /* Rebuild collider_sdf unless it was already built from the same collider and settings.
+     * Voxel size 0 means auto (1/256 of collider bounding box diagonal). The field is refined
+     * up to offset + one brick away from the surface.
+     * */
+    static void update_collider_sdf(vtkPolyData *collider_polydata, ColliderSdf &collider_sdf, double voxel_size,
+                                    double offset);
+
+    /* Same as evaluate_collision(), but using the distance field instead of ray casting:
+     * points with distance < offset are pushed out along mesh normal (blended with field gradient
+     * by collider_normal_factor), by first order estimate of the distance to clear the collider.
+     * */
+    static std::vector<Contact>
+    evaluate_collision_sdf(vtkPolyData *mesh_polydata, const ColliderSdf &collider_sdf, double max_distance,
+                           double offset, double collider_normal_factor,
+                           const std::vector<int> *candidate_points=nullptr);
 
     /* Clear collision by depressing points along their normals;
-     * create falloff by laplacian smoothing weighted by manifold distance from the collision.
+     * create falloff by laplacian smoothing weighted by manifold distance from the collision
+     * (see VtkDistanceAlongSurfaceEffect::compute_distance() for distance_mode).
+     *
+     * With SOLVER_CONJUGATE_GRADIENT, the falloff is solved to convergence instead of iterated
+     * number_of_iterations times (contacts are held fixed, see solve_reaction_cg()).
+     *
+     * Returns IDs of the points that may have moved (contacts and smoothed points), sorted; their new positions
+     * are written to moved_positions (xyz, in the same order). Only the falloff region is copied and deformed,
+     * mesh_polydata is not modified.
+     * If temporal_state is given, its displacement is used as initial guess for the CG solver (when it matches
+     * the mesh); displacement and falloff_region are updated with results of this call.
+     * If reaction_cache is given, the surface graph and distance workspace are kept there between calls.
      * */
-    static void handle_reaction_laplacian(vtkPolyData *mesh_polydata, const std::vector<Contact> &contacts,
+    static std::vector<int> handle_reaction_laplacian(vtkPolyData *mesh_polydata, const std::vector<Contact> &contacts,
                                           double falloff_radius, double falloff_exponent, int number_of_iterations,
-                                          double collision_smoothing_ratio);
+                                          double collision_smoothing_ratio, std::vector<double> &moved_positions,
+                                          int solver=SOLVER_ITERATIVE, TemporalState *temporal_state=nullptr,
+                                          int distance_mode=VtkDistanceAlongSurfaceEffect::DISTANCE_MODE_GRAPH,
+                                          ReactionCache *reaction_cache=nullptr);
+
+private:
+    // instance_state may be null, then nothing is kept for the next cook
+    OfxStatus vtkCook(VtkEffectInput &main_input, VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs,
+                      InstanceState *instance_state);
+
+    // different instances may be cooked concurrently, the map is only accessed with the mutex locked
+    // (state of an instance is only used by its own cook)
+    std::mutex instance_states_mutex;
+    std::map<OfxMeshEffectHandle, InstanceState> instance_states;
 };
@@ -21,8 +21,11 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
-#include <vtkCleanPolyData.h>
+#include <vtkCellArray.h>
+#include <vtkPoints.h>
+
 #include "VtkReduceEdgesEffect.h"
+#include "mfx_vtk_utils.h"
 
 const char *VtkReduceEdgesEffect::GetName() {
     return "Reduce edges";
@@ -44,51 +47,99 @@ OfxStatus VtkReduceEdgesEffect::vtkCook(VtkEffectInput &main_input, VtkEffectInp
 OfxStatus VtkReduceEdgesEffect::vtkCook_inner(vtkPolyData *input_polydata, vtkPolyData *output_polydata,
                                               double maximum_length) {
     auto vtk_input_lines = input_polydata->GetLines();
-    auto vtk_output_lines = vtkSmartPointer<vtkCellArray>::New();
-    auto temp_polydata = vtkSmartPointer<vtkPolyData>::New();
-    temp_polydata->SetPoints(input_polydata->GetPoints());
-    temp_polydata->SetLines(vtk_output_lines);
+    auto input_points = input_polydata->GetPoints();
 
     vtk_input_lines->ConvertTo32BitStorage();
-    int removed_edge_count = 0;
+    const int *input_offsets = vtk_input_lines->GetOffsetsArray32()->GetPointer(0);
+    const int *input_connectivity = vtk_input_lines->GetConnectivityArray32()->GetPointer(0);
+    int input_edge_count = vtk_input_lines->GetNumberOfCells();
+    int point_count = input_polydata->GetNumberOfPoints();
+    const double maximum_length_sq = maximum_length*maximum_length;
 
-    for (int i = 0; i < vtk_input_lines->GetNumberOfCells(); i++) {
-        int j = vtk_input_lines->GetOffsetsArray32()->GetValue(i);
-        int n = vtk_input_lines->GetOffsetsArray32()->GetValue(i+1) - j;
+    // flag edges to keep
+    std::vector<int> edge_index(input_edge_count);
+
+    #pragma omp parallel for schedule(static, 1000) if (input_edge_count > 5000)
+    for (int i = 0; i < input_edge_count; i++) {
+        int j = input_offsets[i];
+        int n = input_offsets[i+1] - j;
 
         if (n != 2) {
-            continue; // not VTK_LINE
+            edge_index[i] = 0; // not VTK_LINE
+            continue;
         }
 
-        int p1 = vtk_input_lines->GetConnectivityArray32()->GetValue(j);
-        int p2 = vtk_input_lines->GetConnectivityArray32()->GetValue(j+1);
-
         double a[3], b[3];
-        input_polydata->GetPoints()->GetPoint(p1, a);
-        input_polydata->GetPoints()->GetPoint(p2, b);
+        input_points->GetPoint(input_connectivity[j], a);
+        input_points->GetPoint(input_connectivity[j+1], b);
 
-        double distance_sq = (a[0]-b[0])*(a[0]-b[0]) + (a[1]-b[1])*(a[1]-b[1]) + (a[2]-b[2])*(a[2]-b[2]);
+        edge_index[i] = (vec3_squared_distance(a, b) < maximum_length_sq) ? 1 : 0;
+    }
 
-        if (distance_sq < maximum_length*maximum_length) {
-            vtk_output_lines->InsertNextCell({p1, p2});
-        } else {
-            removed_edge_count++;
+    // scan + scatter kept edges, marking points that are still used
+    int edge_count = exclusive_scan(edge_index.data(), edge_index.data(), input_edge_count);
+    int removed_edge_count = input_edge_count - edge_count;
+
+    auto output_offsets = vtkSmartPointer<vtkTypeInt32Array>::New();
+    auto output_connectivity = vtkSmartPointer<vtkTypeInt32Array>::New();
+    output_offsets->SetNumberOfValues(edge_count + 1);
+    output_connectivity->SetNumberOfValues(2*edge_count);
+    int *offsets = output_offsets->GetPointer(0);
+    int *connectivity = output_connectivity->GetPointer(0);
+    std::vector<int> point_index(point_count, 0);
+
+    #pragma omp parallel for schedule(static, 1000) if (input_edge_count > 5000)
+    for (int i = 0; i < input_edge_count; i++) {
+        bool kept = (i+1 < input_edge_count) ? (edge_index[i+1] != edge_index[i]) : (edge_index[i] < edge_count);
+        if (!kept) continue;
+
+        int k = edge_index[i];
+        int j = input_offsets[i];
+        offsets[k] = 2*k;
+        for (int v = 0; v < 2; v++) {
+            int p = input_connectivity[j+v];
+            connectivity[2*k + v] = p;
+            #pragma omp atomic write
+            point_index[p] = 1;
         }
     }
+    offsets[edge_count] = 2*edge_count;
+
+    auto output_lines = vtkSmartPointer<vtkCellArray>::New();
+    output_lines->SetData(output_offsets, output_connectivity);
+
+    auto temp_polydata = vtkSmartPointer<vtkPolyData>::New();
+    temp_polydata->SetLines(output_lines);
 
-    if (removed_edge_count) {
-        // get rid of unused points
-        auto clean_polydata_filter = vtkSmartPointer<vtkCleanPolyData>::New();
-        clean_polydata_filter->SetInputData(temp_polydata);
-        clean_polydata_filter->SetConvertStripsToPolys(false);
-        clean_polydata_filter->SetConvertPolysToLines(false);
-        clean_polydata_filter->SetConvertLinesToPoints(false);
-        clean_polydata_filter->SetPointMerging(false);
-        clean_polydata_filter->Update();
-        output_polydata->ShallowCopy(clean_polydata_filter->GetOutput());
-    } else {
+    if (!removed_edge_count) {
+        temp_polydata->SetPoints(input_points);
         output_polydata->ShallowCopy(temp_polydata);
+        return kOfxStatOK;
+    }
+
+    // get rid of unused points: scan + scatter points, then remap edges
+    int output_point_count = exclusive_scan(point_index.data(), point_index.data(), point_count);
+
+    auto output_points = vtkSmartPointer<vtkPoints>::New();
+    output_points->SetDataType(input_points->GetDataType());
+    output_points->SetNumberOfPoints(output_point_count);
+
+    #pragma omp parallel for schedule(static, 1000) if (point_count > 5000)
+    for (int p = 0; p < point_count; p++) {
+        bool used = (p+1 < point_count) ? (point_index[p+1] != point_index[p]) : (point_index[p] < output_point_count);
+        if (used) {
+            double x[3];
+            input_points->GetPoint(p, x);
+            output_points->SetPoint(point_index[p], x);
+        }
+    }
+
+    #pragma omp parallel for schedule(static, 1000) if (edge_count > 5000)
+    for (int k = 0; k < 2*edge_count; k++) {
+        connectivity[k] = point_index[connectivity[k]];
     }
 
+    temp_polydata->SetPoints(output_points);
+    output_polydata->ShallowCopy(temp_polydata);
     return kOfxStatOK;
 }
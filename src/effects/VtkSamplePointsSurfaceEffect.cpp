@@ -21,11 +21,20 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
-#include <vtkAppendPolyData.h>
-#include <vtkPolyDataPointSampler.h>
 #include <vtkTriangleFilter.h>
+#include <vtkCellArray.h>
+#include <vtkFloatArray.h>
+#include <vtkPointData.h>
+#include <vtkPolyDataNormals.h>
+#include <vtkUnsignedCharArray.h>
+#include <vtkIntArray.h>
+#include <vtkDoubleArray.h>
 
 #include "VtkSamplePointsSurfaceEffect.h"
+#include "VtkEffectUtils.h"
+#include "mfx_vtk_utils.h"
+#include <cstdint>
+#include <type_traits>
 
 const char *VtkSamplePointsSurfaceEffect::GetName() {
     return "Sample points (surface)";
@@ -38,7 +47,11 @@ OfxStatus VtkSamplePointsSurfaceEffect::vtkDescribe(OfxParamSetHandle parameters
     // AddParam(PARAM_GENERATE_VERTEX_POINTS, true).Label("Generate vertex points");
     AddParam(PARAM_GENERATE_EDGE_POINTS, true).Label("Sample edges");
     AddParam(PARAM_GENERATE_INTERIOR_POINTS, true).Label("Sample faces");
-    // AddParam(PARAM_INTERPOLATE_POINT_DATA, false).Label("Interpolate point data");
+    AddParam(PARAM_INTERPOLATE_POINT_DATA, false).Label("Interpolate point data");
+    AddParam(PARAM_SAMPLING_MODE, SAMPLING_MODE_REGULAR).Range(1, 2).Label("Sampling mode"); // TODO make this enum!
+    AddParam(PARAM_RANDOM_SEED, 0).Range(0, 1000000).Label("Random seed");
+    input_mesh.RequestCornerAttribute(ATTRIBUTE_COLOR, 3, MfxAttributeType::UByte, MfxAttributeSemantic::Color, false);
+    input_mesh.RequestCornerAttribute(ATTRIBUTE_UV, 2, MfxAttributeType::Float, MfxAttributeSemantic::TextureCoordinate, false);
     return kOfxStatOK;
 }
 
@@ -48,49 +61,646 @@ OfxStatus VtkSamplePointsSurfaceEffect::vtkCook(VtkEffectInput &main_input, VtkE
     auto generate_vertex_points = true; // GetParam<bool>(PARAM_GENERATE_VERTEX_POINTS).GetValue(); // TODO false crashes VTK 9.0.1, why?
     auto generate_edge_points = GetParam<bool>(PARAM_GENERATE_EDGE_POINTS).GetValue();
     auto generate_interior_points = GetParam<bool>(PARAM_GENERATE_INTERIOR_POINTS).GetValue();
-    // bool interpolate_point_data = GetParam<bool>(PARAM_INTERPOLATE_POINT_DATA).GetValue();
+    auto interpolate_point_data = GetParam<bool>(PARAM_INTERPOLATE_POINT_DATA).GetValue();
+    auto sampling_mode = GetParam<int>(PARAM_SAMPLING_MODE).GetValue();
+    auto random_seed = GetParam<int>(PARAM_RANDOM_SEED).GetValue();
+
+    // XXX until we have enums...
+    sampling_mode = clamp(sampling_mode, SAMPLING_MODE_REGULAR, SAMPLING_MODE_POISSON_DISK);
 
     return vtkCook_inner(main_input.data, main_output.data, distance, generate_vertex_points,
-                         generate_edge_points, generate_interior_points);
+                         generate_edge_points, generate_interior_points, sampling_mode, interpolate_point_data,
+                         random_seed);
 }
 
 OfxStatus
 VtkSamplePointsSurfaceEffect::vtkCook_inner(vtkPolyData *input_polydata, vtkPolyData *output_polydata, double distance,
                                             bool generate_vertex_points, bool generate_edge_points,
-                                            bool generate_interior_points) {
-    auto append_poly_data = vtkSmartPointer<vtkAppendPolyData>::New();
-
-    auto vertex_edge_sampler = vtkSmartPointer<vtkPolyDataPointSampler>::New();
-    vertex_edge_sampler->SetInputData(input_polydata);
-    vertex_edge_sampler->SetDistance(distance);
-    vertex_edge_sampler->SetGenerateVertexPoints(generate_vertex_points);
-    vertex_edge_sampler->SetGenerateEdgePoints(generate_edge_points);
-    vertex_edge_sampler->SetGenerateInteriorPoints(false);
-    // vertex_edge_sampler->SetInterpolatePointData(interpolate_point_data);
-    vertex_edge_sampler->Update();
-
-    append_poly_data->AddInputData(vertex_edge_sampler->GetOutput());
-
-    if (generate_interior_points) {
-        // to handle non-convex polygons correctly, we need to triangulate first; fixes #2
-        auto triangle_filter = vtkSmartPointer<vtkTriangleFilter>::New();
-        triangle_filter->SetInputData(input_polydata);
+                                            bool generate_interior_points, int sampling_mode,
+                                            bool interpolate_point_data, int random_seed) {
+    std::vector<SurfaceSample> samples;
+
+    if (sampling_mode == SAMPLING_MODE_POISSON_DISK) {
+        // hexagonal packing with given distance has this many points per unit area
+        double density = 2.0 / (std::sqrt(3.0) * distance * distance);
+
+        std::vector<SurfaceSample> candidate_samples;
+        double area = sample_faces_random(input_polydata, POISSON_DISK_CANDIDATE_RATIO * density, candidate_samples,
+                                          random_seed);
+        int num_candidates = candidate_samples.size();
+        int target_count = std::min(num_candidates, static_cast<int>(std::round(density * area)));
 
-        auto face_sampler = vtkSmartPointer<vtkPolyDataPointSampler>::New();
-        face_sampler->SetInputConnection(triangle_filter->GetOutputPort());
-        face_sampler->SetDistance(distance);
-        face_sampler->SetGenerateVertexPoints(false);
-        face_sampler->SetGenerateEdgePoints(false);
-        face_sampler->SetGenerateInteriorPoints(true);
-        // face_sampler->SetInterpolatePointData(interpolate_point_data);
+        std::vector<float> candidates(3*num_candidates);
+        interpolate_sample_positions(input_polydata, candidate_samples, candidates.data());
+
+        std::vector<int> selected;
+        eliminate_samples(candidates, target_count, area, 2, selected);
+
+        samples.resize(selected.size());
+        for (size_t i = 0; i < selected.size(); i++) {
+            samples[i] = candidate_samples[selected[i]];
+        }
+    } else {
+        sample_regular(input_polydata, distance, generate_vertex_points, generate_edge_points,
+                       generate_interior_points, samples);
+    }
 
-        face_sampler->Update();
-        append_poly_data->AddInputData(face_sampler->GetOutput());
+    int num_samples = samples.size();
+    auto points = vtkSmartPointer<vtkPoints>::New();
+    points->SetDataTypeToFloat();
+    points->SetNumberOfPoints(num_samples);
+    if (num_samples > 0) {
+        float *points_ptr = vtkFloatArray::SafeDownCast(points->GetData())->GetPointer(0);
+        interpolate_sample_positions(input_polydata, samples, points_ptr);
     }
 
-    append_poly_data->Update();
+    auto output = vtkSmartPointer<vtkPolyData>::New();
+    output->SetPoints(points);
 
-    auto filter_output = append_poly_data->GetOutput();
-    output_polydata->ShallowCopy(filter_output);
+    if (interpolate_point_data) {
+        interpolate_sample_point_data(input_polydata, samples, output->GetPointData());
+    }
+
+    output_polydata->ShallowCopy(output);
     return kOfxStatOK;
 }
+
+void VtkSamplePointsSurfaceEffect::interpolate_sample_positions(vtkPolyData *mesh,
+                                                                const std::vector<SurfaceSample> &samples,
+                                                                float *positions) {
+    int num_samples = samples.size();
+    #pragma omp parallel for schedule(static, 1000) if (num_samples > 5000)
+    for (int i = 0; i < num_samples; i++) {
+        const SurfaceSample &sample = samples[i];
+        double p[3] = {0, 0, 0};
+        for (int v = 0; v < 3; v++) {
+            double q[3];
+            mesh->GetPoint(sample.point_ids[v], q);
+            for (int a = 0; a < 3; a++) {
+                p[a] += sample.weights[v] * q[a];
+            }
+        }
+        for (int a = 0; a < 3; a++) {
+            positions[3*i + a] = p[a];
+        }
+    }
+}
+
+void VtkSamplePointsSurfaceEffect::interpolate_sample_point_data(vtkPolyData *mesh,
+                                                                 const std::vector<SurfaceSample> &samples,
+                                                                 vtkPointData *output_point_data) {
+    int num_samples = samples.size();
+    int num_points = mesh->GetNumberOfPoints();
+    auto input_point_data = mesh->GetPointData();
+
+    // interpolate arr_in into arr_out with typed loops; integer arrays (labels) take value of the nearest point,
+    // unsigned char arrays (colors) are rounded
+    auto interpolate_array = [&](auto *arr_in, auto *arr_out) {
+        using T = typename std::remove_pointer_t<decltype(arr_in)>::ValueType;
+        int nc = arr_in->GetNumberOfComponents();
+        arr_out->SetName(arr_in->GetName());
+        arr_out->SetNumberOfComponents(nc);
+        arr_out->SetNumberOfTuples(num_samples);
+        if (num_samples == 0) return;
+        const T *src = arr_in->GetPointer(0);
+        T *dst = arr_out->GetPointer(0);
+
+        #pragma omp parallel for schedule(static, 1000) if (num_samples > 5000)
+        for (int i = 0; i < num_samples; i++) {
+            const SurfaceSample &sample = samples[i];
+            if constexpr (std::is_same_v<T, int>) {
+                int v_max = 0;
+                for (int v = 1; v < 3; v++) {
+                    if (sample.weights[v] > sample.weights[v_max]) v_max = v;
+                }
+                for (int c = 0; c < nc; c++) {
+                    dst[i*nc + c] = src[sample.point_ids[v_max]*nc + c];
+                }
+            } else {
+                for (int c = 0; c < nc; c++) {
+                    double acc = 0.0;
+                    for (int v = 0; v < 3; v++) {
+                        acc += sample.weights[v] * src[sample.point_ids[v]*nc + c];
+                    }
+                    if constexpr (std::is_same_v<T, unsigned char>) {
+                        dst[i*nc + c] = static_cast<T>(clamp(std::lround(acc), 0L, 255L));
+                    } else {
+                        dst[i*nc + c] = static_cast<T>(acc);
+                    }
+                }
+            }
+        }
+    };
+
+    for (int k = 0; k < input_point_data->GetNumberOfArrays(); k++) {
+        vtkDataArray *arr = input_point_data->GetArray(k);
+        if (!arr || arr->GetNumberOfTuples() != num_points || !arr->GetName()) continue;
+
+        if (auto arr_float = vtkFloatArray::SafeDownCast(arr)) {
+            auto arr_out = vtkSmartPointer<vtkFloatArray>::New();
+            interpolate_array(arr_float, arr_out.Get());
+            output_point_data->AddArray(arr_out);
+        } else if (auto arr_double = vtkDoubleArray::SafeDownCast(arr)) {
+            auto arr_out = vtkSmartPointer<vtkDoubleArray>::New();
+            interpolate_array(arr_double, arr_out.Get());
+            output_point_data->AddArray(arr_out);
+        } else if (auto arr_int = vtkIntArray::SafeDownCast(arr)) {
+            auto arr_out = vtkSmartPointer<vtkIntArray>::New();
+            interpolate_array(arr_int, arr_out.Get());
+            output_point_data->AddArray(arr_out);
+        } else if (auto arr_uchar = vtkUnsignedCharArray::SafeDownCast(arr)) {
+            auto arr_out = vtkSmartPointer<vtkUnsignedCharArray>::New();
+            interpolate_array(arr_uchar, arr_out.Get());
+            output_point_data->AddArray(arr_out);
+        } else {
+            printf("VtkSamplePointsSurfaceEffect - warning, cannot interpolate array %s of this type\n", arr->GetName());
+        }
+    }
+
+    // point normals, smooth across edges so that they keep point IDs
+    if (mesh->GetNumberOfPolys() > 0) {
+        auto normals_filter = vtkSmartPointer<vtkPolyDataNormals>::New();
+        normals_filter->SetInputData(mesh);
+        normals_filter->SetComputePointNormals(true);
+        normals_filter->SetComputeCellNormals(false);
+        normals_filter->SetSplitting(false);
+        normals_filter->SetConsistency(false);
+        normals_filter->Update();
+
+        auto normals = vtkFloatArray::SafeDownCast(normals_filter->GetOutput()->GetPointData()->GetNormals());
+        if (normals && normals->GetNumberOfTuples() == num_points) {
+            auto normals_out = vtkSmartPointer<vtkFloatArray>::New();
+            interpolate_array(normals, normals_out.Get());
+            normals_out->SetName(ATTRIBUTE_NORMAL);
+
+            float *n = num_samples > 0 ? normals_out->GetPointer(0) : nullptr;
+            #pragma omp parallel for schedule(static, 1000) if (num_samples > 5000)
+            for (int i = 0; i < num_samples; i++) {
+                float length = std::sqrt(vec3_dot(&n[3*i], &n[3*i]));
+                if (length > 0.0f) {
+                    for (int a = 0; a < 3; a++) n[3*i + a] /= length;
+                }
+            }
+            output_point_data->AddArray(normals_out);
+        }
+    }
+}
+
+void VtkSamplePointsSurfaceEffect::sample_regular(vtkPolyData *mesh, double distance, bool generate_vertex_points,
+                                                  bool generate_edge_points, bool generate_interior_points,
+                                                  std::vector<SurfaceSample> &samples) {
+    samples.clear();
+    if (!is_positive_double(distance)) {
+        return;
+    }
+
+    int num_points = mesh->GetNumberOfPoints();
+    int num_vertex_elements = generate_vertex_points ? num_points : 0;
+
+    // unique edges of polygons and lines, as (min ID << 32 | max ID)
+    std::vector<uint64_t> edges;
+    if (generate_edge_points) {
+        auto collect_edges = [&edges](vtkCellArray *cells, bool closed) {
+            int num_cells = cells->GetNumberOfCells();
+            visit_cell_array(cells, [&](auto *offsets, auto *connectivity) {
+                for (int c = 0; c < num_cells; c++) {
+                    auto begin = offsets[c], end = offsets[c+1];
+                    if (end - begin < 2) continue;
+                    for (auto k = begin; k < end; k++) {
+                        auto next = k + 1;
+                        if (next == end) {
+                            if (!closed || end - begin < 3) break;
+                            next = begin;
+                        }
+                        uint64_t a = connectivity[k], b = connectivity[next];
+                        if (a == b) continue;
+                        edges.push_back((std::min(a, b) << 32) | std::max(a, b));
+                    }
+                }
+            });
+        };
+        if (mesh->GetPolys()) collect_edges(mesh->GetPolys(), true);
+        if (mesh->GetLines()) collect_edges(mesh->GetLines(), false);
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+    }
+    int num_edges = edges.size();
+
+    // to handle non-convex polygons correctly, we need to triangulate first; fixes #2
+    std::vector<int> triangle_points;
+    vtkCellArray *polys = mesh->GetPolys();
+    if (generate_interior_points && polys && polys->GetNumberOfCells() > 0) {
+        vtkSmartPointer<vtkPolyData> triangle_mesh = mesh;
+        if (polys->GetMaxCellSize() > 3) {
+            auto triangle_filter = vtkSmartPointer<vtkTriangleFilter>::New();
+            triangle_filter->SetInputData(mesh);
+            triangle_filter->SetPassLines(false);
+            triangle_filter->SetPassVerts(false);
+            triangle_filter->Update();
+            triangle_mesh = triangle_filter->GetOutput(); // this keeps point IDs
+            polys = triangle_mesh->GetPolys();
+        }
+        int num_cells = polys->GetNumberOfCells();
+        visit_cell_array(polys, [&](auto *offsets, auto *connectivity) {
+            for (int c = 0; c < num_cells; c++) {
+                if (offsets[c+1] - offsets[c] != 3) continue;
+                for (int v = 0; v < 3; v++) {
+                    triangle_points.push_back(connectivity[offsets[c] + v]);
+                }
+            }
+        });
+    }
+    int num_triangles = triangle_points.size() / 3;
+
+    // grid of samples in triangle parametric space, with spacing at most distance along the two edges from first point;
+    // calls f(s, t) for each grid node strictly inside the triangle
+    auto for_each_interior_sample = [mesh, distance, &triangle_points](int t, auto &&f) {
+        const int *ids = &triangle_points[3*t];
+        double x0[3], x1[3], x2[3];
+        mesh->GetPoint(ids[0], x0);
+        mesh->GetPoint(ids[1], x1);
+        mesh->GetPoint(ids[2], x2);
+        double l1 = std::sqrt(vec3_squared_distance(x0, x1));
+        double l2 = std::sqrt(vec3_squared_distance(x0, x2));
+        if (!(l1 > distance || l2 > distance)) return;
+        int n1 = std::max(3, static_cast<int>(std::min(l1 / distance, 1e4)) + 1);
+        int n2 = std::max(3, static_cast<int>(std::min(l2 / distance, 1e4)) + 1);
+        for (int i = 1; i < n1 - 1; i++) {
+            double s = static_cast<double>(i) / (n1 - 1);
+            for (int j = 1; j < n2 - 1; j++) {
+                double t = static_cast<double>(j) / (n2 - 1);
+                if (1.0 - s - t <= 0.0) break;
+                f(s, t);
+            }
+        }
+    };
+
+    auto edge_length = [mesh, &edges](int e) -> double {
+        double x0[3], x1[3];
+        mesh->GetPoint(static_cast<int>(edges[e] >> 32), x0);
+        mesh->GetPoint(static_cast<int>(edges[e] & 0xffffffffu), x1);
+        return std::sqrt(vec3_squared_distance(x0, x1));
+    };
+
+    // count samples per element (point, edge, triangle), then each element writes its own range of the output
+    int num_elements = num_vertex_elements + num_edges + num_triangles;
+    std::vector<int64_t> sample_offsets(num_elements + 1);
+
+    #pragma omp parallel for schedule(static, 1000) if (num_elements > 5000)
+    for (int k = 0; k < num_elements; k++) {
+        int64_t count = 0;
+        if (k < num_vertex_elements) {
+            count = 1;
+        } else if (k < num_vertex_elements + num_edges) {
+            count = static_cast<int64_t>(std::min(edge_length(k - num_vertex_elements) / distance, 1e9));
+        } else {
+            for_each_interior_sample(k - num_vertex_elements - num_edges, [&count](double, double) { count++; });
+        }
+        sample_offsets[k] = count;
+    }
+
+    int64_t num_samples = exclusive_scan(sample_offsets.data(), sample_offsets.data(), num_elements);
+    sample_offsets[num_elements] = num_samples;
+
+    const int64_t max_count = 100000000;
+    if (num_samples > max_count) {
+        printf("VtkSamplePointsSurfaceEffect - error, would generate %lld points (limit is %lld), increase distance\n",
+               static_cast<long long>(num_samples), static_cast<long long>(max_count));
+        return;
+    }
+
+    samples.resize(num_samples);
+
+    #pragma omp parallel for schedule(dynamic, 1000) if (num_elements > 5000)
+    for (int k = 0; k < num_elements; k++) {
+        SurfaceSample *out = &samples[sample_offsets[k]];
+        int64_t count = sample_offsets[k+1] - sample_offsets[k];
+
+        if (k < num_vertex_elements) {
+            *out = SurfaceSample{ {k, k, k}, {1.0f, 0.0f, 0.0f} };
+        } else if (k < num_vertex_elements + num_edges) {
+            uint64_t edge = edges[k - num_vertex_elements];
+            int a = static_cast<int>(edge >> 32), b = static_cast<int>(edge & 0xffffffffu);
+            // evenly spaced points along the edge, endpoints excluded
+            for (int64_t i = 0; i < count; i++) {
+                float t = static_cast<float>(i + 1) / (count + 1);
+                out[i] = SurfaceSample{ {a, b, b}, {1.0f - t, t, 0.0f} };
+            }
+        } else {
+            const int *ids = &triangle_points[3*(k - num_vertex_elements - num_edges)];
+            for_each_interior_sample(k - num_vertex_elements - num_edges, [&](double s, double t) {
+                *out++ = SurfaceSample{ {ids[0], ids[1], ids[2]},
+                                        {static_cast<float>(1.0 - s - t), static_cast<float>(s), static_cast<float>(t)} };
+            });
+        }
+    }
+}
+
+double VtkSamplePointsSurfaceEffect::sample_faces_random(vtkPolyData *mesh, double density,
+                                                         std::vector<SurfaceSample> &samples, int random_seed) {
+    samples.clear();
+
+    // to handle non-convex polygons correctly, we need to triangulate first; fixes #2
+    vtkSmartPointer<vtkPolyData> triangle_mesh = mesh;
+    vtkCellArray *polys = mesh->GetPolys();
+    if (!polys || polys->GetNumberOfCells() == 0) {
+        return 0.0;
+    }
+    if (polys->GetMaxCellSize() > 3) {
+        auto triangle_filter = vtkSmartPointer<vtkTriangleFilter>::New();
+        triangle_filter->SetInputData(mesh);
+        triangle_filter->SetPassLines(false);
+        triangle_filter->SetPassVerts(false);
+        triangle_filter->Update();
+        triangle_mesh = triangle_filter->GetOutput(); // this keeps point IDs
+        polys = triangle_mesh->GetPolys();
+    }
+
+    int num_triangles = polys->GetNumberOfCells();
+    std::vector<int> triangle_points(3*num_triangles);
+    std::vector<double> area_offsets(num_triangles + 1);
+
+    visit_cell_array(polys, [&](auto *offsets, auto *connectivity) {
+        #pragma omp parallel for schedule(static, 1000) if (num_triangles > 5000)
+        for (int t = 0; t < num_triangles; t++) {
+            double p[3][3];
+            for (int v = 0; v < 3; v++) {
+                triangle_points[3*t + v] = connectivity[offsets[t] + v];
+                triangle_mesh->GetPoint(triangle_points[3*t + v], p[v]);
+            }
+            double e1[3], e2[3], n[3];
+            for (int a = 0; a < 3; a++) {
+                e1[a] = p[1][a] - p[0][a];
+                e2[a] = p[2][a] - p[0][a];
+            }
+            n[0] = e1[1]*e2[2] - e1[2]*e2[1];
+            n[1] = e1[2]*e2[0] - e1[0]*e2[2];
+            n[2] = e1[0]*e2[1] - e1[1]*e2[0];
+            area_offsets[t] = 0.5 * std::sqrt(vec3_dot(n, n));
+        }
+    });
+
+    double area = exclusive_scan(area_offsets.data(), area_offsets.data(), num_triangles);
+    area_offsets[num_triangles] = area;
+
+    double count_estimate = std::round(density * area);
+    const int max_count = 100000000;
+    if (!(count_estimate <= max_count)) {
+        printf("VtkSamplePointsSurfaceEffect - warning, would generate %g points, limiting to %d\n", count_estimate, max_count);
+        count_estimate = max_count;
+    }
+    int count = static_cast<int>(count_estimate);
+    if (count <= 0 || !is_positive_double(area)) {
+        return area;
+    }
+
+    // low discrepancy sequence - first component picks the triangle, the others place point in it
+    const auto random_sequence = AdditiveRecurrence<3>(random_seed);
+
+    samples.resize(count);
+    #pragma omp parallel for schedule(static, 1000) if (count > 5000)
+    for (int i = 0; i < count; i++) {
+        double u[3];
+        for (int d = 0; d < 3; d++) {
+            u[d] = random_sequence.GetValueAt(i + 1, d);
+        }
+        double target = u[0] * area;
+        int t = std::upper_bound(area_offsets.begin(), area_offsets.end(), target) - area_offsets.begin() - 1;
+        t = clamp(t, 0, num_triangles - 1);
+
+        // uniform point in triangle
+        double r = std::sqrt(u[1]);
+        SurfaceSample &sample = samples[i];
+        for (int v = 0; v < 3; v++) {
+            sample.point_ids[v] = triangle_points[3*t + v];
+        }
+        sample.weights[0] = 1.0 - r;
+        sample.weights[1] = r * (1.0 - u[2]);
+        sample.weights[2] = r * u[2];
+    }
+
+    return area;
+}
+
+/* Indexed binary max-heap of sample weights, with key update.
+ * */
+class SampleHeap {
+public:
+    explicit SampleHeap(const std::vector<double> &weights) : weight(weights), heap(weights.size()), position(weights.size()) {
+        int n = weights.size();
+        for (int i = 0; i < n; i++) {
+            heap[i] = i;
+            position[i] = i;
+        }
+        for (int i = n/2 - 1; i >= 0; i--) {
+            sift_down(i);
+        }
+    }
+
+    bool empty() const {
+        return heap.empty();
+    }
+
+    int pop() {
+        int top = heap[0];
+        position[top] = -1;
+        int last = heap.back();
+        heap.pop_back();
+        if (!heap.empty()) {
+            heap[0] = last;
+            position[last] = 0;
+            sift_down(0);
+        }
+        return top;
+    }
+
+    // weight of i was lowered
+    void decrease(int i, double new_weight) {
+        weight[i] = new_weight;
+        sift_down(position[i]);
+    }
+
+    double get_weight(int i) const {
+        return weight[i];
+    }
+
+private:
+    std::vector<double> weight;
+    std::vector<int> heap;
+    std::vector<int> position;
+
+    void sift_down(int k) {
+        int i = heap[k];
+        int size = heap.size();
+        while (true) {
+            int child = 2*k + 1;
+            if (child >= size) break;
+            if (child + 1 < size && weight[heap[child + 1]] > weight[heap[child]]) child++;
+            if (weight[heap[child]] <= weight[i]) break;
+            heap[k] = heap[child];
+            position[heap[k]] = k;
+            k = child;
+        }
+        heap[k] = i;
+        position[i] = k;
+    }
+};
+
+void VtkSamplePointsSurfaceEffect::eliminate_samples(const std::vector<float> &candidates, int target_count,
+                                                     double measure, int dimension, std::vector<int> &selected) {
+    int num_candidates = candidates.size() / 3;
+    selected.clear();
+
+    if (target_count >= num_candidates) {
+        for (int i = 0; i < num_candidates; i++) selected.push_back(i);
+        return;
+    }
+    if (target_count <= 0) {
+        return;
+    }
+
+    // maximal Poisson disk radius for target_count points, from densest packing (hexagonal / FCC)
+    double r_max = (dimension == 2) ? std::sqrt(measure / (2.0*std::sqrt(3.0)*target_count))
+                                    : std::cbrt(measure / (4.0*std::sqrt(2.0)*target_count));
+    // weight limiting, so that very close pairs do not dominate
+    double r_min = r_max * (1.0 - std::pow(static_cast<double>(target_count) / num_candidates, 1.5)) * 0.65;
+    const double search_radius = 2.0 * r_max;
+    if (!is_positive_double(search_radius)) {
+        for (int i = 0; i < target_count; i++) selected.push_back(i);
+        return;
+    }
+
+    // (1 - d/(2 r_max))^alpha with alpha = 8
+    auto pair_weight = [=](double d) -> double {
+        double d_hat = std::max(d, 2.0 * r_min);
+        double x = 1.0 - d_hat / search_radius;
+        x *= x;
+        x *= x;
+        return x * x;
+    };
+
+    // spatial hash - candidates sorted by grid cell (of size search_radius), cells found by open addressing
+    float bounds_min[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    for (int i = 0; i < num_candidates; i++) {
+        vec3_min(bounds_min, &candidates[3*i]);
+    }
+    auto cell_coord = [&](const float *p, int a) -> int64_t {
+        return static_cast<int64_t>(std::floor((p[a] - bounds_min[a]) / search_radius));
+    };
+    auto cell_key = [](int64_t x, int64_t y, int64_t z) -> uint64_t {
+        return (static_cast<uint64_t>(x) << 42) | (static_cast<uint64_t>(y) << 21) | static_cast<uint64_t>(z);
+    };
+
+    std::vector<uint64_t> candidate_key(num_candidates);
+    std::vector<int> order(num_candidates);
+    #pragma omp parallel for schedule(static, 1000) if (num_candidates > 5000)
+    for (int i = 0; i < num_candidates; i++) {
+        const float *p = &candidates[3*i];
+        candidate_key[i] = cell_key(cell_coord(p, 0), cell_coord(p, 1), cell_coord(p, 2));
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return candidate_key[a] < candidate_key[b] || (candidate_key[a] == candidate_key[b] && a < b);
+    });
+
+    // occupied cells, as ranges of the sorted order; positions are copied in that order for better locality
+    std::vector<int> cell_offsets;
+    std::vector<uint64_t> cell_keys;
+    std::vector<int> candidate_cell(num_candidates);
+    std::vector<float> sorted_candidates(3*num_candidates);
+    for (int k = 0; k < num_candidates; k++) {
+        int i = order[k];
+        if (k == 0 || candidate_key[i] != cell_keys.back()) {
+            cell_offsets.push_back(k);
+            cell_keys.push_back(candidate_key[i]);
+        }
+        candidate_cell[i] = cell_keys.size() - 1;
+        for (int a = 0; a < 3; a++) {
+            sorted_candidates[3*k + a] = candidates[3*i + a];
+        }
+    }
+    int num_cells = cell_keys.size();
+    cell_offsets.push_back(num_candidates);
+
+    // hash table of occupied cells (open addressing), used to find neighbors of each cell
+    int table_bits = 1;
+    while ((1 << table_bits) < 2*num_cells) table_bits++;
+    int table_size = 1 << table_bits;
+    std::vector<int> table(table_size, -1);
+    auto slot_of = [table_bits](uint64_t key) -> int {
+        // Fibonacci hashing, take the high bits
+        return static_cast<int>((key * 0x9E3779B97F4A7C15ull) >> (64 - table_bits));
+    };
+    for (int c = 0; c < num_cells; c++) {
+        int slot = slot_of(cell_keys[c]);
+        while (table[slot] != -1) slot = (slot + 1) & (table_size - 1);
+        table[slot] = c;
+    }
+
+    std::vector<int> cell_neighbors(27*num_cells, -1); // -1 for unoccupied
+    #pragma omp parallel for schedule(static, 1000) if (num_cells > 5000)
+    for (int c = 0; c < num_cells; c++) {
+        const float *p = &sorted_candidates[3*cell_offsets[c]];
+        int64_t xyz[3] = { cell_coord(p, 0), cell_coord(p, 1), cell_coord(p, 2) };
+        int n = 0;
+        for (int64_t z = xyz[2] - 1; z <= xyz[2] + 1; z++) {
+            for (int64_t y = xyz[1] - 1; y <= xyz[1] + 1; y++) {
+                for (int64_t x = xyz[0] - 1; x <= xyz[0] + 1; x++, n++) {
+                    if (x < 0 || y < 0 || z < 0) continue;
+                    uint64_t key = cell_key(x, y, z);
+                    int slot = slot_of(key);
+                    while (table[slot] != -1 && cell_keys[table[slot]] != key) slot = (slot + 1) & (table_size - 1);
+                    cell_neighbors[27*c + n] = table[slot];
+                }
+            }
+        }
+    }
+
+    // call f(j, distance) for all candidates j != i closer than search_radius
+    const float search_radius_squared = search_radius * search_radius;
+    auto for_each_neighbor = [&](int i, auto &&f) {
+        const float *p = &candidates[3*i];
+        const int *neighbors = &cell_neighbors[27*candidate_cell[i]];
+        for (int n = 0; n < 27; n++) {
+            int c = neighbors[n];
+            if (c < 0) continue;
+            for (int k = cell_offsets[c]; k < cell_offsets[c+1]; k++) {
+                float d2 = vec3_squared_distance(p, &sorted_candidates[3*k]);
+                if (d2 < search_radius_squared && order[k] != i) {
+                    f(order[k], std::sqrt(static_cast<double>(d2)));
+                }
+            }
+        }
+    };
+
+    // initial weights
+    std::vector<double> weights(num_candidates);
+    #pragma omp parallel for schedule(dynamic, 1000) if (num_candidates > 5000)
+    for (int k = 0; k < num_candidates; k++) {
+        int i = order[k];
+        double w = 0.0;
+        for_each_neighbor(i, [&](int j, double d) {
+            w += pair_weight(d);
+        });
+        weights[i] = w;
+    }
+
+    // eliminate samples with highest weight, ie. those in the most crowded places
+    SampleHeap heap(weights);
+    std::vector<char> removed(num_candidates, 0);
+    for (int num_left = num_candidates; num_left > target_count; num_left--) {
+        int i = heap.pop();
+        removed[i] = 1;
+        for_each_neighbor(i, [&](int j, double d) {
+            if (!removed[j]) {
+                heap.decrease(j, heap.get_weight(j) - pair_weight(d));
+            }
+        });
+    }
+
+    for (int i = 0; i < num_candidates; i++) {
+        if (!removed[i]) {
+            selected.push_back(i);
+        }
+    }
+}
@@ -24,6 +24,8 @@ THE SOFTWARE.
 #pragma once
 
 #include "VtkEffect.h"
+#include <vtkPointData.h>
+#include <vector>
 
 class VtkSamplePointsSurfaceEffect : public VtkEffect {
 private:
@@ -32,13 +34,70 @@ private:
     // const char *PARAM_GENERATE_VERTEX_POINTS = "GenerateVertexPoints";
     const char *PARAM_GENERATE_EDGE_POINTS = "GenerateEdgePoints";
     const char *PARAM_GENERATE_INTERIOR_POINTS = "GenerateInteriorPoints";
-    //const char *PARAM_INTERPOLATE_POINT_DATA = "InterpolatePointData";
+    const char *PARAM_INTERPOLATE_POINT_DATA = "InterpolatePointData";
+    const char *PARAM_SAMPLING_MODE = "SamplingMode";
+    const char *PARAM_RANDOM_SEED = "RandomSeed";
+
+    const char *ATTRIBUTE_COLOR = "color0";
+    const char *ATTRIBUTE_UV = "uv0";
 
 public:
+    // name of the point normals array written by interpolate_sample_point_data()
+    static constexpr const char *ATTRIBUTE_NORMAL = "normal0";
+
+    static const int SAMPLING_MODE_REGULAR = 1;
+    static const int SAMPLING_MODE_POISSON_DISK = 2;
+
+    // Poisson disk sampling picks output points from this many times more random candidates
+    static const int POISSON_DISK_CANDIDATE_RATIO = 5;
+
+    /* Point on the surface, given as barycentric combination of mesh points.
+     * */
+    struct SurfaceSample {
+        int point_ids[3];
+        float weights[3];
+    };
+
     const char* GetName() override;
     OfxStatus vtkDescribe(OfxParamSetHandle parameters, VtkEffectInputDef &input_mesh, VtkEffectInputDef &output_mesh) override;
     OfxStatus vtkCook(VtkEffectInput &main_input, VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs) override;
     static OfxStatus vtkCook_inner(vtkPolyData *input_polydata, vtkPolyData *output_polydata,
                                    double distance, bool generate_vertex_points,
-                                   bool generate_edge_points, bool generate_interior_points);
+                                   bool generate_edge_points, bool generate_interior_points,
+                                   int sampling_mode=SAMPLING_MODE_REGULAR, bool interpolate_point_data=false,
+                                   int random_seed=0);
+
+    /* Generate points with regular spacing: mesh points, points along edges of polygons and lines
+     * (each shared edge once) and a grid of points inside each triangle. Polygons are triangulated first.
+     * Samples are counted per element first, so they can be written in parallel, in order of elements.
+     * */
+    static void sample_regular(vtkPolyData *mesh, double distance, bool generate_vertex_points,
+                               bool generate_edge_points, bool generate_interior_points,
+                               std::vector<SurfaceSample> &samples);
+
+    /* Generate random points on faces of the mesh, with given number of points per unit area
+     * (quasi-random, using AdditiveRecurrence with given seed). Polygons are triangulated first. Returns total area of the faces.
+     * */
+    static double sample_faces_random(vtkPolyData *mesh, double density, std::vector<SurfaceSample> &samples,
+                                      int random_seed=0);
+
+    /* Weighted sample elimination [Yuksel 2015, Sample Elimination for Generating Poisson Disk Sample Sets]:
+     * from candidate points (xyz), pick target_count points that are evenly spaced (blue noise).
+     * measure is the area (dimension 2) or volume (dimension 3) which the candidates cover.
+     * selected receives indices of picked candidates, in increasing order.
+     * */
+    static void eliminate_samples(const std::vector<float> &candidates, int target_count, double measure,
+                                  int dimension, std::vector<int> &selected);
+
+    /* Write positions of samples (xyz) into preallocated array.
+     * */
+    static void interpolate_sample_positions(vtkPolyData *mesh, const std::vector<SurfaceSample> &samples,
+                                             float *positions);
+
+    /* Add point data arrays of the mesh to output, interpolated at samples (float, double and unsigned char
+     * arrays are interpolated, int arrays take value of the nearest point), plus smooth point normals
+     * of the mesh as ATTRIBUTE_NORMAL.
+     * */
+    static void interpolate_sample_point_data(vtkPolyData *mesh, const std::vector<SurfaceSample> &samples,
+                                              vtkPointData *output_point_data);
 };
@@ -23,12 +23,16 @@ THE SOFTWARE.
 
 #include <vtkFloatArray.h>
 #include <vtkQuadricDecimation.h>
-#include <vtkMinimalStandardRandomSequence.h>
 #include <vtkImplicitPolyDataDistance.h>
 #include <vtkTriangleFilter.h>
 #include <vtkPointData.h>
+#include <vtkCellArray.h>
+#include <vtkStaticCellLocator.h>
+#include <vtkGenericCell.h>
 
 #include "VtkSamplePointsVolumeEffect.h"
+#include "VtkSamplePointsSurfaceEffect.h"
+#include "VtkEffectUtils.h"
 #include "mfx_vtk_utils.h"
 
 const char *VtkSamplePointsVolumeEffect::GetName() {
@@ -40,6 +44,12 @@ OfxStatus VtkSamplePointsVolumeEffect::vtkDescribe(OfxParamSetHandle parameters,
     AddParam(PARAM_NUMBER_OF_POINTS, 200).Range(1, 1e6).Label("Number of points");
     AddParam(PARAM_DISTRIBUTE_UNIFORMLY, true).Label("Distribute points uniformly");
     AddParam(PARAM_AUTO_SIMPLIFY, true).Label("Auto simplify input mesh");
+    AddParam(PARAM_VOXEL_ACCELERATION, true).Label("Voxel acceleration");
+    AddParam(PARAM_SAMPLING_MODE, SAMPLING_MODE_REJECTION).Range(1, 3).Label("Sampling mode"); // TODO make this enum!
+    AddParam(PARAM_INTERPOLATE_POINT_DATA, false).Label("Interpolate point data");
+    AddParam(PARAM_RANDOM_SEED, 0).Range(0, 1000000).Label("Random seed");
+    input_mesh.RequestCornerAttribute(ATTRIBUTE_COLOR, 3, MfxAttributeType::UByte, MfxAttributeSemantic::Color, false);
+    input_mesh.RequestCornerAttribute(ATTRIBUTE_UV, 2, MfxAttributeType::Float, MfxAttributeSemantic::TextureCoordinate, false);
     // TODO more controls
     return kOfxStatOK;
 }
@@ -48,16 +58,32 @@ OfxStatus VtkSamplePointsVolumeEffect::vtkCook(VtkEffectInput &main_input, VtkEf
     auto number_of_points = GetParam<int>(PARAM_NUMBER_OF_POINTS).GetValue();
     auto distribute_uniformly = GetParam<bool>(PARAM_DISTRIBUTE_UNIFORMLY).GetValue();
     auto auto_simplify = GetParam<bool>(PARAM_AUTO_SIMPLIFY).GetValue();
-    return vtkCook_inner(main_input.data, main_output.data, number_of_points, distribute_uniformly, auto_simplify);
+    auto voxel_acceleration = GetParam<bool>(PARAM_VOXEL_ACCELERATION).GetValue();
+    auto sampling_mode = GetParam<int>(PARAM_SAMPLING_MODE).GetValue();
+    auto interpolate_point_data = GetParam<bool>(PARAM_INTERPOLATE_POINT_DATA).GetValue();
+    auto random_seed = GetParam<int>(PARAM_RANDOM_SEED).GetValue();
+
+    // XXX until we have enums...
+    sampling_mode = clamp(sampling_mode, SAMPLING_MODE_REJECTION, SAMPLING_MODE_POISSON_DISK);
+
+    OfxStatus status = vtkCook_inner(main_input.data, main_output.data, number_of_points, distribute_uniformly,
+                                     auto_simplify, false, voxel_acceleration, sampling_mode, random_seed);
+
+    if (status == kOfxStatOK && interpolate_point_data) {
+        transfer_surface_point_data(main_input.data, main_output.data);
+    }
+    return status;
 }
 
 OfxStatus VtkSamplePointsVolumeEffect::vtkCook_inner(vtkPolyData *input_polydata, vtkPolyData *output_polydata,
                                                      int number_of_points, bool distribute_uniformly,
-                                                     bool auto_simplify, bool _assume_input_polydata_triangles) {
+                                                     bool auto_simplify, bool _assume_input_polydata_triangles,
+                                                     bool voxel_acceleration, int sampling_mode, int random_seed) {
     double bounds[6];
     input_polydata->GetBounds(bounds);
 
-    auto poly_data_distance = vtkSmartPointer<vtkImplicitPolyDataDistance>::New();
+    // surface to measure distance from
+    vtkSmartPointer<vtkPolyData> distance_polydata = input_polydata;
 
     if (auto_simplify && input_polydata->GetNumberOfPolys() > 100) {
         vtkSmartPointer<vtkPolyData> input_triangle_mesh = input_polydata;
@@ -77,12 +103,8 @@ OfxStatus VtkSamplePointsVolumeEffect::vtkCook_inner(vtkPolyData *input_polydata
             quadratic_decimation_filter->SetInputData(input_triangle_mesh);
             quadratic_decimation_filter->SetTargetReduction(target_reduction);
             quadratic_decimation_filter->Update();
-            poly_data_distance->SetInput(quadratic_decimation_filter->GetOutput());
-        } else {
-            poly_data_distance->SetInput(input_polydata);
+            distance_polydata = quadratic_decimation_filter->GetOutput();
         }
-    } else {
-        poly_data_distance->SetInput(input_polydata);
     }
 
     auto points = vtkSmartPointer<vtkPoints>::New();
@@ -97,34 +119,181 @@ OfxStatus VtkSamplePointsVolumeEffect::vtkCook_inner(vtkPolyData *input_polydata
 
     output_polydata->GetPointData()->AddArray(distance_arr);
 
-    auto random_generator_vtk = vtkSmartPointer<vtkMinimalStandardRandomSequence>::New();
-    auto random_generator_custom = AdditiveRecurrence<3>();
-    auto get_random_uniform = [distribute_uniformly, &random_generator_vtk, &random_generator_custom](int i, double low, double high) -> double {
-        if (distribute_uniformly) {
-            random_generator_custom.Next();
-            return random_generator_custom.GetRangeValue(i, low, high);
-        } else {
-            random_generator_vtk->Next();
-            return random_generator_vtk->GetRangeValue(low, high);
-        };
-    };
+    if (sampling_mode == SAMPLING_MODE_STRATIFIED) {
+        InsideGrid stratified_grid;
+        build_inside_grid(distance_polydata, bounds, STRATIFIED_GRID_RESOLUTION, stratified_grid);
+        sample_inside_grid(stratified_grid, number_of_points, distribute_uniformly, points, distance_arr, random_seed);
+        return kOfxStatOK;
+    }
 
-    int i, iteration_count;
-    for (i = 0, iteration_count = 0;
-         i < number_of_points && iteration_count < 10*number_of_points;
-         iteration_count++)
-    {
-        double x = get_random_uniform(0, bounds[0], bounds[1]),
-               y = get_random_uniform(1, bounds[2], bounds[3]),
-               z = get_random_uniform(2, bounds[4], bounds[5]);
+    if (sampling_mode == SAMPLING_MODE_POISSON_DISK) {
+        // stratified candidates, thinned out by sample elimination
+        InsideGrid stratified_grid;
+        build_inside_grid(distance_polydata, bounds, STRATIFIED_GRID_RESOLUTION, stratified_grid);
+
+        int num_candidates = VtkSamplePointsSurfaceEffect::POISSON_DISK_CANDIDATE_RATIO * number_of_points;
+        auto candidate_points = vtkSmartPointer<vtkPoints>::New();
+        candidate_points->SetDataTypeToFloat();
+        candidate_points->SetNumberOfPoints(num_candidates);
+        auto candidate_distance_arr = vtkSmartPointer<vtkFloatArray>::New();
+        candidate_distance_arr->SetNumberOfTuples(num_candidates);
+        sample_inside_grid(stratified_grid, num_candidates, distribute_uniformly, candidate_points, candidate_distance_arr,
+                           random_seed);
+        num_candidates = candidate_points->GetNumberOfPoints();
+
+        const float *candidates_ptr = vtkFloatArray::SafeDownCast(candidate_points->GetData())->GetPointer(0);
+        std::vector<float> candidates(candidates_ptr, candidates_ptr + 3*num_candidates);
+
+        double h = stratified_grid.voxel_size;
+        double volume = h * h * h * std::count(stratified_grid.center_inside.begin(),
+                                               stratified_grid.center_inside.end(), 1);
+
+        std::vector<int> selected;
+        VtkSamplePointsSurfaceEffect::eliminate_samples(candidates, number_of_points, volume, 3, selected);
 
-        double distance = poly_data_distance->EvaluateFunction(x, y, z);
+        int num_selected = selected.size();
+        points->SetNumberOfPoints(num_selected);
+        distance_arr->SetNumberOfTuples(num_selected);
 
-        if (distance < 0) {
-            points->SetPoint(i, x, y, z);
-            distance_arr->SetValue(i, distance);
-            i++;
+        #pragma omp parallel for schedule(static, 1000) if (num_selected > 5000)
+        for (int i = 0; i < num_selected; i++) {
+            int k = selected[i];
+            points->SetPoint(i, candidates[3*k], candidates[3*k + 1], candidates[3*k + 2]);
+            distance_arr->SetValue(i, candidate_distance_arr->GetValue(k));
         }
+        return kOfxStatOK;
+    }
+
+    // classify candidates by lookup where we can, exact distance is only needed near the surface
+    InsideGrid inside_grid;
+    if (voxel_acceleration) {
+        build_inside_grid(distance_polydata, bounds, INSIDE_GRID_RESOLUTION, inside_grid);
+    }
+    int exact_evaluation_count = 0;
+
+    // vtkImplicitPolyDataDistance is not thread safe so each thread gets its own, created here for all batches
+    // (SetInput() runs a pipeline on the mesh, which must not happen concurrently)
+    const int thread_count = max_thread_count();
+    std::vector<vtkSmartPointer<vtkImplicitPolyDataDistance>> distance_functions(thread_count);
+    for (auto &distance_function : distance_functions) {
+        distance_function = vtkSmartPointer<vtkImplicitPolyDataDistance>::New();
+        distance_function->SetInput(distance_polydata);
+    }
+
+    // candidate c takes values 3c, 3c+1, 3c+2 of the random stream, so that candidates can be generated in any order
+    const auto random_sequence = AdditiveRecurrence<3>(random_seed);
+    const auto random_generator = PcgRandom(random_seed);
+    const int random_block_size = 1000;
+
+    // Candidates are generated in batches (at their place in the random stream, as if we went one by one),
+    // distance is evaluated in parallel and accepted candidates are compacted in candidate order.
+    // This gives the same points as testing candidates one at a time until we have enough.
+    const int max_iterations = 10*number_of_points;
+    const int min_batch_size = 1000;
+    std::vector<double> candidates;
+    std::vector<float> candidate_distance;
+    std::vector<int> candidate_accepted;
+    std::vector<int> candidate_index;
+
+    int i = 0, iteration_count = 0;
+    while (i < number_of_points && iteration_count < max_iterations) {
+        // guess how many candidates we need from acceptance rate so far
+        int remaining = number_of_points - i;
+        double acceptance_rate = (iteration_count > 0 && i > 0) ? static_cast<double>(i) / iteration_count : 1.0;
+        double batch_size_estimate = 1.1 * remaining / acceptance_rate;
+        int batch_size = static_cast<int>(std::min<double>(max_iterations - iteration_count,
+                                                           std::max<double>(min_batch_size, batch_size_estimate)));
+
+        candidates.resize(3*batch_size);
+        candidate_distance.resize(batch_size);
+        candidate_accepted.resize(batch_size);
+        candidate_index.resize(batch_size);
+
+        // blocks of candidates are generated in parallel, each jumping ahead to its place in the random stream
+        int num_random_blocks = (batch_size + random_block_size - 1) / random_block_size;
+        #pragma omp parallel for schedule(static, 1) if (batch_size > 5000)
+        for (int b = 0; b < num_random_blocks; b++) {
+            auto block_random_generator = random_generator;
+            block_random_generator.Advance(3 * (static_cast<uint64_t>(iteration_count) + b*random_block_size));
+
+            for (int k = b*random_block_size; k < std::min(batch_size, (b+1)*random_block_size); k++) {
+                uint64_t c = static_cast<uint64_t>(iteration_count) + k;
+                for (int a = 0; a < 3; a++) {
+                    if (distribute_uniformly) {
+                        // index 3c+a+2 is where a serial Next() before each value would be
+                        candidates[3*k + a] = random_sequence.GetRangeValueAt(3*c + a + 2, a, bounds[2*a], bounds[2*a + 1]);
+                    } else {
+                        candidates[3*k + a] = block_random_generator.NextRangeValue(bounds[2*a], bounds[2*a + 1]);
+                    }
+                }
+            }
+        }
+
+        // evaluate distance
+        #pragma omp parallel num_threads(thread_count) if (batch_size > 5000) reduction(+:exact_evaluation_count)
+        {
+            vtkImplicitPolyDataDistance *poly_data_distance = distance_functions[thread_index()];
+
+            #pragma omp for schedule(static, 1000)
+            for (int k = 0; k < batch_size; k++) {
+                double *p = &candidates[3*k];
+                int cell = (voxel_acceleration) ? inside_grid.cell_index(p) : -1;
+                char cell_type = (cell >= 0) ? inside_grid.cells[cell] : InsideGrid::CELL_BOUNDARY;
+
+                if (cell_type == InsideGrid::CELL_INSIDE) {
+                    candidate_distance[k] = NAN; // exact distance is evaluated below, only if the candidate is taken
+                    candidate_accepted[k] = 1;
+                } else if (cell_type == InsideGrid::CELL_OUTSIDE) {
+                    candidate_distance[k] = inside_grid.boundary_distance[cell];
+                    candidate_accepted[k] = 0;
+                } else {
+                    double distance = poly_data_distance->EvaluateFunction(p);
+                    candidate_distance[k] = distance;
+                    candidate_accepted[k] = (distance < 0) ? 1 : 0;
+                    exact_evaluation_count++;
+                }
+            }
+        }
+
+        // compact accepted candidates, keeping only as many as we need
+        int num_accepted = exclusive_scan(candidate_accepted.data(), candidate_index.data(), batch_size);
+        int num_taken = std::min(num_accepted, remaining);
+
+        // voxel grid only decides acceptance, taken points inside the grid still get their exact distance
+        #pragma omp parallel num_threads(thread_count) if (batch_size > 5000) reduction(+:exact_evaluation_count)
+        {
+            vtkImplicitPolyDataDistance *poly_data_distance = distance_functions[thread_index()];
+
+            #pragma omp for schedule(static, 1000)
+            for (int k = 0; k < batch_size; k++) {
+                if (candidate_accepted[k] && candidate_index[k] < num_taken) {
+                    float distance = candidate_distance[k];
+                    if (std::isnan(distance)) {
+                        distance = poly_data_distance->EvaluateFunction(&candidates[3*k]);
+                        exact_evaluation_count++;
+                    }
+                    points->SetPoint(i + candidate_index[k], &candidates[3*k]);
+                    distance_arr->SetValue(i + candidate_index[k], distance);
+                }
+            }
+        }
+
+        // count candidates up to the last one taken, as if we went one by one
+        if (num_taken < remaining) {
+            iteration_count += batch_size;
+        } else {
+            int last_taken = batch_size - 1;
+            while (!candidate_accepted[last_taken] || candidate_index[last_taken] >= num_taken) {
+                last_taken--;
+            }
+            iteration_count += last_taken + 1;
+        }
+        i += num_taken;
+    }
+
+    if (voxel_acceleration) {
+        printf("VtkSamplePointsVolumeEffect - voxel grid %dx%dx%d, %d exact distance evaluations for %d candidates\n",
+               inside_grid.dims[0], inside_grid.dims[1], inside_grid.dims[2], exact_evaluation_count, iteration_count);
     }
 
     if (i < number_of_points) {
@@ -138,3 +307,296 @@ OfxStatus VtkSamplePointsVolumeEffect::vtkCook_inner(vtkPolyData *input_polydata
 
     return kOfxStatOK;
 }
+
+void VtkSamplePointsVolumeEffect::build_inside_grid(vtkPolyData *mesh, const double bounds[6], int resolution,
+                                                    InsideGrid &grid) {
+    // grid with one layer of margin around bounds, so that outermost cells are outside
+    double max_extent = 0.0;
+    for (int a = 0; a < 3; a++) {
+        max_extent = std::max(max_extent, bounds[2*a + 1] - bounds[2*a]);
+    }
+    grid.voxel_size = (max_extent > 0) ? max_extent / resolution : 1.0;
+    for (int a = 0; a < 3; a++) {
+        double extent = bounds[2*a + 1] - bounds[2*a];
+        grid.dims[a] = static_cast<int>(std::ceil(extent / grid.voxel_size)) + 2;
+        grid.origin[a] = bounds[2*a] - 0.5*(grid.dims[a]*grid.voxel_size - extent);
+    }
+
+    const int nx = grid.dims[0], ny = grid.dims[1], nz = grid.dims[2];
+    const double h = grid.voxel_size;
+    const double *origin = grid.origin;
+    grid.cells.assign(nx*ny*nz, InsideGrid::CELL_OUTSIDE);
+    grid.center_inside.assign(nx*ny*nz, 0);
+    char *cells = grid.cells.data();
+    char *center_inside = grid.center_inside.data();
+
+    // scanlines go through cell centers, nudged a bit so that they do not hit mesh edges and vertices exactly
+    // (these would be counted twice or not at all)
+    const double scanline_offset[2] = { 1.2345e-4*h, 2.3456e-4*h };
+    std::vector<std::vector<float>> crossings(ny*nz); // X coordinates where scanline (y, z) crosses the surface
+
+    auto to_cell = [&](double x, int a) -> int {
+        return clamp(static_cast<int>(std::floor((x - origin[a]) / h)), 0, grid.dims[a] - 1);
+    };
+
+    vtkCellArray *polys = mesh->GetPolys();
+    int num_polys = polys ? polys->GetNumberOfCells() : 0;
+    if (num_polys > 0) {
+        visit_cell_array(polys, [&](auto *offsets, auto *connectivity) {
+            for (int c = 0; c < num_polys; c++) {
+                int begin = offsets[c], end = offsets[c+1];
+                if (end - begin < 3) continue;
+
+                // mark cells in bounding box of the polygon as boundary
+                double poly_bounds[6] = { DBL_MAX, -DBL_MAX, DBL_MAX, -DBL_MAX, DBL_MAX, -DBL_MAX };
+                for (int v = begin; v < end; v++) {
+                    double p[3];
+                    mesh->GetPoint(connectivity[v], p);
+                    for (int a = 0; a < 3; a++) {
+                        poly_bounds[2*a] = std::min(poly_bounds[2*a], p[a]);
+                        poly_bounds[2*a + 1] = std::max(poly_bounds[2*a + 1], p[a]);
+                    }
+                }
+                for (int k = to_cell(poly_bounds[4], 2); k <= to_cell(poly_bounds[5], 2); k++) {
+                    for (int j = to_cell(poly_bounds[2], 1); j <= to_cell(poly_bounds[3], 1); j++) {
+                        for (int i = to_cell(poly_bounds[0], 0); i <= to_cell(poly_bounds[1], 0); i++) {
+                            cells[i + nx*(j + ny*k)] = InsideGrid::CELL_BOUNDARY;
+                        }
+                    }
+                }
+
+                // intersect triangle fan with scanlines in its YZ bounding box
+                double p0[3];
+                mesh->GetPoint(connectivity[begin], p0);
+                for (int v = begin + 1; v + 1 < end; v++) {
+                    double p1[3], p2[3];
+                    mesh->GetPoint(connectivity[v], p1);
+                    mesh->GetPoint(connectivity[v+1], p2);
+
+                    double det = (p1[1] - p0[1])*(p2[2] - p0[2]) - (p2[1] - p0[1])*(p1[2] - p0[2]);
+                    if (det == 0) continue; // parallel to scanlines
+
+                    double y_min = std::min({p0[1], p1[1], p2[1]}), y_max = std::max({p0[1], p1[1], p2[1]});
+                    double z_min = std::min({p0[2], p1[2], p2[2]}), z_max = std::max({p0[2], p1[2], p2[2]});
+                    int j_begin = std::max(0, static_cast<int>(std::ceil((y_min - origin[1] - scanline_offset[0]) / h - 0.5)));
+                    int j_end = std::min(ny - 1, static_cast<int>(std::floor((y_max - origin[1] - scanline_offset[0]) / h - 0.5)));
+                    int k_begin = std::max(0, static_cast<int>(std::ceil((z_min - origin[2] - scanline_offset[1]) / h - 0.5)));
+                    int k_end = std::min(nz - 1, static_cast<int>(std::floor((z_max - origin[2] - scanline_offset[1]) / h - 0.5)));
+
+                    for (int k = k_begin; k <= k_end; k++) {
+                        double z = origin[2] + (k + 0.5)*h + scanline_offset[1];
+                        for (int j = j_begin; j <= j_end; j++) {
+                            double y = origin[1] + (j + 0.5)*h + scanline_offset[0];
+
+                            // barycentric coordinates of (y, z) in projection of the triangle
+                            double w1 = ((y - p0[1])*(p2[2] - p0[2]) - (p2[1] - p0[1])*(z - p0[2])) / det;
+                            double w2 = ((p1[1] - p0[1])*(z - p0[2]) - (y - p0[1])*(p1[2] - p0[2])) / det;
+                            if (w1 < 0 || w2 < 0 || w1 + w2 > 1) continue;
+
+                            double x = p0[0] + w1*(p1[0] - p0[0]) + w2*(p2[0] - p0[0]);
+                            crossings[j + ny*k].push_back(x);
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    // fill inside spans of each scanline
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int jk = 0; jk < ny*nz; jk++) {
+        auto &xs = crossings[jk];
+        char *row = cells + nx*jk;
+        char *row_center_inside = center_inside + nx*jk;
+
+        if (xs.size() % 2 != 0) {
+            // mesh is not closed here, we cannot tell what is inside
+            std::fill(row, row + nx, InsideGrid::CELL_BOUNDARY);
+            continue;
+        }
+
+        std::sort(xs.begin(), xs.end());
+        for (int s = 0; s < xs.size(); s += 2) {
+            // cells with center in the span
+            int i_begin = std::max(0, static_cast<int>(std::ceil((xs[s] - origin[0]) / h - 0.5)));
+            int i_end = std::min(nx - 1, static_cast<int>(std::floor((xs[s+1] - origin[0]) / h - 0.5)));
+            for (int i = i_begin; i <= i_end; i++) {
+                row_center_inside[i] = 1;
+                if (row[i] != InsideGrid::CELL_BOUNDARY) {
+                    row[i] = InsideGrid::CELL_INSIDE;
+                }
+            }
+        }
+    }
+
+    // chamfer distance transform from boundary cells, two passes with 26-neighborhood
+    grid.boundary_distance.resize(nx*ny*nz);
+    float *distance = grid.boundary_distance.data();
+    for (int c = 0; c < nx*ny*nz; c++) {
+        distance[c] = (cells[c] == InsideGrid::CELL_BOUNDARY) ? 0.0f : FLT_MAX;
+    }
+
+    const float weights[4] = { 0.0f, 1.0f, static_cast<float>(std::sqrt(2.0)), static_cast<float>(std::sqrt(3.0)) };
+    auto chamfer_pass = [&](int direction) {
+        int k0 = (direction > 0) ? 0 : nz - 1;
+        int j0 = (direction > 0) ? 0 : ny - 1;
+        int i0 = (direction > 0) ? 0 : nx - 1;
+        for (int k = k0; k >= 0 && k < nz; k += direction) {
+            for (int j = j0; j >= 0 && j < ny; j += direction) {
+                for (int i = i0; i >= 0 && i < nx; i += direction) {
+                    float &d = distance[i + nx*(j + ny*k)];
+                    // neighbors already visited in this pass
+                    for (int dk = -1; dk <= 0; dk++) {
+                        for (int dj = -1; dj <= 1; dj++) {
+                            for (int di = -1; di <= 1; di++) {
+                                if (dk == 0 && (dj > 0 || (dj == 0 && di >= 0))) continue;
+                                int ii = i + direction*di, jj = j + direction*dj, kk = k + direction*dk;
+                                if (ii < 0 || jj < 0 || kk < 0 || ii >= nx || jj >= ny || kk >= nz) continue;
+                                float w = weights[std::abs(di) + std::abs(dj) + std::abs(dk)];
+                                d = std::min(d, distance[ii + nx*(jj + ny*kk)] + w);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    };
+    chamfer_pass(1);
+    chamfer_pass(-1);
+
+    for (int c = 0; c < nx*ny*nz; c++) {
+        distance[c] *= h;
+    }
+}
+
+void VtkSamplePointsVolumeEffect::sample_inside_grid(const InsideGrid &grid, int number_of_points,
+                                                     bool distribute_uniformly, vtkPoints *points,
+                                                     vtkFloatArray *distance_arr, int random_seed) {
+    int num_cells = grid.cells.size();
+    std::vector<int> sampled_cells;
+    for (int c = 0; c < num_cells; c++) {
+        if (grid.center_inside[c]) {
+            sampled_cells.push_back(c);
+        }
+    }
+
+    int num_sampled_cells = sampled_cells.size();
+    printf("VtkSamplePointsVolumeEffect - stratified sampling, %d inside voxels\n", num_sampled_cells);
+    if (num_sampled_cells == 0) {
+        printf("WARNING - mesh has no inside, is it closed?\n");
+        points->SetNumberOfPoints(0);
+        distance_arr->SetNumberOfTuples(0);
+        return;
+    }
+
+    const int nx = grid.dims[0], ny = grid.dims[1];
+    const double h = grid.voxel_size;
+
+    // sample s takes values 4s..4s+3 of the random stream; blocks of samples are generated in parallel,
+    // each jumping ahead to its place in the stream
+    const auto random_sequence = AdditiveRecurrence<4>(random_seed);
+    const auto random_generator = PcgRandom(random_seed);
+    const int random_block_size = 1000;
+    int num_random_blocks = (number_of_points + random_block_size - 1) / random_block_size;
+
+    #pragma omp parallel for schedule(static, 1) if (number_of_points > 5000)
+    for (int b = 0; b < num_random_blocks; b++) {
+        auto block_random_generator = random_generator;
+        block_random_generator.Advance(4 * static_cast<uint64_t>(b*random_block_size));
+
+        for (int s = b*random_block_size; s < std::min(number_of_points, (b+1)*random_block_size); s++) {
+            double u[4];
+            for (int d = 0; d < 4; d++) {
+                u[d] = distribute_uniformly ? random_sequence.GetValueAt(s + 1, d) : block_random_generator.NextValue();
+            }
+            int c = sampled_cells[std::min(num_sampled_cells - 1, static_cast<int>(u[0] * num_sampled_cells))];
+            int ijk[3] = { c % nx, (c / nx) % ny, c / (nx*ny) };
+
+            double p[3];
+            for (int a = 0; a < 3; a++) {
+                p[a] = grid.origin[a] + (ijk[a] + u[a+1]) * h;
+            }
+            points->SetPoint(s, p);
+            distance_arr->SetValue(s, -grid.boundary_distance[c]);
+        }
+    }
+}
+
+void VtkSamplePointsVolumeEffect::transfer_surface_point_data(vtkPolyData *mesh, vtkPolyData *point_cloud) {
+    // closest point queries need triangles; the filter keeps point IDs and point data
+    vtkSmartPointer<vtkPolyData> triangle_mesh = mesh;
+    if (mesh->GetNumberOfVerts() > 0 || mesh->GetNumberOfLines() > 0 || mesh->GetNumberOfStrips() > 0 ||
+        mesh->GetPolys()->GetMaxCellSize() > 3) {
+        auto triangle_filter = vtkSmartPointer<vtkTriangleFilter>::New();
+        triangle_filter->SetInputData(mesh);
+        triangle_filter->SetPassLines(false);
+        triangle_filter->SetPassVerts(false);
+        triangle_filter->Update();
+        triangle_mesh = triangle_filter->GetOutput();
+    }
+
+    int num_triangles = triangle_mesh->GetNumberOfPolys();
+    if (num_triangles == 0) {
+        printf("VtkSamplePointsVolumeEffect - warning, mesh has no faces to interpolate from\n");
+        return;
+    }
+
+    // only polys are left, so cell IDs are indices of triangles
+    std::vector<int> triangle_points(3*num_triangles);
+    visit_cell_array(triangle_mesh->GetPolys(), [&](auto *offsets, auto *connectivity) {
+        for (int t = 0; t < num_triangles; t++) {
+            for (int v = 0; v < 3; v++) {
+                triangle_points[3*t + v] = connectivity[offsets[t] + v];
+            }
+        }
+    });
+
+    auto locator = vtkSmartPointer<vtkStaticCellLocator>::New();
+    locator->SetDataSet(triangle_mesh);
+    locator->BuildLocator();
+
+    int num_samples = point_cloud->GetNumberOfPoints();
+    std::vector<VtkSamplePointsSurfaceEffect::SurfaceSample> samples(num_samples);
+
+    // FindClosestPoint() is thread-safe once the locator is built, if each thread has its own cell
+    #pragma omp parallel
+    {
+        auto cell = vtkSmartPointer<vtkGenericCell>::New();
+
+        #pragma omp for schedule(static, 1000)
+        for (int i = 0; i < num_samples; i++) {
+            double p[3], closest[3], dist2;
+            vtkIdType cell_id = 0;
+            int sub_id;
+            point_cloud->GetPoint(i, p);
+            locator->FindClosestPoint(p, closest, cell, cell_id, sub_id, dist2);
+
+            // barycentric coordinates of the closest point
+            auto &sample = samples[i];
+            const int *ids = &triangle_points[3*cell_id];
+            double x[3][3], e1[3], e2[3], d[3];
+            for (int v = 0; v < 3; v++) {
+                sample.point_ids[v] = ids[v];
+                triangle_mesh->GetPoint(ids[v], x[v]);
+            }
+            for (int a = 0; a < 3; a++) {
+                e1[a] = x[1][a] - x[0][a];
+                e2[a] = x[2][a] - x[0][a];
+                d[a] = closest[a] - x[0][a];
+            }
+            double d11 = vec3_dot(e1, e1), d12 = vec3_dot(e1, e2), d22 = vec3_dot(e2, e2);
+            double d1 = vec3_dot(d, e1), d2 = vec3_dot(d, e2);
+            double denominator = d11*d22 - d12*d12;
+            double u = 0.0, v = 0.0;
+            if (is_positive_double(denominator)) {
+                u = clamp((d22*d1 - d12*d2) / denominator, 0.0, 1.0);
+                v = clamp((d11*d2 - d12*d1) / denominator, 0.0, 1.0 - u);
+            }
+            sample.weights[0] = 1.0 - u - v;
+            sample.weights[1] = u;
+            sample.weights[2] = v;
+        }
+    }
+
+    VtkSamplePointsSurfaceEffect::interpolate_sample_point_data(triangle_mesh, samples, point_cloud->GetPointData());
+}
@@ -24,18 +24,83 @@ THE SOFTWARE.
 #pragma once
 
 #include "VtkEffect.h"
+#include <vtkFloatArray.h>
+#include <vector>
+#include <cmath>
 
 class VtkSamplePointsVolumeEffect : public VtkEffect {
 private:
     const char *PARAM_NUMBER_OF_POINTS = "NumberOfPoints";
     const char *PARAM_DISTRIBUTE_UNIFORMLY = "DistributeUniformly";
     const char *PARAM_AUTO_SIMPLIFY = "AutoSimplify";
+    const char *PARAM_VOXEL_ACCELERATION = "VoxelAcceleration";
+    const char *PARAM_SAMPLING_MODE = "SamplingMode";
+    const char *PARAM_INTERPOLATE_POINT_DATA = "InterpolatePointData";
+    const char *PARAM_RANDOM_SEED = "RandomSeed";
+
+    const char *ATTRIBUTE_COLOR = "color0";
+    const char *ATTRIBUTE_UV = "uv0";
 
 public:
+    /* Coarse voxelization of a closed mesh. Boundary cells are those that may intersect the surface,
+     * other cells are entirely inside or outside of it.
+     * */
+    struct InsideGrid {
+        static constexpr char CELL_OUTSIDE = 0;
+        static constexpr char CELL_INSIDE = 1;
+        static constexpr char CELL_BOUNDARY = 2;
+
+        double origin[3];
+        double voxel_size;
+        int dims[3];
+        std::vector<char> cells; // x varies fastest
+        std::vector<char> center_inside; // cell center is inside (by parity, 0 for open scanlines)
+        std::vector<float> boundary_distance; // approximate distance to nearest boundary cell (chamfer)
+
+        int cell_index(const double p[3]) const {
+            int ijk[3];
+            for (int a = 0; a < 3; a++) {
+                ijk[a] = static_cast<int>(std::floor((p[a] - origin[a]) / voxel_size));
+                if (ijk[a] < 0 || ijk[a] >= dims[a]) return -1;
+            }
+            return ijk[0] + dims[0]*(ijk[1] + dims[1]*ijk[2]);
+        }
+    };
+
+    // voxels along longest side of the inside grid
+    static const int INSIDE_GRID_RESOLUTION = 64;
+    static const int STRATIFIED_GRID_RESOLUTION = 128;
+
+    static const int SAMPLING_MODE_REJECTION = 1;
+    static const int SAMPLING_MODE_STRATIFIED = 2;
+    static const int SAMPLING_MODE_POISSON_DISK = 3;
+
     const char* GetName() override;
     OfxStatus vtkDescribe(OfxParamSetHandle parameters, VtkEffectInputDef &input_mesh, VtkEffectInputDef &output_mesh) override;
     OfxStatus vtkCook(VtkEffectInput &main_input, VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs) override;
     static OfxStatus vtkCook_inner(vtkPolyData *input_polydata, vtkPolyData *output_polydata,
                                    int number_of_points, bool distribute_uniformly, bool auto_simplify,
-                                   bool _assume_input_polydata_triangles=false);
+                                   bool _assume_input_polydata_triangles=false, bool voxel_acceleration=true,
+                                   int sampling_mode=SAMPLING_MODE_REJECTION, int random_seed=0);
+
+    /* Voxelize mesh into grid covering bounds, with resolution voxels along the longest side.
+     * Cells touched by bounding box of some polygon are boundary; the rest is classified by parity
+     * of surface crossings along scanlines in X direction. Scanlines with odd number of crossings
+     * (open mesh) are marked as boundary altogether.
+     * */
+    static void build_inside_grid(vtkPolyData *mesh, const double bounds[6], int resolution, InsideGrid &grid);
+
+    /* Put number_of_points points into cells of the grid whose center is inside, with probability
+     * proportional to volume: each point takes one value of a 4-D sequence to pick the cell and place itself in it.
+     * There is no rejection, so this always gives all the points in one pass; the price is that
+     * the shape is only resolved up to grid resolution. Points and distance must have the right size already.
+     * Points are generated in parallel; for given seed, the result does not depend on number of threads.
+     * */
+    static void sample_inside_grid(const InsideGrid &grid, int number_of_points, bool distribute_uniformly,
+                                   vtkPoints *points, vtkFloatArray *distance_arr, int random_seed=0);
+
+    /* Give points of the point cloud point data of the nearest point on mesh surface
+     * (see VtkSamplePointsSurfaceEffect::interpolate_sample_point_data()).
+     * */
+    static void transfer_surface_point_data(vtkPolyData *mesh, vtkPolyData *point_cloud);
 };
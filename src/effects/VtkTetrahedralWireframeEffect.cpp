@@ -21,13 +21,15 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
-#include <vtkCleanPolyData.h>
+#include <vtkCellArray.h>
 #include <vtkDelaunay3D.h>
 #include <vtkExtractEdges.h>
+#include <vtkPoints.h>
 #include <vtkUnstructuredGrid.h>
 
 #include "VtkReduceEdgesEffect.h"
 #include "VtkTetrahedralWireframeEffect.h"
+#include "mfx_vtk_utils.h"
 
 const char *VtkTetrahedralWireframeEffect::GetName() {
     return "Tetrahedral wireframe";
@@ -36,16 +38,87 @@ const char *VtkTetrahedralWireframeEffect::GetName() {
 OfxStatus VtkTetrahedralWireframeEffect::vtkDescribe(OfxParamSetHandle parameters, VtkEffectInputDef &input_mesh,
                                                      VtkEffectInputDef &output_mesh) {
     AddParam(PARAM_MAXIMUM_EDGE_LENGTH, 1.0).Range(0, 1e6).Label("Maximum edge length");
+    AddParam(PARAM_BACKEND, BACKEND_VTK).Range(1, 2).Label("Backend"); // TODO make this enum!
     return kOfxStatOK;
 }
 
 OfxStatus VtkTetrahedralWireframeEffect::vtkCook(VtkEffectInput &main_input, VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs) {
     auto maximum_edge_length = GetParam<double>(PARAM_MAXIMUM_EDGE_LENGTH).GetValue();
-    return vtkCook_inner(main_input.data, main_output.data, maximum_edge_length);
+    auto backend = GetParam<int>(PARAM_BACKEND).GetValue();
+
+    // XXX until we have enums...
+    backend = clamp(backend, BACKEND_VTK, BACKEND_NATIVE);
+
+    return vtkCook_inner(main_input.data, main_output.data, maximum_edge_length, backend);
 }
 
 OfxStatus VtkTetrahedralWireframeEffect::vtkCook_inner(vtkPolyData *input_polydata, vtkPolyData *output_polydata,
-                                                       double maximum_edge_length) {
+                                                       double maximum_edge_length, int backend) {
+    if (backend == BACKEND_NATIVE) {
+        auto input_points = input_polydata->GetPoints();
+        int point_count = input_polydata->GetNumberOfPoints();
+        std::vector<int> edges;
+
+        if (point_count > 0) {
+            int skipped_count = delaunay_edges(input_points, maximum_edge_length, edges);
+            if (skipped_count > 0) {
+                printf("VtkTetrahedralWireframeEffect - %d points coincide or are coplanar, these have no edges\n",
+                       skipped_count);
+            }
+        }
+
+        // mark used points, then scan + scatter them
+        int edge_count = edges.size() / 2;
+        std::vector<int> point_index(point_count, 0);
+
+        #pragma omp parallel for schedule(static, 1000) if (edge_count > 5000)
+        for (int k = 0; k < 2*edge_count; k++) {
+            #pragma omp atomic write
+            point_index[edges[k]] = 1;
+        }
+
+        int output_point_count = exclusive_scan(point_index.data(), point_index.data(), point_count);
+
+        auto output_points = vtkSmartPointer<vtkPoints>::New();
+        output_points->SetDataType(input_points ? input_points->GetDataType() : VTK_FLOAT);
+        output_points->SetNumberOfPoints(output_point_count);
+
+        #pragma omp parallel for schedule(static, 1000) if (point_count > 5000)
+        for (int p = 0; p < point_count; p++) {
+            bool used = (p+1 < point_count) ? (point_index[p+1] != point_index[p]) : (point_index[p] < output_point_count);
+            if (used) {
+                double x[3];
+                input_points->GetPoint(p, x);
+                output_points->SetPoint(point_index[p], x);
+            }
+        }
+
+        auto output_offsets = vtkSmartPointer<vtkTypeInt32Array>::New();
+        auto output_connectivity = vtkSmartPointer<vtkTypeInt32Array>::New();
+        output_offsets->SetNumberOfValues(edge_count + 1);
+        output_connectivity->SetNumberOfValues(2*edge_count);
+        int *offsets = output_offsets->GetPointer(0);
+        int *connectivity = output_connectivity->GetPointer(0);
+
+        #pragma omp parallel for schedule(static, 1000) if (edge_count > 5000)
+        for (int k = 0; k <= edge_count; k++) {
+            offsets[k] = 2*k;
+            if (k < edge_count) {
+                connectivity[2*k] = point_index[edges[2*k]];
+                connectivity[2*k + 1] = point_index[edges[2*k + 1]];
+            }
+        }
+
+        auto output_lines = vtkSmartPointer<vtkCellArray>::New();
+        output_lines->SetData(output_offsets, output_connectivity);
+
+        auto temp_polydata = vtkSmartPointer<vtkPolyData>::New();
+        temp_polydata->SetPoints(output_points);
+        temp_polydata->SetLines(output_lines);
+        output_polydata->ShallowCopy(temp_polydata);
+        return kOfxStatOK;
+    }
+
     auto delaunay3d_filter = vtkSmartPointer<vtkDelaunay3D>::New();
     delaunay3d_filter->SetInputData(input_polydata);
     delaunay3d_filter->SetAlpha(0);
@@ -59,3 +132,620 @@ OfxStatus VtkTetrahedralWireframeEffect::vtkCook_inner(vtkPolyData *input_polyda
 
     return VtkReduceEdgesEffect::vtkCook_inner(raw_edge_polydata, output_polydata, maximum_edge_length);
 }
+
+// ---------------------------------------------------------------------------------------------------------------------
+// Native Delaunay tetrahedralization
+//
+// Coordinates are snapped to integer grid of 2^DELAUNAY_GRID_BITS steps (same scale for all axes, which keeps
+// the Delaunay property), so that the predicates can be evaluated exactly: orient3d fits into 64 bits,
+// insphere needs 128 bits for the last step. With exact predicates, the cavity of all tetrahedra whose
+// circumsphere contains the new point strictly is always star-shaped, even for cospherical points.
+
+static const int DELAUNAY_GRID_BITS = 20;
+
+/* Minimal two's complement 128-bit integer, just enough to sum the terms of insphere determinant.
+ * */
+struct Int128 {
+    uint64_t lo;
+    uint64_t hi;
+
+    static Int128 product(int64_t a, int64_t b) {
+        bool negative = (a < 0) != (b < 0);
+        uint64_t ua = (a < 0) ? 0 - static_cast<uint64_t>(a) : static_cast<uint64_t>(a);
+        uint64_t ub = (b < 0) ? 0 - static_cast<uint64_t>(b) : static_cast<uint64_t>(b);
+
+        uint64_t a_lo = ua & 0xffffffffu, a_hi = ua >> 32;
+        uint64_t b_lo = ub & 0xffffffffu, b_hi = ub >> 32;
+        uint64_t p0 = a_lo * b_lo, p1 = a_lo * b_hi, p2 = a_hi * b_lo, p3 = a_hi * b_hi;
+        uint64_t middle = (p0 >> 32) + (p1 & 0xffffffffu) + (p2 & 0xffffffffu);
+
+        Int128 result;
+        result.lo = (p0 & 0xffffffffu) | (middle << 32);
+        result.hi = p3 + (p1 >> 32) + (p2 >> 32) + (middle >> 32);
+        return negative ? result.negated() : result;
+    }
+
+    Int128 negated() const {
+        Int128 result;
+        result.lo = ~lo + 1;
+        result.hi = ~hi + (result.lo == 0 ? 1 : 0);
+        return result;
+    }
+
+    Int128 operator+(const Int128 &other) const {
+        Int128 result;
+        result.lo = lo + other.lo;
+        result.hi = hi + other.hi + (result.lo < lo ? 1 : 0);
+        return result;
+    }
+
+    Int128 operator-(const Int128 &other) const {
+        return *this + other.negated();
+    }
+
+    int sign() const {
+        if (hi >> 63) return -1;
+        return (hi != 0 || lo != 0) ? 1 : 0;
+    }
+};
+
+// positive if d is below plane of counterclockwise abc [Shewchuk, Robust Adaptive Floating-Point Geometric Predicates]
+static inline int orient3d_exact(const int64_t a[3], const int64_t b[3], const int64_t c[3], const int64_t d[3]) {
+    int64_t adx = a[0] - d[0], ady = a[1] - d[1], adz = a[2] - d[2];
+    int64_t bdx = b[0] - d[0], bdy = b[1] - d[1], bdz = b[2] - d[2];
+    int64_t cdx = c[0] - d[0], cdy = c[1] - d[1], cdz = c[2] - d[2];
+
+    // each 2x2 minor is below 2^41, the sum below 3 * 2^61
+    int64_t det = adx * (bdy*cdz - bdz*cdy) + bdx * (cdy*adz - cdz*ady) + cdx * (ady*bdz - adz*bdy);
+    return (det > 0) - (det < 0);
+}
+
+// positive if e is inside sphere through a, b, c, d (given orient3d_exact(a, b, c, d) > 0)
+static inline int insphere_exact(const int64_t a[3], const int64_t b[3], const int64_t c[3], const int64_t d[3],
+                                 const int64_t e[3]) {
+    int64_t aex = a[0] - e[0], aey = a[1] - e[1], aez = a[2] - e[2];
+    int64_t bex = b[0] - e[0], bey = b[1] - e[1], bez = b[2] - e[2];
+    int64_t cex = c[0] - e[0], cey = c[1] - e[1], cez = c[2] - e[2];
+    int64_t dex = d[0] - e[0], dey = d[1] - e[1], dez = d[2] - e[2];
+
+    int64_t ab = aex*bey - bex*aey;
+    int64_t bc = bex*cey - cex*bey;
+    int64_t cd = cex*dey - dex*cey;
+    int64_t da = dex*aey - aex*dey;
+    int64_t ac = aex*cey - cex*aey;
+    int64_t bd = bex*dey - dex*bey;
+
+    int64_t abc = aez*bc - bez*ac + cez*ab;
+    int64_t bcd = bez*cd - cez*bd + dez*bc;
+    int64_t cda = cez*da + dez*ac + aez*cd;
+    int64_t dab = dez*ab + aez*bd + bez*da;
+
+    int64_t alift = aex*aex + aey*aey + aez*aez;
+    int64_t blift = bex*bex + bey*bey + bez*bez;
+    int64_t clift = cex*cex + cey*cey + cez*cez;
+    int64_t dlift = dex*dex + dey*dey + dez*dez;
+
+    // the products do not fit into 64 bits; decide in floating point unless the result is too close to zero
+    double t0 = static_cast<double>(dlift) * static_cast<double>(abc);
+    double t1 = static_cast<double>(clift) * static_cast<double>(dab);
+    double t2 = static_cast<double>(blift) * static_cast<double>(cda);
+    double t3 = static_cast<double>(alift) * static_cast<double>(bcd);
+    double approximate_det = (t0 - t1) + (t2 - t3);
+    double error_bound = (std::abs(t0) + std::abs(t1) + std::abs(t2) + std::abs(t3)) * (8 * DBL_EPSILON);
+    if (approximate_det > error_bound) return 1;
+    if (approximate_det < -error_bound) return -1;
+
+    Int128 det = (Int128::product(dlift, abc) - Int128::product(clift, dab)) +
+                 (Int128::product(blift, cda) - Int128::product(alift, bcd));
+    return det.sign();
+}
+
+/* Tetrahedralization of the whole space: convex hull faces are connected to an infinite vertex,
+ * so that every tetrahedron has four neighbors. Tetrahedra are positively oriented and face i
+ * (the one opposite to vertex i) is made of vertices FACE_VERTICES[i], ordered so that vertex i
+ * is on its positive side.
+ * */
+class DelaunayTetrahedralization {
+public:
+    static const int INFINITE_VERTEX = -1;
+    static const int DEAD_TETRAHEDRON = -2;
+
+    std::vector<int> tetrahedra; // 8 per tetrahedron: 4 vertices, then 4 neighbors (neighbor i is across face i)
+
+    explicit DelaunayTetrahedralization(const std::vector<int64_t> &coords) : coords(coords) {}
+
+    // insert points in order of their IDs, returns number of points that could not be inserted
+    int Build() {
+        int count = coords.size() / 3;
+        if (count < 4) {
+            return count;
+        }
+
+        // first tetrahedron from points in general position
+        int first[4] = {0, -1, -1, -1};
+        int found = 1;
+        for (int p = 1; p < count && found < 4; p++) {
+            if (found == 1 && !SamePosition(first[0], p)) {
+                first[found++] = p;
+            } else if (found == 2 && !Collinear(first[0], first[1], p)) {
+                first[found++] = p;
+            } else if (found == 3 && Orient(first[0], first[1], first[2], p) != 0) {
+                first[found++] = p;
+            }
+        }
+        if (found < 4) {
+            return count;
+        }
+        CreateFirstTetrahedron(first);
+
+        int skipped_count = 0;
+        for (int p = 0; p < count; p++) {
+            if (p != first[0] && p != first[1] && p != first[2] && p != first[3] && !Insert(p)) {
+                skipped_count++;
+            }
+        }
+        return skipped_count;
+    }
+
+    int *Vertices(int t) {
+        return &tetrahedra[8*t];
+    }
+
+    const int *Vertices(int t) const {
+        return &tetrahedra[8*t];
+    }
+
+    int *Neighbors(int t) {
+        return &tetrahedra[8*t + 4];
+    }
+
+    const int *Neighbors(int t) const {
+        return &tetrahedra[8*t + 4];
+    }
+
+    int GetNumberOfTetrahedra() const {
+        return tetrahedra.size() / 8;
+    }
+
+    /* Whether tetrahedron t is the one with the lowest ID among those around its edge (i, j),
+     * ie. the one that should emit the edge.
+     * */
+    bool IsEdgeOwner(int t, int i, int j) const {
+        int u = Vertices(t)[i], v = Vertices(t)[j];
+        int k = 0;
+        while (k == i || k == j) k++;
+
+        int previous = t;
+        int current = Neighbors(t)[k];
+        while (current != t) {
+            if (current < t) {
+                return false;
+            }
+            // of the two faces of current containing the edge, leave through the one we did not come from
+            const int *w = Vertices(current);
+            int next = -1;
+            for (int l = 0; l < 4; l++) {
+                if (w[l] != u && w[l] != v && Neighbors(current)[l] != previous) {
+                    next = Neighbors(current)[l];
+                    break;
+                }
+            }
+            previous = current;
+            current = next;
+        }
+        return true;
+    }
+
+protected:
+    static constexpr int FACE_VERTICES[4][3] = {{1, 3, 2}, {0, 2, 3}, {0, 3, 1}, {0, 1, 2}};
+
+    struct CavityFace {
+        int face_vertices[3];
+        int outer_tetrahedron;
+        int outer_slot; // index into neighbors of outer_tetrahedron which points into the cavity
+    };
+
+    const std::vector<int64_t> &coords;
+    enum : uint8_t { NOT_TESTED = 0, IN_CAVITY = 1, NOT_IN_CAVITY = 2 };
+    std::vector<uint8_t> mark; // per tetrahedron, reset after each insertion
+    std::vector<int> free_tetrahedra;
+    int last_tetrahedron = 0;
+    uint32_t walk_random_state = 1;
+
+    std::vector<int> stack, cavity;
+    std::vector<CavityFace> cavity_faces;
+    std::vector<std::pair<uint64_t, int>> face_table; // open addressing, matches new faces by their edge
+    std::vector<int> face_table_used;
+
+    const int64_t *P(int p) const {
+        return &coords[3*p];
+    }
+
+    bool SamePosition(int a, int b) const {
+        return P(a)[0] == P(b)[0] && P(a)[1] == P(b)[1] && P(a)[2] == P(b)[2];
+    }
+
+    bool Collinear(int a, int b, int c) const {
+        const int64_t *pa = P(a), *pb = P(b), *pc = P(c);
+        int64_t u[3] = {pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2]};
+        int64_t v[3] = {pc[0] - pa[0], pc[1] - pa[1], pc[2] - pa[2]};
+        return u[1]*v[2] == u[2]*v[1] && u[2]*v[0] == u[0]*v[2] && u[0]*v[1] == u[1]*v[0];
+    }
+
+    int Orient(int a, int b, int c, int d) const {
+        return orient3d_exact(P(a), P(b), P(c), P(d));
+    }
+
+    // orientation of point p with respect to face i of tetrahedron t (positive on the side of vertex i)
+    int OrientFace(int t, int i, int p) const {
+        const int *v = Vertices(t);
+        const int *f = FACE_VERTICES[i];
+        return Orient(v[f[0]], v[f[1]], v[f[2]], p);
+    }
+
+    int FindInfiniteVertex(int t) const {
+        for (int i = 0; i < 4; i++) {
+            if (Vertices(t)[i] == INFINITE_VERTEX) return i;
+        }
+        return -1;
+    }
+
+    bool InConflict(int t, int p) const {
+        int i = FindInfiniteVertex(t);
+        if (i < 0) {
+            const int *v = Vertices(t);
+            return insphere_exact(P(v[0]), P(v[1]), P(v[2]), P(v[3]), P(p)) > 0;
+        }
+
+        // outside of the hull face, or in its plane and inside its circumcircle
+        // (which is the same as being inside circumsphere of the finite tetrahedron behind the face)
+        int orientation = OrientFace(t, i, p);
+        if (orientation != 0) {
+            return orientation > 0;
+        }
+        const int *w = Vertices(Neighbors(t)[i]);
+        return insphere_exact(P(w[0]), P(w[1]), P(w[2]), P(w[3]), P(p)) > 0;
+    }
+
+    int AllocateTetrahedron() {
+        if (!free_tetrahedra.empty()) {
+            int t = free_tetrahedra.back();
+            free_tetrahedra.pop_back();
+            return t;
+        }
+        int t = GetNumberOfTetrahedra();
+        tetrahedra.resize(8*t + 8);
+        mark.push_back(NOT_TESTED);
+        return t;
+    }
+
+    void CreateFirstTetrahedron(int first[4]) {
+        if (Orient(first[0], first[1], first[2], first[3]) < 0) {
+            std::swap(first[0], first[1]);
+        }
+
+        int t0 = AllocateTetrahedron();
+        for (int i = 0; i < 4; i++) {
+            Vertices(t0)[i] = first[i];
+        }
+
+        // hull faces turned inside out, with the infinite vertex on the outer side
+        for (int i = 0; i < 4; i++) {
+            const int *f = FACE_VERTICES[i];
+            int t = AllocateTetrahedron();
+            Vertices(t)[0] = first[f[0]];
+            Vertices(t)[1] = first[f[2]];
+            Vertices(t)[2] = first[f[1]];
+            Vertices(t)[3] = INFINITE_VERTEX;
+        }
+
+        // connect tetrahedra sharing a face
+        for (int t = 0; t < 5; t++) {
+            for (int i = 0; i < 4; i++) {
+                for (int s = 0; s < 5; s++) {
+                    for (int j = 0; s != t && j < 4; j++) {
+                        if (SameFace(t, i, s, j)) {
+                            Neighbors(t)[i] = s;
+                        }
+                    }
+                }
+            }
+        }
+        last_tetrahedron = t0;
+    }
+
+    bool SameFace(int t, int i, int s, int j) const {
+        int a[3], b[3];
+        for (int k = 0; k < 3; k++) {
+            a[k] = Vertices(t)[FACE_VERTICES[i][k]];
+            b[k] = Vertices(s)[FACE_VERTICES[j][k]];
+        }
+        std::sort(a, a + 3);
+        std::sort(b, b + 3);
+        return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+    }
+
+    /* Walk towards point p, returns a tetrahedron whose circumsphere contains p,
+     * or -1 if p coincides with an existing vertex.
+     * */
+    int Locate(int p) {
+        int t = last_tetrahedron;
+        for (;;) {
+            int infinite_index = FindInfiniteVertex(t);
+            if (infinite_index >= 0) {
+                if (OrientFace(t, infinite_index, p) > 0) {
+                    return t; // outside of convex hull
+                }
+                t = Neighbors(t)[infinite_index];
+                continue;
+            }
+
+            // stochastic walk: start with random face to avoid cycles
+            walk_random_state ^= walk_random_state << 13;
+            walk_random_state ^= walk_random_state >> 17;
+            walk_random_state ^= walk_random_state << 5;
+            int start = walk_random_state & 3;
+
+            int next = -1;
+            for (int k = 0; k < 4; k++) {
+                int i = (start + k) & 3;
+                if (OrientFace(t, i, p) < 0) {
+                    next = Neighbors(t)[i];
+                    break;
+                }
+            }
+            if (next < 0) {
+                for (int i = 0; i < 4; i++) {
+                    if (SamePosition(Vertices(t)[i], p)) return -1;
+                }
+                return t;
+            }
+            t = next;
+        }
+    }
+
+    // tested tetrahedra are the cavity and its neighbors
+    void ResetMarks() {
+        for (int t : stack) {
+            mark[t] = NOT_TESTED;
+        }
+        for (int t : cavity) {
+            mark[t] = NOT_TESTED;
+        }
+        for (const CavityFace &cavity_face : cavity_faces) {
+            mark[cavity_face.outer_tetrahedron] = NOT_TESTED;
+        }
+    }
+
+    bool Insert(int p) {
+        int start = Locate(p);
+        if (start < 0) {
+            return false;
+        }
+
+        // flood fill tetrahedra in conflict with p
+        stack.clear();
+        cavity.clear();
+        cavity_faces.clear();
+        mark[start] = IN_CAVITY;
+        stack.push_back(start);
+
+        while (!stack.empty()) {
+            int t = stack.back();
+            stack.pop_back();
+            cavity.push_back(t);
+
+            for (int i = 0; i < 4; i++) {
+                int s = Neighbors(t)[i];
+                if (mark[s] == IN_CAVITY) {
+                    continue;
+                }
+                if (mark[s] != NOT_IN_CAVITY) {
+                    if (InConflict(s, p)) {
+                        mark[s] = IN_CAVITY;
+                        stack.push_back(s);
+                        continue;
+                    }
+                    mark[s] = NOT_IN_CAVITY;
+                }
+
+                CavityFace cavity_face;
+                bool finite = true;
+                for (int k = 0; k < 3; k++) {
+                    cavity_face.face_vertices[k] = Vertices(t)[FACE_VERTICES[i][k]];
+                    finite = finite && (cavity_face.face_vertices[k] != INFINITE_VERTEX);
+                }
+                cavity_face.outer_tetrahedron = s;
+                cavity_face.outer_slot = 0;
+                while (Neighbors(s)[cavity_face.outer_slot] != t) cavity_face.outer_slot++;
+
+                cavity_faces.push_back(cavity_face);
+
+                // cannot happen with exact predicates, but better leave the point out than corrupt the mesh
+                if (finite && OrientFace(t, i, p) <= 0) {
+                    ResetMarks();
+                    return false;
+                }
+            }
+        }
+
+        // replace cavity with tetrahedra connecting its boundary faces to p
+        int cavity_face_count = cavity_faces.size();
+        size_t table_size = 64;
+        while (table_size < 6 * static_cast<size_t>(cavity_face_count)) table_size *= 2;
+        if (face_table.size() < table_size) {
+            face_table.assign(table_size, {0, -1});
+        }
+        const size_t table_mask = table_size - 1;
+        face_table_used.clear();
+
+        for (int k = 0; k < cavity_face_count; k++) {
+            const CavityFace &cavity_face = cavity_faces[k];
+            int t = (k < static_cast<int>(cavity.size())) ? cavity[k] : AllocateTetrahedron();
+            const int *f = cavity_face.face_vertices;
+
+            Vertices(t)[0] = f[0];
+            Vertices(t)[1] = f[1];
+            Vertices(t)[2] = f[2];
+            Vertices(t)[3] = p;
+            Neighbors(t)[3] = cavity_face.outer_tetrahedron;
+            Neighbors(cavity_face.outer_tetrahedron)[cavity_face.outer_slot] = t;
+
+            // face i of the new tetrahedron is shared with another new one, identified by the edge other than p
+            for (int i = 0; i < 3; i++) {
+                uint32_t u = static_cast<uint32_t>(f[(i+1) % 3]), v = static_cast<uint32_t>(f[(i+2) % 3]);
+                uint64_t key = (static_cast<uint64_t>(std::min(u, v)) << 32) | std::max(u, v);
+                size_t slot = static_cast<size_t>((key * 0x9e3779b97f4a7c15ull) >> 40) & table_mask;
+                while (face_table[slot].second >= 0 && face_table[slot].first != key) {
+                    slot = (slot + 1) & table_mask;
+                }
+                if (face_table[slot].second >= 0) {
+                    int other = face_table[slot].second;
+                    Neighbors(t)[i] = other / 4;
+                    Neighbors(other / 4)[other % 4] = t;
+                } else {
+                    face_table[slot] = {key, 4*t + i};
+                    face_table_used.push_back(slot);
+                }
+            }
+        }
+        ResetMarks();
+
+        for (int slot : face_table_used) {
+            face_table[slot].second = -1;
+        }
+
+        for (int k = cavity_face_count; k < static_cast<int>(cavity.size()); k++) {
+            Vertices(cavity[k])[0] = DEAD_TETRAHEDRON;
+            free_tetrahedra.push_back(cavity[k]);
+        }
+
+        last_tetrahedron = cavity.empty() ? last_tetrahedron : cavity[0];
+        return true;
+    }
+};
+
+int VtkTetrahedralWireframeEffect::delaunay_edges(vtkPoints *points, double maximum_edge_length,
+                                                  std::vector<int> &edges) {
+    edges.clear();
+    int point_count = points->GetNumberOfPoints();
+    double bounds[6];
+    points->GetBounds(bounds);
+    double extent = std::max(bounds[1] - bounds[0], std::max(bounds[3] - bounds[2], bounds[5] - bounds[4]));
+    if (point_count < 4 || !(extent > 0)) {
+        return point_count;
+    }
+
+    // snap to grid
+    const int64_t grid_max = (int64_t(1) << DELAUNAY_GRID_BITS) - 1;
+    const double scale = grid_max / extent;
+    std::vector<int64_t> coords(3*point_count);
+
+    #pragma omp parallel for schedule(static, 1000) if (point_count > 5000)
+    for (int p = 0; p < point_count; p++) {
+        double x[3];
+        points->GetPoint(p, x);
+        for (int a = 0; a < 3; a++) {
+            coords[3*p + a] = clamp(static_cast<int64_t>(std::llround((x[a] - bounds[2*a]) * scale)), int64_t(0), grid_max);
+        }
+    }
+
+    // biased randomized insertion order [Amenta et al. 2003, Incremental Constructions con BRIO]:
+    // each point goes into round k with probability 2^-(k+1), going from the last round to the first,
+    // and points are sorted along Morton curve within the round, so that consecutive points are close
+    const int MAX_ROUND = 20;
+    const int MORTON_BITS = 16;
+    std::vector<uint64_t> keys(point_count);
+    std::vector<int> order(point_count);
+    const auto random_generator = PcgRandom();
+    const int random_block_size = 1000;
+    int num_random_blocks = (point_count + random_block_size - 1) / random_block_size;
+
+    #pragma omp parallel for schedule(static, 1) if (point_count > 5000)
+    for (int b = 0; b < num_random_blocks; b++) {
+        auto block_random_generator = random_generator;
+        block_random_generator.Advance(static_cast<uint64_t>(b) * random_block_size);
+
+        for (int p = b*random_block_size; p < std::min(point_count, (b+1)*random_block_size); p++) {
+            uint32_t random_bits = block_random_generator.NextUInt();
+            int round = 0;
+            while (round < MAX_ROUND && (random_bits & (1u << round)) == 0) round++;
+
+            uint64_t morton = 0;
+            for (int bit = 0; bit < MORTON_BITS; bit++) {
+                for (int a = 0; a < 3; a++) {
+                    uint64_t bit_value = (coords[3*p + a] >> (DELAUNAY_GRID_BITS - MORTON_BITS + bit)) & 1;
+                    morton |= bit_value << (3*bit + a);
+                }
+            }
+            keys[p] = (static_cast<uint64_t>(MAX_ROUND - round) << (3*MORTON_BITS)) | morton;
+            order[p] = p;
+        }
+    }
+
+    radix_sort(keys, order, 3*MORTON_BITS + 5);
+    std::vector<uint64_t>().swap(keys);
+
+    // renumber points in order of insertion, for memory locality
+    std::vector<int64_t> sorted_coords(3*point_count);
+
+    #pragma omp parallel for schedule(static, 1000) if (point_count > 5000)
+    for (int k = 0; k < point_count; k++) {
+        for (int a = 0; a < 3; a++) {
+            sorted_coords[3*k + a] = coords[3*order[k] + a];
+        }
+    }
+    std::vector<int64_t>().swap(coords);
+
+    DelaunayTetrahedralization tetrahedralization(sorted_coords);
+    int skipped_count = tetrahedralization.Build();
+
+    // emit edges that are short enough from the tetrahedron with lowest ID around them: count + scan + write
+    const int tetrahedron_count = tetrahedralization.GetNumberOfTetrahedra();
+    const int EDGE_VERTICES[6][2] = {{0, 1}, {0, 2}, {0, 3}, {1, 2}, {1, 3}, {2, 3}};
+    const double maximum_edge_length_sq = maximum_edge_length*maximum_edge_length;
+    std::vector<uint8_t> edge_mask(tetrahedron_count);
+    std::vector<int> edge_offsets(tetrahedron_count);
+
+    #pragma omp parallel for schedule(static, 1000) if (tetrahedron_count > 5000)
+    for (int t = 0; t < tetrahedron_count; t++) {
+        const int *v = tetrahedralization.Vertices(t);
+        int mask = 0, count = 0;
+        if (v[0] != DelaunayTetrahedralization::DEAD_TETRAHEDRON) {
+            for (int e = 0; e < 6; e++) {
+                int u = v[EDGE_VERTICES[e][0]], w = v[EDGE_VERTICES[e][1]];
+                if (u < 0 || w < 0) continue;
+                u = order[u];
+                w = order[w];
+
+                double a[3], b[3];
+                points->GetPoint(u, a);
+                points->GetPoint(w, b);
+                if (vec3_squared_distance(a, b) < maximum_edge_length_sq &&
+                    tetrahedralization.IsEdgeOwner(t, EDGE_VERTICES[e][0], EDGE_VERTICES[e][1])) {
+                    mask |= 1 << e;
+                    count++;
+                }
+            }
+        }
+        edge_mask[t] = mask;
+        edge_offsets[t] = count;
+    }
+
+    int edge_count = exclusive_scan(edge_offsets.data(), edge_offsets.data(), tetrahedron_count);
+    edges.resize(2*edge_count);
+
+    #pragma omp parallel for schedule(static, 1000) if (tetrahedron_count > 5000)
+    for (int t = 0; t < tetrahedron_count; t++) {
+        int k = edge_offsets[t];
+        for (int e = 0; e < 6; e++) {
+            if (edge_mask[t] & (1 << e)) {
+                edges[2*k] = order[tetrahedralization.Vertices(t)[EDGE_VERTICES[e][0]]];
+                edges[2*k + 1] = order[tetrahedralization.Vertices(t)[EDGE_VERTICES[e][1]]];
+                k++;
+            }
+        }
+    }
+
+    return skipped_count;
+}
@@ -24,15 +24,27 @@ THE SOFTWARE.
 #pragma once
 
 #include "VtkEffect.h"
+#include <vector>
 
 class VtkTetrahedralWireframeEffect : public VtkEffect {
 private:
     const char *PARAM_MAXIMUM_EDGE_LENGTH = "MaximumEdgeLength";
+    const char *PARAM_BACKEND = "Backend";
 
 public:
+    static const int BACKEND_VTK = 1;
+    static const int BACKEND_NATIVE = 2;
+
     const char* GetName() override;
     OfxStatus vtkDescribe(OfxParamSetHandle parameters, VtkEffectInputDef &input_mesh, VtkEffectInputDef &output_mesh) override;
     OfxStatus vtkCook(VtkEffectInput &main_input, VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs) override;
     static OfxStatus vtkCook_inner(vtkPolyData *input_polydata, vtkPolyData *output_polydata,
-                                   double maximum_length);
+                                   double maximum_length, int backend=BACKEND_VTK);
+
+    /* Edges of 3D Delaunay tetrahedralization of the points that are shorter than maximum_edge_length,
+     * as pairs of point IDs, each edge once. Points are inserted incrementally (Bowyer-Watson) in biased
+     * randomized order with exact predicates on coordinates snapped to a 2^20 grid; returns number of points
+     * that were left out (coincident after snapping, or all points coplanar).
+     * */
+    static int delaunay_edges(vtkPoints *points, double maximum_edge_length, std::vector<int> &edges);
 };
@@ -0,0 +1,251 @@
+/*
+MfxVTK Open Mesh Effect plug-in
+Copyright (c) 2020 Tomas Karabela
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <vtkPointData.h>
+#include <vtkFloatArray.h>
+#include <vtkDoubleArray.h>
+#include <vtkIntArray.h>
+#include <vtkUnsignedCharArray.h>
+#include <type_traits>
+#include <cstring>
+
+#include "mfx_vtk_utils.h"
+#include "VtkVoxelDownsampleEffect.h"
+
+const char *VtkVoxelDownsampleEffect::GetName() {
+    return "Voxel downsample";
+}
+
+OfxStatus
+VtkVoxelDownsampleEffect::vtkDescribe(OfxParamSetHandle parameters, VtkEffectInputDef &input_mesh, VtkEffectInputDef &output_mesh) {
+    AddParam(PARAM_VOXEL_SIZE, 0.1).Range(0, 1e6).Label("Voxel size");
+    AddParam(PARAM_REPRESENTATIVE, REPRESENTATIVE_CENTROID).Range(1, 3).Label("Representative point"); // TODO make this enum!
+    AddParam(PARAM_RANDOM_SEED, 0).Range(0, 1000000).Label("Random seed");
+    input_mesh.RequestPointAttribute(ATTRIBUTE_COLOR, 3, MfxAttributeType::UByte, MfxAttributeSemantic::Color, false);
+    input_mesh.RequestPointAttribute(ATTRIBUTE_NORMAL, 3, MfxAttributeType::Float, MfxAttributeSemantic::Normal, false);
+    return kOfxStatOK;
+}
+
+bool VtkVoxelDownsampleEffect::vtkIsIdentity(OfxParamSetHandle parameters) {
+    double voxel_size = GetParam<double>(PARAM_VOXEL_SIZE).GetValue();
+    return !is_positive_double(voxel_size);
+}
+
+OfxStatus VtkVoxelDownsampleEffect::vtkCook(VtkEffectInput &main_input, VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs) {
+    auto voxel_size = GetParam<double>(PARAM_VOXEL_SIZE).GetValue();
+    auto representative = GetParam<int>(PARAM_REPRESENTATIVE).GetValue();
+    auto random_seed = GetParam<int>(PARAM_RANDOM_SEED).GetValue();
+
+    // XXX until we have enums...
+    representative = clamp(representative, REPRESENTATIVE_CENTROID, REPRESENTATIVE_RANDOM);
+
+    return vtkCook_inner(main_input.data, main_output.data, voxel_size, representative, random_seed);
+}
+
+OfxStatus
+VtkVoxelDownsampleEffect::vtkCook_inner(vtkPolyData *input_polydata, vtkPolyData *output_polydata, double voxel_size,
+                                        int representative, int random_seed) {
+    int num_points = input_polydata->GetNumberOfPoints();
+    if (num_points == 0 || !is_positive_double(voxel_size)) {
+        output_polydata->ShallowCopy(input_polydata);
+        return kOfxStatOK;
+    }
+
+    double bounds[6];
+    input_polydata->GetBounds(bounds);
+
+    // voxel grid, coarsened if it would not fit into 62-bit keys
+    auto grid_dimension = [&](int a) -> double {
+        return std::floor((bounds[2*a + 1] - bounds[2*a]) / voxel_size) + 1;
+    };
+    if (std::log2(grid_dimension(0)) + std::log2(grid_dimension(1)) + std::log2(grid_dimension(2)) > 62) {
+        while (std::log2(grid_dimension(0)) + std::log2(grid_dimension(1)) + std::log2(grid_dimension(2)) > 62) {
+            voxel_size *= 2;
+        }
+        printf("VtkVoxelDownsampleEffect - warning, too many voxels, increasing voxel size to %g\n", voxel_size);
+    }
+    int64_t dims[3];
+    for (int a = 0; a < 3; a++) {
+        dims[a] = static_cast<int64_t>(grid_dimension(a));
+    }
+    int key_bits = 1;
+    while (key_bits < 63 && (static_cast<uint64_t>(1) << key_bits) < static_cast<uint64_t>(dims[0] * dims[1] * dims[2])) {
+        key_bits++;
+    }
+
+    // sort points by voxel
+    auto input_points = input_polydata->GetPoints();
+    std::vector<uint64_t> keys(num_points);
+    std::vector<int> order(num_points);
+
+    #pragma omp parallel for schedule(static, 1000) if (num_points > 5000)
+    for (int i = 0; i < num_points; i++) {
+        double p[3];
+        input_points->GetPoint(i, p);
+        int64_t ijk[3];
+        for (int a = 0; a < 3; a++) {
+            ijk[a] = clamp<int64_t>(static_cast<int64_t>(std::floor((p[a] - bounds[2*a]) / voxel_size)), 0, dims[a] - 1);
+        }
+        keys[i] = static_cast<uint64_t>(ijk[0] + dims[0]*(ijk[1] + dims[1]*ijk[2]));
+        order[i] = i;
+    }
+
+    radix_sort(keys, order, key_bits); // stable, so points in each voxel stay ordered by ID
+
+    // voxels are runs of equal keys; flag-scan-scatter their starts
+    std::vector<int> voxel_index(num_points);
+    #pragma omp parallel for schedule(static, 1000) if (num_points > 5000)
+    for (int k = 0; k < num_points; k++) {
+        voxel_index[k] = (k == 0 || keys[k] != keys[k-1]) ? 1 : 0;
+    }
+    int num_voxels = exclusive_scan(voxel_index.data(), voxel_index.data(), num_points);
+
+    std::vector<int> voxel_offsets(num_voxels + 1);
+    #pragma omp parallel for schedule(static, 1000) if (num_points > 5000)
+    for (int k = 0; k < num_points; k++) {
+        if (k == 0 || keys[k] != keys[k-1]) {
+            voxel_offsets[voxel_index[k]] = k;
+        }
+    }
+    voxel_offsets[num_voxels] = num_points;
+
+    // pick representative (for centroid, all points of the voxel are averaged)
+    std::vector<int> representative_point(num_voxels);
+    if (representative != REPRESENTATIVE_CENTROID) {
+        #pragma omp parallel for schedule(static, 1000) if (num_voxels > 5000)
+        for (int v = 0; v < num_voxels; v++) {
+            int begin = voxel_offsets[v], count = voxel_offsets[v+1] - voxel_offsets[v];
+            int k = begin;
+            if (representative == REPRESENTATIVE_RANDOM) {
+                // one stream per voxel, so the choice does not depend on other voxels
+                PcgRandom random_generator(random_seed, keys[begin]);
+                k = begin + static_cast<int>(random_generator.NextUInt() % static_cast<uint32_t>(count));
+            }
+            representative_point[v] = order[k];
+        }
+    }
+
+    auto output_points = vtkSmartPointer<vtkPoints>::New();
+    output_points->SetDataTypeToFloat();
+    output_points->SetNumberOfPoints(num_voxels);
+    float *output_points_ptr = vtkFloatArray::SafeDownCast(output_points->GetData())->GetPointer(0);
+
+    #pragma omp parallel for schedule(static, 1000) if (num_voxels > 5000)
+    for (int v = 0; v < num_voxels; v++) {
+        double p[3] = {0, 0, 0};
+        if (representative == REPRESENTATIVE_CENTROID) {
+            for (int k = voxel_offsets[v]; k < voxel_offsets[v+1]; k++) {
+                double q[3];
+                input_points->GetPoint(order[k], q);
+                for (int a = 0; a < 3; a++) p[a] += q[a];
+            }
+            double weight = 1.0 / (voxel_offsets[v+1] - voxel_offsets[v]);
+            for (int a = 0; a < 3; a++) p[a] *= weight;
+        } else {
+            input_points->GetPoint(representative_point[v], p);
+        }
+        for (int a = 0; a < 3; a++) {
+            output_points_ptr[3*v + a] = p[a];
+        }
+    }
+
+    auto output = vtkSmartPointer<vtkPolyData>::New();
+    output->SetPoints(output_points);
+
+    // point data: averaged for centroid (except integer arrays, ie. labels, which take the first point),
+    // copied from representative point otherwise
+    auto reduce_array = [&](auto *arr_in, auto *arr_out) {
+        using T = typename std::remove_pointer_t<decltype(arr_in)>::ValueType;
+        int nc = arr_in->GetNumberOfComponents();
+        arr_out->SetName(arr_in->GetName());
+        arr_out->SetNumberOfComponents(nc);
+        arr_out->SetNumberOfTuples(num_voxels);
+        const T *src = arr_in->GetPointer(0);
+        T *dst = arr_out->GetPointer(0);
+
+        #pragma omp parallel for schedule(static, 1000) if (num_voxels > 5000)
+        for (int v = 0; v < num_voxels; v++) {
+            if (representative == REPRESENTATIVE_CENTROID && !std::is_same_v<T, int>) {
+                double weight = 1.0 / (voxel_offsets[v+1] - voxel_offsets[v]);
+                for (int c = 0; c < nc; c++) {
+                    double acc = 0.0;
+                    for (int k = voxel_offsets[v]; k < voxel_offsets[v+1]; k++) {
+                        acc += src[order[k]*nc + c];
+                    }
+                    if constexpr (std::is_same_v<T, unsigned char>) {
+                        dst[v*nc + c] = static_cast<T>(clamp(std::lround(acc * weight), 0L, 255L));
+                    } else {
+                        dst[v*nc + c] = static_cast<T>(acc * weight);
+                    }
+                }
+            } else {
+                int i = (representative == REPRESENTATIVE_CENTROID) ? order[voxel_offsets[v]] : representative_point[v];
+                for (int c = 0; c < nc; c++) {
+                    dst[v*nc + c] = src[i*nc + c];
+                }
+            }
+        }
+    };
+
+    auto input_point_data = input_polydata->GetPointData();
+    auto output_point_data = output->GetPointData();
+    for (int k = 0; k < input_point_data->GetNumberOfArrays(); k++) {
+        vtkDataArray *arr = input_point_data->GetArray(k);
+        if (!arr || arr->GetNumberOfTuples() != num_points || !arr->GetName()) continue;
+
+        if (auto arr_float = vtkFloatArray::SafeDownCast(arr)) {
+            auto arr_out = vtkSmartPointer<vtkFloatArray>::New();
+            reduce_array(arr_float, arr_out.Get());
+            if (representative == REPRESENTATIVE_CENTROID && strcmp(arr->GetName(), ATTRIBUTE_NORMAL) == 0 &&
+                arr->GetNumberOfComponents() == 3) {
+                // average of unit normals is shorter
+                float *n = arr_out->GetPointer(0);
+                #pragma omp parallel for schedule(static, 1000) if (num_voxels > 5000)
+                for (int v = 0; v < num_voxels; v++) {
+                    float length = std::sqrt(vec3_dot(&n[3*v], &n[3*v]));
+                    if (length > 0.0f) {
+                        for (int a = 0; a < 3; a++) n[3*v + a] /= length;
+                    }
+                }
+            }
+            output_point_data->AddArray(arr_out);
+        } else if (auto arr_double = vtkDoubleArray::SafeDownCast(arr)) {
+            auto arr_out = vtkSmartPointer<vtkDoubleArray>::New();
+            reduce_array(arr_double, arr_out.Get());
+            output_point_data->AddArray(arr_out);
+        } else if (auto arr_int = vtkIntArray::SafeDownCast(arr)) {
+            auto arr_out = vtkSmartPointer<vtkIntArray>::New();
+            reduce_array(arr_int, arr_out.Get());
+            output_point_data->AddArray(arr_out);
+        } else if (auto arr_uchar = vtkUnsignedCharArray::SafeDownCast(arr)) {
+            auto arr_out = vtkSmartPointer<vtkUnsignedCharArray>::New();
+            reduce_array(arr_uchar, arr_out.Get());
+            output_point_data->AddArray(arr_out);
+        }
+    }
+
+    printf("VtkVoxelDownsampleEffect - %d points, %d voxels\n", num_points, num_voxels);
+
+    output_polydata->ShallowCopy(output);
+    return kOfxStatOK;
+}
@@ -0,0 +1,53 @@
+/*
+MfxVTK Open Mesh Effect plug-in
+Copyright (c) 2020 Tomas Karabela
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "VtkEffect.h"
+
+class VtkVoxelDownsampleEffect : public VtkEffect {
+private:
+    const char *PARAM_VOXEL_SIZE = "VoxelSize";
+    const char *PARAM_REPRESENTATIVE = "Representative";
+    const char *PARAM_RANDOM_SEED = "RandomSeed";
+
+    const char *ATTRIBUTE_COLOR = "color0";
+    static constexpr const char *ATTRIBUTE_NORMAL = "normal0"; // averaged normals are normalized
+
+public:
+    static const int REPRESENTATIVE_CENTROID = 1;
+    static const int REPRESENTATIVE_FIRST = 2;
+    static const int REPRESENTATIVE_RANDOM = 3;
+
+    const char* GetName() override;
+    OfxStatus vtkDescribe(OfxParamSetHandle parameters, VtkEffectInputDef &input_mesh, VtkEffectInputDef &output_mesh) override;
+    bool vtkIsIdentity(OfxParamSetHandle parameters) override;
+    OfxStatus vtkCook(VtkEffectInput &main_input, VtkEffectInput &main_output, std::vector<VtkEffectInput> &extra_inputs) override;
+
+    /* Keep one point per voxel of given size: the centroid of points in the voxel (with point data averaged),
+     * the first of them (lowest ID) or a random one. Output is a point cloud with no cells.
+     * Points are bucketed by parallel radix sort of their voxel keys.
+     * */
+    static OfxStatus vtkCook_inner(vtkPolyData *input_polydata, vtkPolyData *output_polydata, double voxel_size,
+                                   int representative=REPRESENTATIVE_CENTROID, int random_seed=0);
+};
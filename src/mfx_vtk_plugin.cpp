@@ -33,6 +33,7 @@ THE SOFTWARE.
 #include "effects/VtkDistanceAlongSurfaceEffect.h"
 #include "effects/VtkPokeEffect.h"
 #include "effects/VtkFillHolesEffect.h"
+#include "effects/VtkVoxelDownsampleEffect.h"
 
 MfxRegister(
         VtkExtractEdgesEffect,
@@ -45,5 +46,6 @@ MfxRegister(
         VtkSmoothEffect,
         VtkDistanceAlongSurfaceEffect,
         VtkPokeEffect,
-        VtkFillHolesEffect
+        VtkFillHolesEffect,
+        VtkVoxelDownsampleEffect
 );
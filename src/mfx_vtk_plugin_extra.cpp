@@ -23,6 +23,10 @@ THE SOFTWARE.
 
 #include <vtkCellIterator.h>
 #include <vtkPointData.h>
+#include <vtkFloatArray.h>
+#include <vtkDoubleArray.h>
+#include <vtkIntArray.h>
+#include <vtkUnsignedCharArray.h>
 #include <vtkStaticCellLocator.h>
 #include <vtkPolyData.h>
 #include <vtkSmartPointer.h>
@@ -31,6 +35,7 @@ THE SOFTWARE.
 #include <vtkDecimatePro.h>
 #include <vtkQuadricClustering.h>
 #include <vtkMaskPoints.h>
+#include <vtkMath.h>
 #include <vtkStaticCellLinks.h>
 #include <vtkTransform.h>
 #include <vtkTransformPolyDataFilter.h>
@@ -51,7 +56,7 @@ private:
     const char *PARAM_RANDOM_MODE_TYPE = "RandomModeType";
     const char *PARAM_ON_RATIO = "OnRatio";
     const char *PARAM_MAXIMUM_NUMBER_OF_POINTS = "MaximumNumberOfPoints";
-    // const char *PARAM_RANDOM_SEED = "RandomSeed";
+    const char *PARAM_RANDOM_SEED = "RandomSeed";
 
 public:
     const char* GetName() override {
@@ -63,7 +68,7 @@ public:
         AddParam(PARAM_RANDOM_MODE_TYPE, 0).Range(0, 3).Label("Random distribution type"); // TODO replace this with enum
         AddParam(PARAM_ON_RATIO, 2).Label("Take every n-th point");
         AddParam(PARAM_MAXIMUM_NUMBER_OF_POINTS, 10000).Range(0, 10000000).Label("Maximum number of points");
-        // AddParam(PARAM_RANDOM_SEED, 1).Label("Random seed");
+        AddParam(PARAM_RANDOM_SEED, 1).Label("Random seed");
         return kOfxStatOK;
     }
 
@@ -72,11 +77,17 @@ public:
         auto random_mode_type = GetParam<int>(PARAM_RANDOM_MODE_TYPE).GetValue();
         auto on_ratio = GetParam<int>(PARAM_ON_RATIO).GetValue();
         auto maximum_number_of_points = GetParam<int>(PARAM_MAXIMUM_NUMBER_OF_POINTS).GetValue();
-        // auto random_seed = GetParam<int>(PARAM_RANDOM_SEED).GetValue();
+        auto random_seed = GetParam<int>(PARAM_RANDOM_SEED).GetValue();
 
         // FIXME until we have eunm, clamp the value manually
         random_mode_type = std::max(0, std::min(3, random_mode_type));
 
+        // spatially stratified types (2, 3) are left to VTK
+        if (!use_random_mode || random_mode_type <= 1) {
+            return mask_points_native(main_input.data, main_output.data, use_random_mode, random_mode_type, on_ratio,
+                                      maximum_number_of_points, random_seed);
+        }
+
         auto mask_points_filter = vtkSmartPointer<vtkMaskPoints>::New();
         mask_points_filter->SetInputData(main_input.data);
 
@@ -84,14 +95,161 @@ public:
         mask_points_filter->SetRandomModeType(random_mode_type);
         mask_points_filter->SetOnRatio(on_ratio);
         mask_points_filter->SetMaximumNumberOfPoints(maximum_number_of_points);
-        // mask_points_filter->SetRandomSeed(random_seed); // TODO does not exist?
 
+        // vtkMaskPoints has no seed of its own, it draws from the global vtkMath generator
+        vtkMath::RandomSeed(random_seed);
         mask_points_filter->Update();
 
         auto filter_output = mask_points_filter->GetOutput();
         main_output.data->ShallowCopy(filter_output);
         return kOfxStatOK;
     }
+
+    /* Same as vtkMaskPoints for point selection off (every n-th point) and random mode types 0 (each point
+     * kept with probability 1/on_ratio) and 1 (exactly N/on_ratio points picked at random), but parallel:
+     * points are flagged, the flags are scanned and kept points (with their point data) are scattered
+     * into a point cloud with no cells.
+     * Random decisions are made per point from a seeded stream, so they do not depend on number of threads.
+     * */
+    static OfxStatus mask_points_native(vtkPolyData *input_polydata, vtkPolyData *output_polydata, bool use_random_mode,
+                                        int random_mode_type, int on_ratio, int maximum_number_of_points,
+                                        int random_seed) {
+        int num_points = input_polydata->GetNumberOfPoints();
+        on_ratio = std::max(1, on_ratio);
+        maximum_number_of_points = std::max(0, maximum_number_of_points);
+
+        std::vector<int> keep(num_points);
+
+        if (!use_random_mode) {
+            #pragma omp parallel for schedule(static, 1000) if (num_points > 5000)
+            for (int i = 0; i < num_points; i++) {
+                keep[i] = (i % on_ratio == 0) ? 1 : 0;
+            }
+        } else {
+            // point i takes value i of the random stream; blocks of points jump ahead to their place in it
+            const auto random_generator = PcgRandom(random_seed);
+            const int random_block_size = 1000;
+            int num_random_blocks = (num_points + random_block_size - 1) / random_block_size;
+            std::vector<uint32_t> random_keys(num_points);
+
+            #pragma omp parallel for schedule(static, 1) if (num_points > 5000)
+            for (int b = 0; b < num_random_blocks; b++) {
+                auto block_random_generator = random_generator;
+                block_random_generator.Advance(static_cast<uint64_t>(b) * random_block_size);
+                for (int i = b*random_block_size; i < std::min(num_points, (b+1)*random_block_size); i++) {
+                    random_keys[i] = block_random_generator.NextUInt();
+                }
+            }
+
+            if (random_mode_type == 0) {
+                // keep with probability 1/on_ratio
+                uint64_t threshold = (static_cast<uint64_t>(1) << 32) / on_ratio;
+                #pragma omp parallel for schedule(static, 1000) if (num_points > 5000)
+                for (int i = 0; i < num_points; i++) {
+                    keep[i] = (random_keys[i] < threshold) ? 1 : 0;
+                }
+            } else {
+                // keep points with smallest keys (ties broken by index)
+                int target_count = std::min(maximum_number_of_points, num_points / on_ratio);
+                std::vector<uint64_t> ranked_keys(num_points);
+                #pragma omp parallel for schedule(static, 1000) if (num_points > 5000)
+                for (int i = 0; i < num_points; i++) {
+                    ranked_keys[i] = (static_cast<uint64_t>(random_keys[i]) << 32) | static_cast<uint32_t>(i);
+                }
+                uint64_t threshold = 0;
+                if (target_count > 0) {
+                    std::nth_element(ranked_keys.begin(), ranked_keys.begin() + (target_count - 1), ranked_keys.end());
+                    threshold = ranked_keys[target_count - 1];
+                }
+                #pragma omp parallel for schedule(static, 1000) if (num_points > 5000)
+                for (int i = 0; i < num_points; i++) {
+                    uint64_t key = (static_cast<uint64_t>(random_keys[i]) << 32) | static_cast<uint32_t>(i);
+                    keep[i] = (target_count > 0 && key <= threshold) ? 1 : 0;
+                }
+            }
+        }
+
+        // compact, keeping at most maximum_number_of_points first points
+        std::vector<int> output_index(num_points);
+        int num_kept = exclusive_scan(keep.data(), output_index.data(), num_points);
+        num_kept = std::min(num_kept, maximum_number_of_points);
+
+        auto input_points = input_polydata->GetPoints();
+        auto output_points = vtkSmartPointer<vtkPoints>::New();
+        output_points->SetDataTypeToFloat();
+        output_points->SetNumberOfPoints(num_kept);
+
+        #pragma omp parallel for schedule(static, 1000) if (num_points > 5000)
+        for (int i = 0; i < num_points; i++) {
+            if (keep[i] && output_index[i] < num_kept) {
+                double p[3];
+                input_points->GetPoint(i, p);
+                output_points->SetPoint(output_index[i], p);
+            }
+        }
+
+        auto output = vtkSmartPointer<vtkPolyData>::New();
+        output->SetPoints(output_points);
+
+        // point data is compacted the same way
+        auto compact_array = [&](auto *arr_in, auto *arr_out) {
+            using T = typename std::remove_pointer_t<decltype(arr_in)>::ValueType;
+            int nc = arr_in->GetNumberOfComponents();
+            arr_out->SetName(arr_in->GetName());
+            arr_out->SetNumberOfComponents(nc);
+            arr_out->SetNumberOfTuples(num_kept);
+            const T *src = arr_in->GetPointer(0);
+            T *dst = arr_out->GetPointer(0);
+
+            #pragma omp parallel for schedule(static, 1000) if (num_points > 5000)
+            for (int i = 0; i < num_points; i++) {
+                if (keep[i] && output_index[i] < num_kept) {
+                    std::copy(src + (size_t)i*nc, src + (size_t)(i+1)*nc, dst + (size_t)output_index[i]*nc);
+                }
+            }
+        };
+
+        auto input_point_data = input_polydata->GetPointData();
+        auto output_point_data = output->GetPointData();
+        for (int k = 0; k < input_point_data->GetNumberOfArrays(); k++) {
+            vtkDataArray *arr = input_point_data->GetArray(k);
+            if (!arr || arr->GetNumberOfTuples() != num_points || !arr->GetName()) continue;
+
+            if (auto arr_float = vtkFloatArray::SafeDownCast(arr)) {
+                auto arr_out = vtkSmartPointer<vtkFloatArray>::New();
+                compact_array(arr_float, arr_out.Get());
+                output_point_data->AddArray(arr_out);
+            } else if (auto arr_double = vtkDoubleArray::SafeDownCast(arr)) {
+                auto arr_out = vtkSmartPointer<vtkDoubleArray>::New();
+                compact_array(arr_double, arr_out.Get());
+                output_point_data->AddArray(arr_out);
+            } else if (auto arr_int = vtkIntArray::SafeDownCast(arr)) {
+                auto arr_out = vtkSmartPointer<vtkIntArray>::New();
+                compact_array(arr_int, arr_out.Get());
+                output_point_data->AddArray(arr_out);
+            } else if (auto arr_uchar = vtkUnsignedCharArray::SafeDownCast(arr)) {
+                auto arr_out = vtkSmartPointer<vtkUnsignedCharArray>::New();
+                compact_array(arr_uchar, arr_out.Get());
+                output_point_data->AddArray(arr_out);
+            } else {
+                // other types through the generic interface
+                vtkSmartPointer<vtkDataArray> arr_out;
+                arr_out.TakeReference(arr->NewInstance());
+                arr_out->SetName(arr->GetName());
+                arr_out->SetNumberOfComponents(arr->GetNumberOfComponents());
+                arr_out->SetNumberOfTuples(num_kept);
+                for (int i = 0; i < num_points; i++) {
+                    if (keep[i] && output_index[i] < num_kept) {
+                        arr_out->SetTuple(output_index[i], i, arr);
+                    }
+                }
+                output_point_data->AddArray(arr_out);
+            }
+        }
+
+        output_polydata->ShallowCopy(output);
+        return kOfxStatOK;
+    }
 };
 
 // ----------------------------------------------------------------------------
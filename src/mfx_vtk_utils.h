@@ -25,6 +25,33 @@ THE SOFTWARE.
 
 #include <cmath>
 #include <array>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* Number of threads available to the next parallel region, and index of the calling thread in its region
+ * (1 and 0 when built without OpenMP). Meant for per-thread objects created before a parallel region.
+ * */
+static inline int max_thread_count() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+static inline int thread_index() {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
 
 static inline constexpr bool is_positive_double(double x) {
     return x >= DBL_EPSILON;
@@ -67,44 +94,256 @@ static inline constexpr void vec3_max(T x[3], const T y[3]) {
     }
 }
 
-// TODO improve, it's a bit too much dependent
+/* Exclusive prefix sum: out[i] = in[0] + ... + in[i-1], returns the total sum.
+ * This is the "scan" step of flag-scan-scatter compaction; in and out may be the same array.
+ * */
+template <typename T, typename U>
+static inline U exclusive_scan(const T *in, U *out, int count) {
+    if (count < 100000) {
+        U acc = 0;
+        for (int i = 0; i < count; i++) {
+            U x = in[i];
+            out[i] = acc;
+            acc += x;
+        }
+        return acc;
+    }
+
+    const int num_blocks = 64;
+    const int block_size = (count + num_blocks - 1) / num_blocks;
+    std::vector<U> block_sums(num_blocks + 1, 0);
+
+    #pragma omp parallel for schedule(static, 1)
+    for (int b = 0; b < num_blocks; b++) {
+        U acc = 0;
+        for (int i = b*block_size; i < std::min(count, (b+1)*block_size); i++) {
+            acc += in[i];
+        }
+        block_sums[b+1] = acc;
+    }
+
+    for (int b = 0; b < num_blocks; b++) {
+        block_sums[b+1] += block_sums[b];
+    }
+
+    #pragma omp parallel for schedule(static, 1)
+    for (int b = 0; b < num_blocks; b++) {
+        U acc = block_sums[b];
+        for (int i = b*block_size; i < std::min(count, (b+1)*block_size); i++) {
+            U x = in[i];
+            out[i] = acc;
+            acc += x;
+        }
+    }
+
+    return block_sums[num_blocks];
+}
+
+/* Stable LSD radix sort of keys by their lowest key_bits bits, values are permuted along with them.
+ * Like exclusive_scan(), the work is split into a fixed number of blocks, so that it is parallel
+ * and the result does not depend on number of threads.
+ * */
+template <typename V>
+static inline void radix_sort(std::vector<uint64_t> &keys, std::vector<V> &values, int key_bits) {
+    const int RADIX_BITS = 11;
+    const int NUM_BUCKETS = 1 << RADIX_BITS;
+    const int count = keys.size();
+    if (count < 2) {
+        return;
+    }
+
+    const int num_blocks = (count < 100000) ? 1 : 64;
+    const int block_size = (count + num_blocks - 1) / num_blocks;
+    std::vector<uint64_t> keys_tmp(count);
+    std::vector<V> values_tmp(count);
+    std::vector<int> offsets(num_blocks * NUM_BUCKETS); // per block, per bucket
+
+    for (int shift = 0; shift < key_bits; shift += RADIX_BITS) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+
+        #pragma omp parallel for schedule(static, 1) if (num_blocks > 1)
+        for (int b = 0; b < num_blocks; b++) {
+            int *block_histogram = &offsets[b * NUM_BUCKETS];
+            for (int i = b*block_size; i < std::min(count, (b+1)*block_size); i++) {
+                block_histogram[(keys[i] >> shift) & (NUM_BUCKETS - 1)]++;
+            }
+        }
+
+        // bucket d of block b goes after all smaller buckets and after bucket d of earlier blocks
+        int acc = 0;
+        for (int d = 0; d < NUM_BUCKETS; d++) {
+            for (int b = 0; b < num_blocks; b++) {
+                int x = offsets[b * NUM_BUCKETS + d];
+                offsets[b * NUM_BUCKETS + d] = acc;
+                acc += x;
+            }
+        }
+
+        #pragma omp parallel for schedule(static, 1) if (num_blocks > 1)
+        for (int b = 0; b < num_blocks; b++) {
+            int *block_offsets = &offsets[b * NUM_BUCKETS];
+            for (int i = b*block_size; i < std::min(count, (b+1)*block_size); i++) {
+                int j = block_offsets[(keys[i] >> shift) & (NUM_BUCKETS - 1)]++;
+                keys_tmp[j] = keys[i];
+                values_tmp[j] = values[i];
+            }
+        }
+
+        keys.swap(keys_tmp);
+        values.swap(values_tmp);
+    }
+}
+
+/* 64-bit FNV-1a hash of a buffer, taken over 8-byte words. Like exclusive_scan(), large buffers are split
+ * into a fixed number of blocks which are hashed in parallel and then combined, so the result does not
+ * depend on number of threads. Meant for telling whether cached results were computed from the same data.
+ * */
+static inline uint64_t hash_bytes(const void *data, size_t size) {
+    const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+    const uint64_t FNV_PRIME = 1099511628211ull;
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+
+    auto hash_range = [&](size_t begin, size_t end) -> uint64_t {
+        uint64_t h = FNV_OFFSET_BASIS;
+        size_t i = begin;
+        for (; i + 8 <= end; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, bytes + i, 8);
+            h = (h ^ word) * FNV_PRIME;
+        }
+        for (; i < end; i++) {
+            h = (h ^ bytes[i]) * FNV_PRIME;
+        }
+        return h;
+    };
+
+    if (size < (1 << 20)) {
+        return hash_range(0, size);
+    }
+
+    const int num_blocks = 64;
+    const size_t block_size = ((size + num_blocks - 1) / num_blocks + 7) & ~size_t(7);
+    uint64_t block_hashes[num_blocks];
+
+    #pragma omp parallel for schedule(static, 1)
+    for (int b = 0; b < num_blocks; b++) {
+        block_hashes[b] = hash_range(std::min(size, b*block_size), std::min(size, (b+1)*block_size));
+    }
+
+    uint64_t h = FNV_OFFSET_BASIS;
+    for (int b = 0; b < num_blocks; b++) {
+        h = (h ^ block_hashes[b]) * FNV_PRIME;
+    }
+    return h;
+}
+
+/* PCG32 random number generator [O'Neill 2014, PCG: A Family of Simple Fast Space-Efficient Statistically Good
+ * Algorithms for Random Number Generation]. Given seed and stream, the sequence is always the same, and Advance()
+ * jumps ahead in O(log n), so that parallel loops can start each block where a serial loop would be.
+ * */
+class PcgRandom {
+public:
+    explicit PcgRandom(uint64_t seed=0, uint64_t stream=0) {
+        state = 0;
+        increment = (stream << 1u) | 1u;
+        NextUInt();
+        state += seed;
+        NextUInt();
+    }
+
+    uint32_t NextUInt() {
+        uint64_t old_state = state;
+        state = old_state * MULTIPLIER + increment;
+        uint32_t xorshifted = static_cast<uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+        uint32_t rot = static_cast<uint32_t>(old_state >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31u));
+    }
+
+    // uniform in [0, 1)
+    double NextValue() {
+        return NextUInt() * (1.0 / 4294967296.0);
+    }
+
+    double NextRangeValue(double low, double high) {
+        return (NextValue() * (high - low)) + low;
+    }
+
+    // same as calling NextUInt() delta times
+    void Advance(uint64_t delta) {
+        uint64_t current_multiplier = MULTIPLIER, current_increment = increment;
+        uint64_t accumulated_multiplier = 1, accumulated_increment = 0;
+        while (delta > 0) {
+            if (delta & 1u) {
+                accumulated_multiplier *= current_multiplier;
+                accumulated_increment = accumulated_increment * current_multiplier + current_increment;
+            }
+            current_increment = (current_multiplier + 1) * current_increment;
+            current_multiplier *= current_multiplier;
+            delta /= 2;
+        }
+        state = accumulated_multiplier * state + accumulated_increment;
+    }
+
+protected:
+    static constexpr uint64_t MULTIPLIER = 6364136223846793005ull;
+    uint64_t state;
+    uint64_t increment;
+};
+
+/* Additive recurrence (Kronecker sequence) with square roots of primes - quasi-random, low discrepancy.
+ * Values are computed in 0.64 fixed point, so the value at any index is available directly (GetValueAt())
+ * and is the same whichever order the sequence is evaluated in. Non-zero seed rotates the sequence
+ * by a random offset in each dimension.
+ * */
 template <int N>
 class AdditiveRecurrence {
 public:
-    AdditiveRecurrence() {
+    explicit AdditiveRecurrence(uint64_t seed=0) {
+        PcgRandom random_generator(seed);
         for (int i = 0; i < N; i++) {
-            s[i] = 0.0;
+            offset[i] = (seed != 0) ? (static_cast<uint64_t>(random_generator.NextUInt()) << 32) | random_generator.NextUInt() : 0;
         }
-        Next();
+        index = 1;
     }
 
     double GetValue(int i) const {
-        return s[i];
+        return GetValueAt(index, i);
     }
 
     double GetRangeValue(int i, double low, double high) const {
         return (GetValue(i) * (high - low)) + low;
     }
 
-    void Next() {
-        const double alpha[8] = {
-                1.4142135623730951, // sqrt(2)
-                1.7320508075688772, // sqrt(3)
-                2.2360679774997898, // sqrt(5)
-                2.6457513110645907, // sqrt(7)
-                3.3166247903553998, // sqrt(11)
-                3.6055512754639891, // sqrt(13)
-                4.1231056256176606, // sqrt(17)
-                4.3588989435406740, // sqrt(19)
+    // (index * alpha_i + offset_i) mod 1
+    double GetValueAt(uint64_t k, int i) const {
+        const uint64_t alpha[8] = {
+                0x6a09e667f3bcc908ull, // fract(sqrt(2))
+                0xbb67ae8584caa73bull, // fract(sqrt(3))
+                0x3c6ef372fe94f82bull, // fract(sqrt(5))
+                0xa54ff53a5f1d36f1ull, // fract(sqrt(7))
+                0x510e527fade682d1ull, // fract(sqrt(11))
+                0x9b05688c2b3e6c1full, // fract(sqrt(13))
+                0x1f83d9abfb41bd6bull, // fract(sqrt(17))
+                0x5be0cd19137e2179ull, // fract(sqrt(19))
         };
+        uint64_t x = k * alpha[i] + offset[i]; // wraps around, ie. mod 1
+        return (x >> 11) * (1.0 / 9007199254740992.0); // top 53 bits
+    }
 
-        double dummy;
-        for (int i = 0; i < N; i++) {
-            s[i] = modf(alpha[i] + s[i], &dummy); // (s_i * alpha_i) mod 1
-        }
+    double GetRangeValueAt(uint64_t k, int i, double low, double high) const {
+        return (GetValueAt(k, i) * (high - low)) + low;
+    }
+
+    uint64_t GetIndex() const {
+        return index;
+    }
+
+    void Next() {
+        index++;
     }
 
 protected:
-    double s[N];
+    uint64_t index;
+    uint64_t offset[N];
     static_assert(N > 0 && N < 8, "wrong dimension");
 };